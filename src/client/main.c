@@ -1,6 +1,8 @@
 #define _GNU_SOURCE
 #include "lib/client.h"
+#include "shared/proto.h"
 #include "shared/log.h"
+#include "shared/util.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -141,12 +143,12 @@ static int cmd_attach (struct nd_client *client, char **argv)
         return -1;
     }
 
-    // attach to it
-    if ((err = nd_attach(client, argv[0])))
+    // attach to it, replaying output from the given offset
+    if ((err = nd_attach_offset(client, argv[0], argv[1] ? strtoull(argv[1], NULL, 0) : 0)))
         return err;
 
     if (nd_process_running(client)) {
-        log_info("Attached to process: %s", nd_process_id(client));
+        log_info("Attached to process: %s at offset %llu", nd_process_id(client), (unsigned long long) nd_output_offset(client));
 
         // stream
         if (run_process(client))
@@ -205,8 +207,8 @@ static int cmd_kill (struct nd_client *client, char **argv)
         return -1;
     }
 
-    // attach
-    if ((err = nd_attach(client, argv[0])))
+    // attach, without replaying any output
+    if ((err = nd_attach_offset(client, argv[0], ND_OFFSET_END)))
         return err;
 
     // yay
@@ -341,6 +343,8 @@ static const struct option options[] = {
     { "verbose",    false,  NULL,   'v' },
     { "debug",      false,  NULL,   'D' },
     { "unix",       true,   NULL,   'u' },
+    { "tcp",        true,   NULL,   't' },
+    { "caps",       true,   NULL,   'C' },
     { 0,            0,      0,      0   }
 };
 
@@ -358,13 +362,16 @@ void help (const char *argv0)
         "\t-v, --verbose        display more informational output\n"
         "\t-d, --debug          equivalent to -v\n"
         "\t-u, --unix=PATH      connect using the given UNIX socket\n"
+        "\t-t, --tcp=[HOST:]PORT\n"
+        "\t                     connect using TCP, instead of a UNIX socket\n"
+        "\t-C, --caps=NAME,...  request only the given protocol features: lz, large, native, ring, all, none\n"
         "\n"
         "Commands available:\n"
         "\tstart -- <exec_path> [<arg> [...]]\n"
         "\t\tSpawn a new process from the given executable and arguments, attaching to it\n"
         "\n"
-        "\tattach <id>\n"
-        "\t\tAttach to the pre-existing process with the given ID\n"
+        "\tattach <id> [<offset>]\n"
+        "\t\tAttach to the pre-existing process with the given ID, replaying its recent output from the given offset\n"
         "\n"
         "\tlist\n"
         "\t\tQuery for and display a listing of processes on the daemon\n"
@@ -388,9 +395,10 @@ void help (const char *argv0)
 }
 
 /**
- * Construct a nd_client and connect to the given unix socket
+ * Construct a nd_client and connect to the given TCP host and port if given, or the given unix socket, requesting the
+ * given protocol features
  */
-int setup_client (struct nd_client **client_ptr, const char *unix_path)
+int setup_client (struct nd_client **client_ptr, const char *unix_path, const char *tcp_host, const char *tcp_port, enum proto_caps caps)
 {
     struct nd_client *client = NULL;
 
@@ -402,17 +410,28 @@ int setup_client (struct nd_client **client_ptr, const char *unix_path)
     }
     
     // connect
-    if (nd_open_unix(client, unix_path) < 0) {
-        log_errno("nd_open_unix: %s", unix_path);
+    if (tcp_port) {
+        if (nd_open_tcp(client, tcp_host, tcp_port) < 0) {
+            log_errno("nd_open_tcp: %s:%s", tcp_host ? tcp_host : "localhost", tcp_port);
 
-        goto error;
-    }
+            goto error;
+        }
+
+        log_info("Connected to TCP port: %s:%s", tcp_host ? tcp_host : "localhost", tcp_port);
 
-    log_info("Connected to UNIX socket: %s", unix_path) ;
+    } else {
+        if (nd_open_unix(client, unix_path) < 0) {
+            log_errno("nd_open_unix: %s", unix_path);
+
+            goto error;
+        }
+
+        log_info("Connected to UNIX socket: %s", unix_path) ;
+    }
 
     // greet
-    if (nd_cmd_hello(client) < 0) {
-        log_errno("nd_cmd_hello");
+    if (nd_set_caps(client, caps) < 0 || nd_hello(client) < 0) {
+        log_errno("nd_hello");
 
         goto error;
     }
@@ -451,9 +470,11 @@ int main (int argc, char **argv)
 {
     int opt;
     const char *unix_path = NULL;
+    const char *tcp_host = NULL, *tcp_port = NULL;
+    enum proto_caps caps = PROTO_CAPS;
     
     // parse arguments
-    while ((opt = getopt_long(argc, argv, "hqvDu:", options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hqvDu:t:C:", options, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 // display help
@@ -480,6 +501,20 @@ int main (int argc, char **argv)
 
                 break;
 
+            case 't':
+                // connect to tcp service
+                if (parse_host_port(optarg, &tcp_host, &tcp_port))
+                    EXIT_WARN(EXIT_FAILURE, "Invalid TCP address: %s", optarg);
+
+                break;
+
+            case 'C':
+                // protocol features
+                if (proto_caps_parse(optarg, &caps))
+                    EXIT_WARN(EXIT_FAILURE, "Invalid protocol features: %s", optarg);
+
+                break;
+
             case '?':
                 // useage error
                 help(argv[0]);
@@ -493,8 +528,8 @@ int main (int argc, char **argv)
     }
 
     // validate
-    if (!unix_path)
-        EXIT_WARN(EXIT_FAILURE, "No service (--unix) given");
+    if (!unix_path && !tcp_port)
+        EXIT_WARN(EXIT_FAILURE, "No service (--unix or --tcp) given");
 
     if (!argv[optind]) {
         // no command given
@@ -506,7 +541,7 @@ int main (int argc, char **argv)
     struct nd_client *client;
     
     // setup client state and connect
-    if (setup_client(&client, unix_path))
+    if (setup_client(&client, unix_path, tcp_host, tcp_port, caps))
         EXIT_ERROR(EXIT_FAILURE, "setup_client");
 
     // run as commanded
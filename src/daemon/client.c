@@ -3,6 +3,7 @@
 #include "commands.h"
 #include "shared/log.h"
 #include "shared/proto.h"
+#include "shared/ring.h"
 #include "shared/util.h"
 
 #include <stdlib.h>
@@ -19,30 +20,283 @@ static int client_sock (struct client *client)
 }
 
 /**
- * Send the given proto_msg to this client
+ * Are messages sent and received using the rings, now that the client has them?
+ */
+static bool client_ring_active (struct client *client)
+{
+    return client->ring && client->ring_memfd < 0;
+}
+
+/**
+ * Are there requests already read from the socket that have not been handled yet?
+ */
+static bool client_pending (struct client *client)
+{
+    return client->pending || (client->stream && proto_stream_pending(client->stream));
+}
+
+/**
+ * Update our read interest, which is paused while suspended or blocked
+ */
+static int client_update_read (struct client *client)
+{
+    bool reading = !client->suspended && !client->blocked;
+
+    // the socket may already be drained, and the client only wakes us up via the rings once we have waited for it
+    if (reading && (client_pending(client) || client_ring_active(client)))
+        select_loop_defer(client->shard->select_loop, &client->dispatch);
+
+    return select_want_read(&client->fd, reading);
+}
+
+/**
+ * Queue above high watermark, pause our reads and the attached process's output
+ */
+static int client_block (struct client *client)
+{
+    log_debug("[%p] Blocked with %zu bytes queued", client, client->queue_size);
+
+    client->blocked = true;
+
+    if (client->process)
+        process_output_pause(client->process);
+
+    return client_update_read(client);
+}
+
+/**
+ * Queue drained below low watermark, resume our reads and the attached process's output
+ */
+static int client_unblock (struct client *client)
+{
+    log_debug("[%p] Unblocked with %zu bytes queued", client, client->queue_size);
+
+    client->blocked = false;
+
+    if (client->process)
+        process_output_resume(client->process);
+
+    return client_update_read(client);
+}
+
+/**
+ * Wait for the socket to become writable, unless using the rings, where the client wakes us up once it has made room
+ */
+static int client_want_write (struct client *client, bool want_write)
+{
+    return select_want_write(&client->fd, want_write && !client_ring_active(client));
+}
+
+/**
+ * Append a reference to the given frame to the outbound queue, and wait for the socket to become writable
+ */
+static int client_queue (struct client *client, struct proto_frame *frame)
+{
+    struct daemon_options *options = &client->daemon->options;
+    struct client_msg *msg;
+
+    if (client->queue_size + frame->len > options->client_queue_max) {
+        // give up on this client
+        errno = ENOBUFS;
+
+        return -1;
+    }
+
+    if ((msg = malloc(sizeof(*msg))) == NULL)
+        return -1;
+
+    msg->frame = proto_frame_ref(frame);
+
+    TAILQ_INSERT_TAIL(&client->queue, msg, client_queue);
+    client->queue_size += frame->len;
+
+    if (!client->blocked && client->queue_size >= options->client_queue_high && client_block(client))
+        return -1;
+
+    return client_want_write(client, true);
+}
+
+/**
+ * Pass the rings to the client along with the given message, and start using them for everything that follows
+ */
+static int client_ring_start (struct client *client, const char *buf, size_t len)
+{
+    int fds[RING_LINK_FDS] = { client->ring_memfd, client->ring->wake_fd, client->ring_fd.fd };
+
+    if (proto_send_fds_seqpacket(client_sock(client), buf, len, fds, RING_LINK_FDS))
+        return -1;
+
+    // the mapping is all we need
+    close(client->ring_memfd);
+    client->ring_memfd = -1;
+
+    log_info("[%p] Using shared memory rings", client);
+
+    // the client wakes us up for requests, and once it has made room for more
+    return select_loop_add(client->shard->select_loop, &client->ring_fd);
+}
+
+/**
+ * Send the given encoded message directly on the socket or rings, framed for our transport. On streams, this
+ * continues from the send_offset left by any previous partial send.
+ *
+ * Fails with EAGAIN if the socket or ring is full, which may leave a stream with the message partially sent.
+ */
+static int client_write (struct client *client, const char *buf, size_t len)
+{
+    if (client_ring_active(client))
+        return ring_write(&client->ring->tx, buf, len);
+    else if (client->ring)
+        return client_ring_start(client, buf, len);
+    else if (client->stream)
+        return proto_send_stream(client_sock(client), buf, len, &client->send_offset);
+    else
+        return proto_send_buf_seqpacket(client_sock(client), buf, len);
+}
+
+/**
+ * Send as much of the outbound queue as the socket will take
+ */
+static int client_flush (struct client *client)
+{
+    struct client_msg *msg;
+
+    while ((msg = TAILQ_FIRST(&client->queue)) != NULL) {
+        if (client_write(client, msg->frame->buf, msg->frame->len)) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                // wait for more room
+                return 0;
+
+            return -1;
+        }
+
+        TAILQ_REMOVE(&client->queue, msg, client_queue);
+        client->queue_size -= msg->frame->len;
+
+        proto_frame_unref(msg->frame);
+        free(msg);
+
+        if (client->blocked && client->queue_size <= client->daemon->options.client_queue_low && client_unblock(client))
+            return -1;
+    }
+
+    // all sent
+    return client_want_write(client, false);
+}
+
+/**
+ * Send the given proto_msg to this client, or queue a copy of it if the socket is not writable
  */
 static int client_send (struct client *client, struct proto_msg *msg)
 {
-    return proto_send_seqpacket(client_sock(client), msg);
+    struct proto_frame *frame;
+    int err;
+
+    if (TAILQ_EMPTY(&client->queue)) {
+        // try sending directly
+        if (client_write(client, msg->buf, msg->offset) == 0)
+            return 0;
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+    }
+
+    // keep ordering behind anything already queued, or send the rest of it later
+    if ((frame = proto_frame_copy(msg)) == NULL)
+        return -1;
+
+    err = client_queue(client, frame);
+
+    proto_frame_unref(frame);
+
+    return err;
+}
+
+/**
+ * Send the given shared frame to this client, or queue a reference to it if the socket is not writable
+ */
+static int client_send_frame (struct client *client, struct proto_frame *frame)
+{
+    if (TAILQ_EMPTY(&client->queue)) {
+        // try sending directly
+        if (client_write(client, frame->buf, frame->len) == 0)
+            return 0;
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+    }
+
+    // keep ordering behind anything already queued, or send the rest of it later
+    return client_queue(client, frame);
+}
+
+/**
+ * Release the client state, once the select loop is done with it
+ */
+static void client_release (void *arg)
+{
+    struct client *client = arg;
+    struct client_msg *msg;
+
+    // anything still unsent is lost
+    while ((msg = TAILQ_FIRST(&client->queue)) != NULL) {
+        TAILQ_REMOVE(&client->queue, msg, client_queue);
+
+        proto_frame_unref(msg->frame);
+        free(msg);
+    }
+
+    // as are any requests not handled yet
+    if (client->pending)
+        proto_batch_free(client->pending);
+
+    if (client->stream)
+        proto_stream_free(client->stream);
+
+    if (client->ring) {
+        ring_link_close(client->ring);
+        free(client->ring);
+    }
+
+    if (client->ring_memfd >= 0)
+        close(client->ring_memfd);
+
+    free(client);
 }
 
 /**
- * Destroy the given client, releasing any resources
+ * Destroy the given client, releasing any resources.
+ *
+ * This is safe to call from within the select loop; the client state itself is released at the end of the loop run.
  */
 void client_destroy (struct client *client)
 {
-    // remove from select loop if added
-    select_loop_del(&client->daemon->select_loop, &client->fd);
-    
-    // release the socket
-    close(client_sock(client));
+    // remove from select loop if added, and release the socket and our end of the rings
+    select_loop_close(client->shard->select_loop, &client->fd);
+    select_loop_close(client->shard->select_loop, &client->ring_fd);
+    select_timer_cancel(client->shard->select_loop, &client->migrate_timer);
 
     // detach from process if attached
-    if (client->process)
+    if (client->process) {
+        if (client->blocked)
+            process_output_resume(client->process);
+
         process_detach(client->process, client);
 
+        client->process = NULL;
+    }
+
+    // forget about any process being spawned for us
+    if (client->spawning) {
+        client->spawning->spawn_client = NULL;
+        client->spawning = NULL;
+    }
+
+    free(client->migrate_process_id);
+    client->migrate_process_id = NULL;
+
     // release state
-    free(client);
+    select_loop_defer(client->shard->select_loop, &client->release);
 }
 
 /**
@@ -52,34 +306,54 @@ static void client_disconnected (struct client *client)
 {
     log_info("[%p] Disconnected", client);
 
-    // XXX: breaks socket_loop_run
     client_destroy(client);
 }
 
 
 /**
- * Fatal client error. Attempt to send a terminal error packet, and close the connection
+ * Initialize the given msg for a command sent to the client, in the byte order agreed upon in the handshake
+ */
+static int client_cmd_init (struct client *client, struct proto_msg *msg, char *buf, size_t len, uint32_t id, enum proto_cmd cmd)
+{
+    if (proto_msg_init(msg, buf, len))
+        return -1;
+
+    msg->native = client->caps & PROTO_CAP_NATIVE;
+
+    return proto_cmd_start(msg, id, cmd);
+}
+
+/**
+ * Fatal client error. Attempt to send a terminal error packet, ahead of anything still queued
  */
 static void client_abort (struct client *client, int error)
 {
     char buf[512];
     struct proto_msg msg;
+    struct proto_error fields = { .err_code = error };
 
     log_warn("[%p] Terminate: %s", client, strerror(error));
 
     // build CMD_ABORT packet
-    if (proto_cmd_init(&msg, buf, sizeof(buf), CMD_ABORT, 0))
+    if (client_cmd_init(client, &msg, buf, sizeof(buf), 0, CMD_ABORT))
         goto error;
 
     // add fields
     if (
-            proto_write_int32(&msg, error)
+            proto_encode_error(&msg, &fields)
         ||  proto_write_str(&msg, strerror(error))
     )
         goto error;
 
+    if (client->send_offset) {
+        // can't interrupt a partially sent message
+        errno = EBUSY;
+
+        goto error;
+    }
+
     // send
-    if (client_send(client, &msg))
+    if (client_write(client, msg.buf, msg.offset))
         goto error;
     
     // ok
@@ -90,6 +364,15 @@ error:
     log_warn_errno("[%p] Unable to send CMD_ABORT", client);
 }
 
+/**
+ * Unable to send to the client from outside of its own handlers, so abort and disconnect it
+ */
+static void client_error (struct client *client, int error)
+{
+    client_abort(client, error);
+    client_destroy(client);
+}
+
 /**
  * Reply to the given command message with the given reply code, using either CMD_OK or CMD_ERROR.
  */
@@ -98,6 +381,7 @@ static int client_reply (struct client *client, struct proto_msg *req, int error
     // XXX: use reply-buf from client_on_msg instead?
     char buf[512];
     struct proto_msg msg;
+    struct proto_error fields = { .err_code = error };
 
     if (error)
         log_warn("[%p] Soft error: %s", client, strerror(error));
@@ -112,7 +396,7 @@ static int client_reply (struct client *client, struct proto_msg *req, int error
 
     // write reply
     if (error && (
-            proto_write_int32(&msg, error)
+            proto_encode_error(&msg, &fields)
         ||  proto_write_str(&msg, strerror(error))
     ))
         return -1;
@@ -126,30 +410,61 @@ static int client_reply (struct client *client, struct proto_msg *req, int error
 }
 
 /**
- * Send a CMD_DATA packet to the client
+ * Stop reading any further requests from the client, deferring the reply to the given request until client_resume
  */
-static int client_cmd_data (struct client *client, enum proto_channel channel, const char *buf, size_t len)
+static int client_suspend (struct client *client, struct proto_msg *req)
 {
-    struct proto_msg msg;
-    char msg_buf[ND_PROTO_MSG_MAX];
+    client->suspended = true;
 
-    // prep CMD_DATA
-    if (proto_cmd_init(&msg, msg_buf, sizeof(msg_buf), 0, CMD_DATA))
-        return -1;
+    // only the id and byte order are needed for the reply
+    proto_msg_init(&client->suspended_req, NULL, 0);
 
-    // write packet
-    if (
-            proto_write_uint16(&msg, channel)
-        ||  proto_write_buf(&msg, buf, len)
-    )
-        return -1;
+    client->suspended_req.id = req->id;
+    client->suspended_req.cmd = req->cmd;
+    client->suspended_req.native = req->native;
 
-    // send
-    if (client_send(client, &msg))
-        return -1;
+    return client_update_read(client);
+}
 
-    // ok
-    return 0;
+/**
+ * Send the given reply to the suspended request, or a CMD_OK/CMD_ERROR reply with the given error if NULL, and resume
+ * reading requests.
+ *
+ * The client is disconnected on errors.
+ */
+static void client_resume (struct client *client, struct proto_msg *reply, int error)
+{
+    client->suspended = false;
+
+    if (reply ? client_send(client, reply) : client_reply(client, &client->suspended_req, error))
+        goto error;
+
+    if (client_update_read(client))
+        goto error;
+
+    return;
+
+error:
+    log_warn_errno("[%p] Unable to resume", client);
+
+    client_destroy(client);
+}
+
+/**
+ * Replay the attached process's output, once the CMD_ATTACHED reply has been sent
+ */
+static int client_replay (struct client *client)
+{
+    if (!client->replay)
+        return 0;
+
+    client->replay = false;
+
+    if (!client->process)
+        // dropped while sending the reply
+        return 0;
+
+    return process_replay(client->process, client, client->replay_offset);
 }
 
 /**
@@ -158,17 +473,15 @@ static int client_cmd_data (struct client *client, enum proto_channel channel, c
 static int client_cmd_status (struct client *client, enum proto_process_status status, int code)
 {
     struct proto_msg msg;
-    char msg_buf[ND_PROTO_MSG_MAX];
+    char msg_buf[512];
+    struct proto_status fields = { .status = status, .code = code };
 
     // prep CMD_STATUS
-    if (proto_cmd_init(&msg, msg_buf, sizeof(msg_buf), 0, CMD_STATUS))
+    if (client_cmd_init(client, &msg, msg_buf, sizeof(msg_buf), 0, CMD_STATUS))
         return -1;
 
     // write packet
-    if (
-            proto_write_uint16(&msg, status)
-        ||  proto_write_uint16(&msg, code)
-    )
+    if (proto_encode_status(&msg, &fields))
         return -1;
 
     // send
@@ -184,14 +497,19 @@ static int client_cmd_status (struct client *client, enum proto_process_status s
  */
 static int client_cmd_dispatch (struct client *client, struct proto_msg *request, struct proto_msg *reply)
 {
+    const struct proto_cmd_handler *handler = proto_cmd_lookup(&daemon_command_handlers, request->cmd);
     int err;
 
     // check protocol state
-    if (!client->version && request->cmd != CMD_HELLO)
+    if (!client->version && !(handler && handler->flags & PROTO_CMD_BEFORE_HELLO))
         return EBADMSG;
 
-    // dispatch to handlers
-    if ((err = proto_cmd_dispatch(daemon_command_handlers, request, reply, client)) < 0)
+    // unknown command
+    if (!handler)
+        return -1;
+
+    // dispatch to handler
+    if ((err = proto_cmd_call(handler, request, reply, client)) < 0)
         return -1;
 
     // ok
@@ -208,14 +526,15 @@ static int client_cmd_dispatch (struct client *client, struct proto_msg *request
 static int client_on_msg (struct client *client, struct proto_msg *request)
 {
     struct proto_msg reply;
-    char buf[ND_PROTO_MSG_MAX];
     int err;
 
-    // prep reply packet
-    if (proto_msg_init(&reply, buf, sizeof(buf)))
+    // prep reply packet, which is either sent or copied into our queue before returning
+    if (proto_msg_init(&reply, client->shard->reply_buf, ND_PROTO_MSG_MAX))
         goto error;
 
-    // parse command
+    // parse command, in the byte order agreed upon in the handshake
+    request->native = client->caps & PROTO_CAP_NATIVE;
+
     if (proto_cmd_parse(request))
         goto error;
 
@@ -224,6 +543,10 @@ static int client_on_msg (struct client *client, struct proto_msg *request)
         // system error
         goto error;
 
+    else if (client->suspended)
+        // reply is sent later
+        err = 0;
+
     else if (reply.cmd)
         // send reply packet
         err = client_send(client, &reply);
@@ -232,6 +555,10 @@ static int client_on_msg (struct client *client, struct proto_msg *request)
         // generic reply; err=0 -> success, or err>0 -> non-fatal error reply
         err = client_reply(client, request, err);
 
+    // followed by any replay
+    if (!err && client_replay(client))
+        goto error;
+
     // ok
     return err;
 
@@ -243,119 +570,575 @@ error:
 }
 
 /**
- * Callback for readable SOCK_SEQPACKET socket
+ * Handle the received requests in order, until the client is suspended or blocked.
+ *
+ * Returns 1 if there are requests left in the batch for once the client is reading again.
  */
-static int client_on_read_seqpacket (int fd, short what, void *arg)
+static int client_dispatch (struct client *client, struct proto_batch *batch)
 {
-    struct client *client = arg;
-    struct proto_msg msg;    
-    char buf[ND_PROTO_MSG_MAX];
-
-    // XXX: recv more than one packet!
-    // init msg
-    if (proto_msg_init(&msg, buf, sizeof(buf)))
-        goto error;
+    struct proto_msg *msg;
 
-    // recv
-    if (proto_recv_seqpacket(fd, &msg))
-        goto error;
-
-    // handle message
-    if (client_on_msg(client, &msg))
-        goto error;
+    while (!client->suspended && !client->blocked) {
+        if (!(msg = proto_batch_next(batch)))
+            return 0;
 
-    // ok
-    return 0;
+        if (client_on_msg(client, msg))
+            return -1;
+    }
 
-error:
-    // disconnect client
-    client_disconnected(client);
-    
-    // client is now disconnected, we dealt with the error
-    // XXX: how safely return to select_loop?
-    return 0;
+    return proto_batch_pending(batch);
 }
 
-int client_add_seqpacket (struct daemon *daemon, int sock)
+/**
+ * Handle any requests left over from a previous read.
+ *
+ * Returns 1 if there are still requests left.
+ */
+static int client_dispatch_pending (struct client *client)
 {
-    struct client *client;
-
-    // alloc
-    if ((client = calloc(1, sizeof(*client))) == NULL)
-        return -1; // ENOMEM
-
-    // init
-    client->daemon = daemon;
+    int ret;
 
-    // set state
-    if (fd_flags(sock, O_NONBLOCK|O_CLOEXEC))
-        return -1;
+    if (!client->pending)
+        return 0;
 
-    // init fd state
-    select_fd_init(&client->fd, sock, FD_READ, client_on_read_seqpacket, client);
+    if ((ret = client_dispatch(client, client->pending)))
+        return ret;
 
-    // activate
-    select_loop_add(&daemon->select_loop, &client->fd);
+    proto_batch_free(client->pending);
+    client->pending = NULL;
 
     return 0;
 }
 
-void client_on_process_data (struct process *process, enum proto_channel channel, const char *buf, size_t len, void *ctx)
+/**
+ * Handle the requests received on the stream in order, until the client is suspended or blocked.
+ *
+ * Returns 1 if there are complete requests left for once the client is reading again.
+ */
+static int client_dispatch_stream (struct client *client)
 {
-    struct client *client = ctx;
+    struct proto_msg *msg;
 
-    log_debug("[%p] Got data on %d from process [%p]: %.*s", client, channel, process, (int) len, buf);
-    
-    // send packet
-    if (client_cmd_data(client, channel, buf, len))
-        client_abort(client, errno);
-}
+    while (!client->suspended && !client->blocked) {
+        if (!(msg = proto_stream_next(client->stream)))
+            return 0;
 
-void client_on_process_eof (struct process *process, enum proto_channel channel, void *ctx)
-{
-    struct client *client = ctx;
+        if (client_on_msg(client, msg))
+            return -1;
+    }
 
-    log_debug("[%p] Got EOF on %d from process [%p]", client, channel, process);
-    
-    // send packet
-    if (client_cmd_data(client, channel, "", 0))
-        client_abort(client, errno);
+    return proto_stream_pending(client->stream);
 }
 
-void client_on_process_status (struct process *process, enum proto_process_status status, int code, void *ctx)
+/**
+ * Fill the batch with the messages received by the loop's SELECT_OP_RECV, as per proto_recv_batch.
+ *
+ * The messages remain in the loop's buffers until the end of the loop run.
+ */
+static int client_recv_batch (struct client *client, struct proto_batch *batch)
 {
-    struct client *client = ctx;
-    
-    log_debug("[%p] Got status from process [%p]: %d:%d", client, process, status, code);
+    ssize_t len;
+    char *buf;
 
-    // send
-    if (client_cmd_status(client, status, code))
-        client_abort(client, errno);
-}
+    proto_batch_reset(batch);
 
-int client_on_cmd_data (struct client *client, enum proto_channel channel, const char *buf, size_t len)
-{
-    assert(client->process);
+    while (!proto_batch_full(batch)) {
+        if ((len = select_recv(&client->fd, &buf)) < 0) {
+            if (errno == EAGAIN)
+                break;
 
-    switch (channel) {
-        case CHANNEL_STDIN:
+            return -1;
+
+        } else if (len == 0) {
+            // EOF, handle whatever came before it first
+            break;
+        }
+
+        if (proto_batch_push(batch, buf, len))
+            return -1;
+    }
+
+    if (proto_batch_pending(batch))
+        return 0;
+
+    if (len == 0)
+        // EOF
+        errno = EINVAL;
+
+    return -1;
+}
+
+/**
+ * Feed the data received by the loop's SELECT_OP_RECV into the stream, as per proto_recv_stream.
+ */
+static int client_recv_stream (struct client *client)
+{
+    bool received = false;
+    ssize_t len;
+    char *buf;
+
+    while ((len = select_recv(&client->fd, &buf)) > 0) {
+        if (proto_stream_feed(client->stream, buf, len))
+            return -1;
+
+        received = true;
+    }
+
+    if (received)
+        return 0;
+
+    if (len == 0)
+        // EOF
+        errno = EINVAL;
+
+    return -1;
+}
+
+/**
+ * Move any requests received by the loop's SELECT_OP_RECV into the client's own state, before leaving the loop
+ */
+static int client_recv_take (struct client *client)
+{
+    struct proto_batch *pending;
+    ssize_t len;
+    char *buf;
+
+    while ((len = select_recv(&client->fd, &buf)) > 0) {
+        if (client->stream) {
+            if (proto_stream_feed(client->stream, buf, len))
+                return -1;
+
+        } else if ((pending = proto_batch_append(client->pending, buf, len)) == NULL) {
+            return -1;
+
+        } else {
+            client->pending = pending;
+        }
+    }
+
+    // any EOF or error will be seen again once reading on the next loop
+    return 0;
+}
+
+/**
+ * Read and handle requests from a SOCK_SEQPACKET socket
+ */
+static int client_read_seqpacket (struct client *client)
+{
+    struct proto_batch *batch = client->shard->recv;
+    int ret;
+
+    // finish handling the previous read first
+    if ((ret = client_dispatch_pending(client)) < 0)
+        return -1;
+    else if (ret || client->suspended || client->blocked)
+        return 0;
+
+    if (select_fd_op_active(&client->fd)) {
+        // take the messages already received by the loop
+        if (client_recv_batch(client, batch)) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                // spurious
+                return 0;
+
+            return -1;
+        }
+
+    // recv into the shard's buffers
+    } else if (proto_recv_batch(client_sock(client), batch)) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            // spurious
+            return 0;
+
+        return -1;
+    }
+
+    // handle messages
+    if ((ret = client_dispatch(client, batch)) < 0)
+        return -1;
+
+    // keep a copy of the rest for once we are reading again, as the shard's buffers are reused for the next read
+    if (ret && (client->pending = proto_batch_take(batch)) == NULL)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Read and handle requests from a SOCK_STREAM socket
+ */
+static int client_read_stream (struct client *client)
+{
+    int ret;
+
+    // finish handling the previous read first
+    if ((ret = client_dispatch_stream(client)) < 0)
+        return -1;
+    else if (ret || client->suspended || client->blocked)
+        return 0;
+
+    // read into the stream, which keeps any partial request for the next read
+    if (select_fd_op_active(&client->fd) ? client_recv_stream(client) : proto_recv_stream(client_sock(client), client->stream)) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            // spurious
+            return 0;
+
+        return -1;
+    }
+
+    // handle complete messages
+    if (client_dispatch_stream(client) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Callback for readable/writable socket
+ */
+static int client_on_sock (int fd, short what, void *arg)
+{
+    struct client *client = arg;
+
+    if (what & FD_WRITE) {
+        // send queued messages
+        if (client_flush(client))
+            goto error;
+
+        return 0;
+    }
+
+    if (client->stream ? client_read_stream(client) : client_read_seqpacket(client))
+        goto error;
+
+    // ok
+    return 0;
+
+error:
+    // disconnect client
+    client_disconnected(client);
+    
+    // client is now disconnected, we dealt with the error
+    return 0;
+}
+
+/**
+ * Read and handle requests from the rings, until the client is suspended or blocked.
+ *
+ * Each request is copied out of the shared memory before being handled, so that the client cannot modify it from under
+ * us, and its room in the ring is released right away.
+ */
+static int client_read_ring (struct client *client)
+{
+    struct shard *shard = client->shard;
+    size_t size = (client->caps & PROTO_CAP_LARGE) ? RING_MSG_MAX : ND_PROTO_MSG_MAX;
+    struct proto_msg msg;
+    size_t len;
+    int ret;
+
+    if (!shard->ring_buf && (errno = posix_memalign((void **) &shard->ring_buf, PROTO_BUF_ALIGN, RING_MSG_MAX)))
+        return -1;
+
+    while (!client->suspended && !client->blocked) {
+        if ((ret = ring_read(&client->ring->rx, shard->ring_buf, size, &len)) < 0)
+            return -1;
+
+        if (!ret) {
+            if (ring_idle(&client->ring->rx))
+                // wait for the client to wake us up
+                return 0;
+
+            // raced with the client
+            continue;
+        }
+
+        if (proto_msg_init(&msg, shard->ring_buf, len))
+            return -1;
+
+        if (client_on_msg(client, &msg))
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Callback for wakeups from the client via the rings, for either requests or room for queued messages
+ */
+static int client_on_ring (int fd, short what, void *arg)
+{
+    struct client *client = arg;
+    uint64_t count;
+
+    // clear wakeup
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        goto error;
+
+    // send queued messages
+    if (client_flush(client))
+        goto error;
+
+    if (client_read_ring(client))
+        goto error;
+
+    // ok
+    return 0;
+
+error:
+    // disconnect client
+    client_disconnected(client);
+
+    // client is now disconnected, we dealt with the error
+    return 0;
+}
+
+/**
+ * Reading again with requests left over, which the socket or rings may not signal
+ */
+static void client_on_dispatch (void *arg)
+{
+    struct client *client = arg;
+
+    if (!select_fd_active(&client->fd))
+        // destroyed, or being handed off to another shard
+        return;
+
+    client_on_sock(client_sock(client), FD_READ, client);
+
+    if (select_fd_active(&client->ring_fd))
+        client_on_ring(client->ring_fd.fd, FD_READ, client);
+}
+
+/**
+ * Client was handed off to this shard, activate it
+ */
+static void client_on_adopt (struct shard *shard, void *arg)
+{
+    struct client *client = arg;
+
+    if (select_loop_add(shard->select_loop, &client->fd)) {
+        log_warn_errno("[%p] Dropping client connection", client);
+
+        client_destroy(client);
+    }
+}
+
+/**
+ * Pass the client on to the next shard, once our current shard is done with it.
+ *
+ * Any requests that the loop has already received on our behalf are taken along, once its reads have stopped.
+ */
+static void client_migrate (void *arg)
+{
+    struct client *client = arg;
+
+    if (!select_fd_active(&client->fd))
+        // destroyed
+        return;
+
+    if (!select_fd_op_stopped(&client->fd)) {
+        // try again once the loop has run
+        select_timer_add(client->shard->select_loop, &client->migrate_timer, 0);
+
+        return;
+    }
+
+    if (client_recv_take(client))
+        goto error;
+
+    // leave our current shard
+    select_loop_del(client->shard->select_loop, &client->fd);
+    select_loop_del(client->shard->select_loop, &client->ring_fd);
+
+    if (shard_send(shard_next(client->shard), &client->shard_msg))
+        goto error;
+
+    return;
+
+error:
+    log_warn_errno("[%p] Unable to pass on client", client);
+
+    client_destroy(client);
+}
+
+/**
+ * Retry passing on the client
+ */
+static int client_on_migrate_timer (struct timer *timer, void *arg)
+{
+    client_migrate(arg);
+
+    return 0;
+}
+
+/**
+ * Construct a new client for the given socket, and hand it off to a shard to be activated
+ */
+static int client_add (struct daemon *daemon, int sock, bool stream)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    struct client *client;
+
+    // alloc
+    if ((client = calloc(1, sizeof(*client))) == NULL)
+        return -1; // ENOMEM
+
+    // init
+    client->daemon = daemon;
+    client->shard = daemon_shard_next(daemon);
+    TAILQ_INIT(&client->queue);
+
+    if (stream && (client->stream = proto_stream_new(ND_PROTO_MSG_MAX)) == NULL)
+        goto error;
+
+    // peers on AF_UNIX sockets share our byte order
+    client->local = getsockname(sock, (struct sockaddr *) &addr, &addr_len) == 0 && addr.ss_family == AF_UNIX;
+
+    // set state
+    if (fd_flags(sock, O_NONBLOCK|O_CLOEXEC))
+        goto error;
+
+    // init fd state
+    select_fd_init(&client->fd, sock, FD_READ, client_on_sock, client);
+    select_fd_op(&client->fd, SELECT_OP_RECV);
+    select_fd_init(&client->ring_fd, -1, FD_READ, client_on_ring, client);
+    client->ring_memfd = -1;
+    select_defer_init(&client->release, client_release, client);
+    select_defer_init(&client->migrate, client_migrate, client);
+    timer_init(&client->migrate_timer, client_on_migrate_timer, client);
+    select_defer_init(&client->dispatch, client_on_dispatch, client);
+    shard_msg_init(&client->shard_msg, client_on_adopt, client);
+
+    // activate on our shard
+    if (shard_send(client->shard, &client->shard_msg))
+        goto error;
+
+    return 0;
+
+error:
+    if (client->stream)
+        proto_stream_free(client->stream);
+
+    free(client);
+
+    return -1;
+}
+
+int client_add_seqpacket (struct daemon *daemon, int sock)
+{
+    return client_add(daemon, sock, false);
+}
+
+int client_add_stream (struct daemon *daemon, int sock)
+{
+    return client_add(daemon, sock, true);
+}
+
+int client_ring_open (struct client *client)
+{
+    int fds[RING_LINK_FDS];
+
+    if (client->ring)
+        // already in use
+        return 0;
+
+    if (!client->local || client->stream) {
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    if ((client->ring = malloc(sizeof(*client->ring))) == NULL)
+        return -1;
+
+    if (ring_link_create(client->ring, fds)) {
+        free(client->ring);
+        client->ring = NULL;
+
+        return -1;
+    }
+
+    // passed to the client by client_ring_start
+    client->ring_memfd = fds[0];
+
+    // owned by the select loop from here on
+    select_fd_init(&client->ring_fd, client->ring->wait_fd, FD_READ, client_on_ring, client);
+    client->ring->wait_fd = -1;
+
+    return 0;
+}
+
+size_t client_data_max (struct client *client)
+{
+    if ((client->stream || client->ring) && (client->caps & PROTO_CAP_LARGE))
+        return PROCESS_READ_MAX;
+    else
+        return PROCESS_READ_SIZE;
+}
+
+void client_on_process_data (struct process *process, struct process_data *data, void *ctx)
+{
+    struct client *client = ctx;
+    struct proto_frame *frame;
+
+    log_debug("[%p] Got %zu bytes of CMD_DATA on %d from process [%p]", client, data->len, data->channel, process);
+    
+    // send packet
+    if ((frame = process_data_frame(data, client->version, client->caps)) == NULL || client_send_frame(client, frame))
+        client_error(client, errno);
+}
+
+void client_on_process_status (struct process *process, enum proto_process_status status, int code, void *ctx)
+{
+    struct client *client = ctx;
+    
+    log_debug("[%p] Got status from process [%p]: %d:%d", client, process, status, code);
+
+    // send
+    if (client_cmd_status(client, status, code))
+        client_error(client, errno);
+}
+
+void client_on_process_stdin (struct process *process, int err, void *ctx)
+{
+    struct client *client = ctx;
+
+    log_debug("[%p] Wrote queued data to process [%p]: %s", client, process, err ? strerror(err) : "ok");
+
+    // reply to the suspended CMD_DATA
+    client_resume(client, NULL, err);
+}
+
+int client_on_cmd_data (struct client *client, struct proto_msg *req, enum proto_channel channel, const char *buf, size_t len)
+{
+    int ret;
+
+    assert(client->process);
+
+    switch (channel) {
+        case CHANNEL_STDIN:
             if (len) {
                 log_debug("[%p] Write data to process [%p]: %.*s", client, client->process, (int) len, buf);
 
                 // send to stdin
-                if (process_stdin_data(client->process, buf, len))
-                    // soft error
-                    return errno;
+                ret = process_stdin_data(client->process, client, buf, len);
 
             } else {
                 log_debug("[%p] EOF on stdin to process [%p]", client, client->process);
 
                 // perform
-                if (process_stdin_eof(client->process))
-                    // soft error
-                    return errno;
+                ret = process_stdin_eof(client->process, client);
             }
 
+            if (ret < 0)
+                // soft error
+                return errno;
+
+            else if (ret)
+                // queued, reply once written
+                return client_suspend(client, req);
+
             return 0;
 
         default:
@@ -379,10 +1162,13 @@ static int client_attach_process (struct client *client, struct process *process
     // ok
     client->process = process;
 
+    if (client->blocked)
+        process_output_pause(process);
+
     return 0;
 }
 
-int client_start (struct client *client, const struct process_exec_info *exec_info)
+int client_start (struct client *client, struct proto_msg *req, const struct process_exec_info *exec_info)
 {
     struct process *process;
     int err;
@@ -390,8 +1176,20 @@ int client_start (struct client *client, const struct process_exec_info *exec_in
     if (client->process)
         return EALREADY;
 
+    if (select_fd_active(&client->shard->zygote_fd)) {
+        // spawn asynchronously via the zygote
+        if (shard_process_spawn(client->shard, &process, exec_info))
+            // soft error
+            return errno;
+
+        process->spawn_client = client;
+        client->spawning = process;
+
+        return client_suspend(client, req);
+    }
+
     // spawn new process
-    if (daemon_process_start(client->daemon, &process, exec_info))
+    if (shard_process_start(client->shard, &process, exec_info))
         // soft errror
         // XXX: EINTR? Hmm...
         return errno;
@@ -410,16 +1208,342 @@ error:
     return err;    
 }
 
-int client_attach (struct client *client, const char *process_id)
+void client_on_spawn (struct client *client, struct process *process, int err)
+{
+    struct proto_msg reply;
+    char buf[512];
+
+    client->spawning = NULL;
+
+    if (err) {
+        client_resume(client, NULL, err);
+
+    } else if ((err = client_attach_process(client, process))) {
+        if (err < 0)
+            goto error;
+
+        client_resume(client, NULL, err);
+
+    } else {
+        // respond with CMD_ATTACHED
+        if (
+                proto_msg_init(&reply, buf, sizeof(buf))
+            ||  cmd_reply_attached(&reply, &client->suspended_req, process, process->output_offset)
+        )
+            goto error;
+
+        client_resume(client, &reply, 0);
+    }
+
+    return;
+
+error:
+    log_warn_errno("[%p] Unable to attach to spawned process", client);
+
+    client_destroy(client);
+}
+
+/**
+ * Client was passed on to this shard, looking for the process to attach to
+ */
+static void client_on_migrate (struct shard *shard, void *arg)
+{
+    struct client *client = arg;
+    struct process *process = NULL;
+    struct proto_msg reply;
+    char buf[512];
+    int err;
+
+    if (!client->migrate_err && !(process = shard_find_process(shard, client->migrate_process_id)) && shard != client->migrate_origin) {
+        log_debug("[%p] Process not found on shard %u, passing on", client, shard->index);
+
+        if (shard_send(shard_next(shard), &client->shard_msg) == 0)
+            return;
+
+        client->migrate_err = errno;
+
+        log_warn_errno("[%p] Unable to pass on client", client);
+
+        // report the error from where we started
+        if (shard_send(client->migrate_origin, &client->shard_msg) == 0)
+            return;
+
+        log_warn_errno("[%p] Unable to return client to shard %u, staying on shard %u", client, client->migrate_origin->index, shard->index);
+    }
+
+    // stay here, also to report an error if we could not return, as the client's own shard must resume or destroy it
+    client->shard = shard;
+
+    free(client->migrate_process_id);
+    client->migrate_process_id = NULL;
+
+    if (select_loop_add(shard->select_loop, &client->fd))
+        goto error;
+
+    if (client_ring_active(client) && select_loop_add(shard->select_loop, &client->ring_fd))
+        goto error;
+
+    if (client->migrate_err) {
+        // unable to look any further
+        client_resume(client, NULL, client->migrate_err);
+
+    } else if (!process) {
+        // back where we started
+        client_resume(client, NULL, ENOENT);
+
+    } else if ((err = client_attach_process(client, process))) {
+        if (err < 0)
+            goto error;
+
+        client_resume(client, NULL, err);
+
+    } else {
+        client->replay = true;
+
+        log_debug("[%p] Attached to process [%p] on shard %u", client, process, shard->index);
+
+        // respond with CMD_ATTACHED
+        if (
+                proto_msg_init(&reply, buf, sizeof(buf))
+            ||  cmd_reply_attached(&reply, &client->suspended_req, process, process_scrollback_start(process, client->replay_offset))
+        )
+            goto error;
+
+        client_resume(client, &reply, 0);
+
+        // followed by the replay
+        if (client_replay(client))
+            goto error;
+    }
+
+    return;
+
+error:
+    log_warn_errno("[%p] Unable to attach on shard %u", client, shard->index);
+
+    client_destroy(client);
+}
+
+int client_attach (struct client *client, struct proto_msg *req, const char *process_id, uint64_t offset)
 {
     struct process *process;
+    int err;
+
+    if (client->process)
+        return EALREADY;
+
+    // replay once attached
+    client->replay_offset = offset;
+
+    // find process on our own shard
+    if ((process = shard_find_process(client->shard, process_id))) {
+        if ((err = client_attach_process(client, process)))
+            return err;
 
-    // find process
-    if ((process = daemon_find_process(client->daemon, process_id)) == NULL)
+        client->replay = true;
+
+        return 0;
+    }
+
+    if (client->daemon->shards_count == 1)
         return ENOENT;
 
-    // attach to it
-    return client_attach_process(client, process);
+    // look for it on the other shards, taking the client along with us
+    if ((client->migrate_process_id = strdup(process_id)) == NULL)
+        return -1;
+
+    client->migrate_origin = client->shard;
+    client->migrate_err = 0;
+    shard_msg_init(&client->shard_msg, client_on_migrate, client);
+
+    if (client_suspend(client, req))
+        return -1;
+
+    // leave our current shard
+    select_loop_defer(client->shard->select_loop, &client->migrate);
+
+    return 0;
+}
+
+/**
+ * CMD_LIST reply being collected from each shard in turn
+ */
+struct client_list {
+    /** Requesting client, and its handle to check that it is still there once we get back */
+    struct client *client;
+    select_handle_t client_handle;
+
+    /** Shard the client is on */
+    struct shard *origin;
+
+    /** Reply being built, the offset of its process count, and the number of processes so far */
+    struct proto_msg reply;
+    size_t count_offset;
+    uint16_t count;
+
+    /** Error from building the reply */
+    int err;
+
+    /** Message used to pass the request around the shards */
+    struct shard_msg shard_msg;
+
+    /** Reply buffer */
+    char buf[ND_PROTO_MSG_MAX];
+};
+
+/**
+ * Append the shard's processes to the CMD_LIST reply
+ */
+static int client_list_shard (struct proto_msg *reply, uint16_t *count, struct shard *shard)
+{
+    struct process *process;
+
+    LIST_FOREACH(process, &shard->processes, shard_processes) {
+        struct proto_status fields = { .status = process->status, .code = process->status_code };
+
+        if (
+                proto_write_str(reply, process_id(process))
+            ||  proto_encode_status(reply, &fields)
+        )
+            return -1;
+
+        (*count)++;
+    }
+
+    return 0;
+}
+
+/**
+ * Fill in the number of processes in the CMD_LIST reply
+ */
+static int client_list_finish (struct proto_msg *reply, size_t count_offset, uint16_t count)
+{
+    size_t offset = reply->offset;
+
+    log_info("-> count=%u", count);
+
+    reply->offset = count_offset;
+
+    if (proto_write_uint16(reply, count))
+        return -1;
+
+    reply->offset = offset;
+
+    return 0;
+}
+
+/**
+ * CMD_LIST reply passed on to this shard
+ */
+static void client_on_list (struct shard *shard, void *arg)
+{
+    struct client_list *list = arg;
+    struct client *client;
+
+    if (shard != list->origin) {
+        // add ours
+        if (!list->err && client_list_shard(&list->reply, &list->count, shard))
+            list->err = errno;
+
+        // and pass it on, eventually back to the origin
+        if (shard_send(shard_next(shard), &list->shard_msg) == 0)
+            return;
+
+        list->err = errno;
+
+        log_warn_errno("[%p] Unable to pass on CMD_LIST", list->client);
+
+        // the client can only be resumed on its own shard, which replies with the error
+        if (shard_send(list->origin, &list->shard_msg) == 0)
+            return;
+
+        log_errno("[%p] Unable to return CMD_LIST to shard %u, client stays suspended", list->client, list->origin->index);
+
+        goto out;
+    }
+
+    // the client may have gone away in the meantime
+    if (select_loop_lookup(shard->select_loop, list->client_handle) == NULL) {
+        log_debug("[%p] Client gone before CMD_LIST reply", list->client);
+
+        goto out;
+    }
+
+    client = list->client;
+
+    if (!list->err && client_list_finish(&list->reply, list->count_offset, list->count))
+        list->err = errno;
+
+    if (list->err)
+        client_resume(client, NULL, list->err);
+    else
+        client_resume(client, &list->reply, 0);
+
+out:
+    free(list);
+}
+
+int client_list (struct client *client, struct proto_msg *req, struct proto_msg *out)
+{
+    struct client_list *list;
+    size_t count_offset;
+    uint16_t count = 0;
+
+    if (client->daemon->shards_count == 1) {
+        // reply directly
+        if (proto_cmd_reply(out, req, CMD_LIST))
+            return -1;
+
+        count_offset = out->offset;
+
+        if (
+                proto_write_uint16(out, 0)
+            ||  client_list_shard(out, &count, client->shard)
+            ||  client_list_finish(out, count_offset, count)
+        )
+            return -1;
+
+        return 0;
+    }
+
+    // collect from each shard
+    if ((list = calloc(1, sizeof(*list))) == NULL)
+        return -1;
+
+    list->client = client;
+    list->client_handle = select_fd_handle(client->shard->select_loop, &client->fd);
+    list->origin = client->shard;
+
+    shard_msg_init(&list->shard_msg, client_on_list, list);
+
+    if (
+            proto_msg_init(&list->reply, list->buf, sizeof(list->buf))
+        ||  proto_cmd_reply(&list->reply, req, CMD_LIST)
+    )
+        goto error;
+
+    list->count_offset = list->reply.offset;
+
+    // starting with our own
+    if (
+            proto_write_uint16(&list->reply, 0)
+        ||  client_list_shard(&list->reply, &list->count, client->shard)
+    )
+        goto error;
+
+    if (client_suspend(client, req))
+        goto error;
+
+    // pass on to the other shards
+    if (shard_send(shard_next(client->shard), &list->shard_msg))
+        goto error;
+
+    return 0;
+
+error:
+    free(list);
+
+    return -1;
 }
 
 int client_kill (struct client *client, int sig)
@@ -10,6 +10,33 @@
 #include "process.h"
 #include "shared/proto.h"
 
+struct ring_link;
+
+/**
+ * Default outbound queue limits, in bytes: once the queue reaches the high watermark, the client stops reading requests
+ * and its attached process's output is paused until the queue drains below the low watermark. A client whose queue
+ * would exceed the maximum is disconnected.
+ */
+#define CLIENT_QUEUE_LOW    (64 * 1024)
+#define CLIENT_QUEUE_HIGH   (256 * 1024)
+#define CLIENT_QUEUE_MAX    (4 * 1024 * 1024)
+
+/**
+ * Default number of requests received from a client per read
+ */
+#define CLIENT_RECV_BATCH   8
+
+/**
+ * Queued outbound message
+ */
+struct client_msg {
+    /** Our entry in the client's queue */
+    TAILQ_ENTRY(client_msg) client_queue;
+
+    /** Reference to the encoded message, possibly shared with other clients */
+    struct proto_frame *frame;
+};
+
 /**
  * Per-client connection state
  */
@@ -17,39 +44,129 @@ struct client {
     /** Daemon we are running under */
     struct daemon *daemon;
 
+    /** Shard we are running on */
+    struct shard *shard;
+
     /** socket IO info */
     struct select_fd fd;
 
-    /** Protocol version agreed upon in handshake */
+    /** Reassembly state for SOCK_STREAM connections, or NULL for SOCK_SEQPACKET */
+    struct proto_stream *stream;
+
+    /** How much of the message at the head of the queue has already been sent on a SOCK_STREAM connection */
+    size_t send_offset;
+
+    /** Deferred release after destroy */
+    struct select_defer release;
+
+    /** Message used to hand off the client to a shard */
+    struct shard_msg shard_msg;
+
+    /** Deferred hand-off to the next shard, once our current shard is done with us, and its retry */
+    struct select_defer migrate;
+    struct timer migrate_timer;
+
+    /** Process to attach to on another shard, and the shard we started looking from */
+    char *migrate_process_id;
+    struct shard *migrate_origin;
+
+    /** Error passing the client on to the next shard, reported to the client by the shard it ends up on */
+    int migrate_err;
+
+    /** Requests received from the socket along with a request that suspended or blocked us, not handled yet */
+    struct proto_batch *pending;
+
+    /** Deferred handling of the pending requests, once we are reading again */
+    struct select_defer dispatch;
+
+    /** Not reading any further requests until the reply to the suspended request has been sent */
+    bool suspended;
+    struct proto_msg suspended_req;
+
+    /** Outbound messages waiting for the socket to become writable, and their total size */
+    TAILQ_HEAD(client_queue, client_msg) queue;
+    size_t queue_size;
+
+    /** Queue is above the high watermark, so our reads and the attached process's output are paused */
+    bool blocked;
+
+    /** Protocol version and features agreed upon in handshake */
     enum proto_version version;
+    enum proto_caps caps;
+
+    /** Connected over AF_UNIX, so on the same host */
+    bool local;
+
+    /** Shared memory rings used in place of the socket with PROTO_CAP_RING, and their memfd until it has been sent */
+    struct ring_link *ring;
+    int ring_memfd;
+
+    /** Woken up by the client via the rings */
+    struct select_fd ring_fd;
 
     /** Attached process */
     struct process *process;
 
+    /** Process being spawned via the zygote for the suspended CMD_START */
+    struct process *spawning;
+
+    /** Replay the attached process's output from the given offset, once the CMD_ATTACHED reply has been sent */
+    bool replay;
+    uint64_t replay_offset;
+
     /** Process's consumer list */
     LIST_ENTRY(client) process_clients;
 };
 
 /**
- * Construct a new client and activate it.
+ * Construct a new client and hand it off to a shard to be activated.
  *
  * @param daemon daemon we are running under
- * @param client_ptr returned client struct if not NULL
  * @param sock connected socket fd of the SOCK_SEQPACKET type
  */
 int client_add_seqpacket (struct daemon *daemon, int sock);
 
 /**
- * Client got data from attached process.
+ * Construct a new client and hand it off to a shard to be activated.
+ *
+ * Messages are framed using a uint32_t length prefix.
+ *
+ * @param daemon daemon we are running under
+ * @param sock connected socket fd of the SOCK_STREAM type
+ */
+int client_add_stream (struct daemon *daemon, int sock);
+
+/**
+ * Set up a ring_link for the client, which is passed to it along with the next message sent on the socket, i.e. the
+ * CMD_HELLO reply. All further messages are sent and received using the rings.
+ *
+ * Fails with EINVAL for clients not on a local SOCK_SEQPACKET socket.
+ */
+int client_ring_open (struct client *client);
+
+/**
+ * Return the maximum amount of process output that can be sent to the client in a single CMD_DATA: large frames are
+ * only used for clients on SOCK_STREAM transports or rings using PROTO_CAP_LARGE.
+ */
+size_t client_data_max (struct client *client);
+
+/**
+ * Client got data from attached process, of no more than client_data_max bytes, sent as a CMD_DATA frame encoded once
+ * for all attached clients using the same protocol version. A zero-length CMD_DATA indicates EOF.
  *
  * XXX: should not be a 'public' interface
  */
-void client_on_process_data (struct process *process, enum proto_channel channel, const char *buf, size_t len, void *ctx);
+void client_on_process_data (struct process *process, struct process_data *data, void *ctx);
 
 /**
- * Client got EOF from attached process
+ * Process being spawned for the client via the zygote is running, or failed to spawn with the given error
  */
-void client_on_process_eof (struct process *process, enum proto_channel channel, void *ctx);
+void client_on_spawn (struct client *client, struct process *process, int err);
+
+/**
+ * Stdin data queued by the client was written to the process, or failed with the given error
+ */
+void client_on_process_stdin (struct process *process, int err, void *ctx);
 
 /**
  * Client's attached process changed status
@@ -57,19 +174,35 @@ void client_on_process_eof (struct process *process, enum proto_channel channel,
 void client_on_process_status (struct process *process, enum proto_process_status status, int code, void *ctx);
 
 /**
- * Send data to process
+ * Send data to process.
+ *
+ * If the process is not able to take the data yet, the client is suspended, and the reply to the given request is sent
+ * once it has been written.
  */
-int client_on_cmd_data (struct client *client, enum proto_channel channel, const char *buf, size_t len);
+int client_on_cmd_data (struct client *client, struct proto_msg *req, enum proto_channel channel, const char *buf, size_t len);
 
 /**
- * Start process and attach to it
+ * Start process and attach to it.
+ *
+ * If spawning the process via the zygote, the client is suspended, and the reply to the given request is sent once
+ * attached.
+ */
+int client_start (struct client *client, struct proto_msg *req, const struct process_exec_info *exec_info);
+
+/**
+ * Attach to process, replaying its output from the given offset after the reply to the given request.
+ *
+ * If the process is not running on the client's own shard, the client is suspended and passed around the other
+ * shards, and the reply to the given request is sent once attached.
  */
-int client_start (struct client *client, const struct process_exec_info *exec_info);
+int client_attach (struct client *client, struct proto_msg *req, const char *process_id, uint64_t offset);
 
 /**
- * Attach to process
+ * Write the CMD_LIST reply to the given request.
+ *
+ * With multiple shards, the client is suspended, and the reply is sent once it has been collected from each shard.
  */
-int client_attach (struct client *client, const char *process_id);
+int client_list (struct client *client, struct proto_msg *req, struct proto_msg *out);
 
 /**
  * Send signal to attached process
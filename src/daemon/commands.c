@@ -5,13 +5,15 @@
 #include "errno.h"
 
 // send CMD_ATTACHED reply
-static int reply_cmd_attached (struct proto_msg *out, struct proto_msg *req, struct process *process)
+int cmd_reply_attached (struct proto_msg *out, struct proto_msg *req, struct process *process, uint64_t offset)
 {
+    struct proto_status fields = { .status = process->status, .code = process->status_code };
+
     return (
             proto_cmd_reply(out, req, CMD_ATTACHED)
         ||  proto_write_str(out, process_id(process))
-        ||  proto_write_uint16(out, process->status)
-        ||  proto_write_uint16(out, process->status_code)
+        ||  proto_encode_status(out, &fields)
+        ||  proto_encode_offset(out, &(struct proto_offset) { .offset = offset })
     );
 }
 
@@ -22,31 +24,58 @@ static int cmd_hello (struct proto_msg *req, struct proto_msg *out, void *ctx)
 {
     struct client *client = ctx;
     uint16_t proto_version;
+    uint32_t caps = 0;
+    bool has_caps;
 
     if (proto_read_uint16(req, &proto_version))
         return -1;
 
+    // older clients do not request any features
+    if ((has_caps = proto_version >= PROTO_V2 && req->offset < req->len) && proto_read_uint32(req, &caps))
+        return -1;
 
-    switch (proto_version) {
-        case PROTO_V1:
-            log_info("proto_version=%u (current)", proto_version);
-            break;
 
-        default:
-            log_warn("Unknown protocol version: %d", proto_version);
-            
-            errno = EINVAL;
-            
-            return -1;
+    if (proto_version < PROTO_V1) {
+        log_warn("Unknown protocol version: %d", proto_version);
+        
+        errno = EINVAL;
+        
+        return -1;
+
+    } else if (proto_version > PROTO_VERSION) {
+        log_info("proto_version=%u (newer, using %u)", proto_version, PROTO_VERSION);
+
+        proto_version = PROTO_VERSION;
+
+    } else {
+        log_info("proto_version=%u", proto_version);
     }
 
     // set
     client->version = proto_version;
+    client->caps = caps & client->daemon->options.caps;
+
+    if (!client->local)
+        // byte order may differ, and no shared memory
+        client->caps &= ~(PROTO_CAP_NATIVE | PROTO_CAP_RING);
+
+    // set up the rings, which are passed to the client along with our reply
+    if ((client->caps & PROTO_CAP_RING) && client_ring_open(client)) {
+        log_warn_errno("client_ring_open");
+
+        client->caps &= ~PROTO_CAP_RING;
+    }
+
+    log_info("caps=%#x (using %#x)", caps, client->caps);
+
+    if (client->stream && (client->caps & PROTO_CAP_LARGE))
+        proto_stream_limit(client->stream, ND_PROTO_STREAM_MSG_MAX);
     
     // reply with CMD_HELLO
     if (
             proto_cmd_reply(out, req, CMD_HELLO)
         ||  proto_write_uint16(out, PROTO_VERSION)
+        ||  (has_caps && proto_write_uint32(out, client->caps))
     )
         return -1;
 
@@ -101,11 +130,15 @@ static int cmd_start (struct proto_msg *req, struct proto_msg *out, void *ctx)
     exec_info.envp[0] = NULL;
 
     // go
-    if ((err = client_start(client, &exec_info)))
+    if ((err = client_start(client, req, &exec_info)))
         return err;
 
+    if (client->suspended)
+        // being spawned, reply once attached
+        return 0;
+
     // yay, respond with CMD_ATTACHED
-    if (reply_cmd_attached(out, req, client->process))
+    if (cmd_reply_attached(out, req, client->process, client->process->output_offset))
         goto error;
 
     // good
@@ -130,16 +163,13 @@ static int cmd_data (struct proto_msg *req, struct proto_msg *out, void *ctx)
         return ECHILD;
 
     // read packet
-    if (
-            proto_read_uint16(req, &channel)
-        ||  proto_read_buf_ptr(req, &buf, &len)
-    )
+    if (proto_read_data(req, client->version, &channel, &buf, &len))
         return -1;
 
     log_info("channel=%u, data=%zu:%.*s", channel, len, (int) len, buf);
 
     // process
-    return client_on_cmd_data(client, channel, buf, len); 
+    return client_on_cmd_data(client, req, channel, buf, len); 
 }
 
 // attach to process
@@ -147,19 +177,28 @@ static int cmd_attach (struct proto_msg *req, struct proto_msg *out, void *ctx)
 {
     struct client *client = ctx;
     const char *process_id;
+    struct proto_offset fields = { .offset = 0 };
     int err;
     
     if (proto_read_str(req, &process_id))
         return -1;
+
+    // optional replay offset
+    if (req->offset < req->len && proto_decode_offset(req, &fields))
+        return -1;
     
-    log_info("process_id=%s", process_id);
+    log_info("process_id=%s, offset=%llu", process_id, (unsigned long long) fields.offset);
 
     // process
-    if ((err = client_attach(client, process_id)))
+    if ((err = client_attach(client, req, process_id, fields.offset)))
         return err;
 
-    // respond with CMD_ATTACHED
-    if (reply_cmd_attached(out, req, client->process))
+    if (client->suspended)
+        // looking for the process on the other shards, reply once attached
+        return 0;
+
+    // respond with CMD_ATTACHED, followed by the replay
+    if (cmd_reply_attached(out, req, client->process, process_scrollback_start(client->process, fields.offset)))
         goto error;
 
     // good
@@ -175,60 +214,46 @@ error:
 static int cmd_kill (struct proto_msg *req, struct proto_msg *out, void *ctx)
 {
     struct client *client = ctx;
-    uint16_t sig;
+    struct proto_kill fields;
 
-    if (proto_read_uint16(req, &sig))
+    if (proto_decode_kill(req, &fields))
         return -1;
 
-    log_info("sig=%u", sig);
+    log_info("sig=%u", fields.signal);
 
     // process
-    return client_kill(client, sig);
+    return client_kill(client, fields.signal);
 }
 
 // get list of processes
 static int cmd_list (struct proto_msg *req, struct proto_msg *out, void *ctx)
 {
     struct client *client = ctx;
-    struct process *process;
-    uint16_t count = 0;
-
-    // number of processes running
-    LIST_FOREACH(process, &client->daemon->processes, daemon_processes)
-        count++;
-    
-    log_info("-> count=%u", count);
 
-    // reply
-    if (
-            proto_cmd_reply(out, req, CMD_LIST)
-        ||  proto_write_uint16(out, count)
-    )
-        return -1;
-
-    LIST_FOREACH(process, &client->daemon->processes, daemon_processes) {
-        if (
-                proto_write_str(out, process_id(process))
-            ||  proto_write_uint16(out, process->status)
-            ||  proto_write_uint16(out, process->status_code)
-        )
-            return -1;
-    }
-
-    // ok
-    return 0;
+    // process
+    return client_list(client, req, out);
 }
 
 /**
- * Server-side command handlers
+ * Server-side command handlers, by page
  */
-struct proto_cmd_handler daemon_command_handlers[] = {
-    {   CMD_LIST,       cmd_list        },
-    {   CMD_KILL,       cmd_kill        },
-    {   CMD_ATTACH,     cmd_attach      },
-    {   CMD_DATA,       cmd_data        },
-    {   CMD_HELLO,      cmd_hello       },
-    {   CMD_START,      cmd_start       },
-    {   0,              0               }
+static const struct proto_cmd_handler daemon_commands_session[PROTO_CMD_PAGE_SIZE] = {
+    PROTO_CMD(  CMD_HELLO,      cmd_hello,      PROTO_CMD_BEFORE_HELLO,     sizeof(uint16_t)                        ),
+};
+
+static const struct proto_cmd_handler daemon_commands_process[PROTO_CMD_PAGE_SIZE] = {
+    PROTO_CMD(  CMD_START,      cmd_start,      0,                          PROTO_LEN_STR + 2 * sizeof(uint16_t)    ),
+    PROTO_CMD(  CMD_ATTACH,     cmd_attach,     0,                          PROTO_LEN_STR                           ),
+    PROTO_CMD(  CMD_LIST,       cmd_list,       0,                          0                                       ),
+};
+
+static const struct proto_cmd_handler daemon_commands_data[PROTO_CMD_PAGE_SIZE] = {
+    PROTO_CMD(  CMD_DATA,       cmd_data,       0,                          PROTO_LEN_data + sizeof(uint16_t)       ),
+    PROTO_CMD(  CMD_KILL,       cmd_kill,       0,                          PROTO_LEN_kill                          ),
 };
 
+const struct proto_cmd_table daemon_command_handlers = { .pages = {
+    [PROTO_CMD_PAGE(CMD_HELLO)]     = daemon_commands_session,
+    [PROTO_CMD_PAGE(CMD_START)]     = daemon_commands_process,
+    [PROTO_CMD_PAGE(CMD_DATA)]      = daemon_commands_data,
+} };
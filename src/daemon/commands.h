@@ -10,6 +10,11 @@
 /**
  * Server-side command handlers. These take the `struct client *` as the context argument.
  */
-extern struct proto_cmd_handler daemon_command_handlers[];
+extern const struct proto_cmd_table daemon_command_handlers;
+
+/**
+ * Build a CMD_ATTACHED reply to the given request for the given process, with output following from the given offset
+ */
+int cmd_reply_attached (struct proto_msg *out, struct proto_msg *req, struct process *process, uint64_t offset);
 
 #endif
@@ -1,4 +1,5 @@
 #include "daemon.h"
+#include "client.h"
 #include "shared/signal.h"
 #include "shared/log.h"
 
@@ -12,11 +13,17 @@
 int on_sigchld (void *arg)
 {
     struct daemon *daemon = arg;
+    unsigned i;
 
     log_info("trap");
 
-    // have the process module deal with it
-    return process_reap(daemon);
+    // have each shard's process module deal with it
+    for (i = 0; i < daemon->shards_count; i++) {
+        if (shard_send(&daemon->shards[i], &daemon->shards[i].reap_msg))
+            return -1;
+    }
+
+    return 0;
 }
 
 int on_sigint (void *arg)
@@ -32,7 +39,9 @@ int on_sigint (void *arg)
 
     } else {
         log_info("Terminating");
-        
+
+        errno = ECANCELED;
+
         return -1;
     }
 
@@ -42,21 +51,94 @@ int on_sigint (void *arg)
 static struct signal_handler sigchld_handler, sigint_handler;
 
 
-int daemon_init (struct daemon *daemon)
+/**
+ * Set up the shards, either running in their own worker threads, or a single shard in the main loop
+ */
+static int daemon_init_shards (struct daemon *daemon, const struct daemon_options *options)
 {
+    unsigned i;
+
+    daemon->shards_count = options->workers ? options->workers : 1;
+    daemon->shards_next = 0;
+
+    if ((daemon->shards = calloc(daemon->shards_count, sizeof(*daemon->shards))) == NULL)
+        return -1;
+
+    for (i = 0; i < daemon->shards_count; i++) {
+        if (shard_init(&daemon->shards[i], daemon, i, options->workers ? NULL : &daemon->select_loop, options->select_backend))
+            return -1;
+    }
+
+    if (options->workers)
+        log_info("Using %u worker threads", options->workers);
+
+    // ok
+    return 0;
+}
+
+int daemon_init (struct daemon *daemon, const struct daemon_options *options)
+{
+    // tunables
+    daemon->options = *options;
+
+    if (!daemon->options.client_queue_low)
+        daemon->options.client_queue_low = CLIENT_QUEUE_LOW;
+
+    if (!daemon->options.client_queue_high)
+        daemon->options.client_queue_high = CLIENT_QUEUE_HIGH;
+
+    if (!daemon->options.client_queue_max)
+        daemon->options.client_queue_max = CLIENT_QUEUE_MAX;
+
+    if (!daemon->options.client_recv_batch)
+        daemon->options.client_recv_batch = CLIENT_RECV_BATCH;
+
+    if (!daemon->options.process_stdin_max)
+        daemon->options.process_stdin_max = PROCESS_STDIN_MAX;
+
+    if (!daemon->options.process_scrollback)
+        daemon->options.process_scrollback = PROCESS_SCROLLBACK;
+
+    // a full replay must fit into the client's queue
+    if (
+            daemon->options.client_queue_low > daemon->options.client_queue_high
+        ||  daemon->options.client_queue_high > daemon->options.client_queue_max
+        ||  daemon->options.process_scrollback > daemon->options.client_queue_max
+    ) {
+        errno = EINVAL;
+
+        return -1;
+    }
+
     // lists
     LIST_INIT(&daemon->services);
-    LIST_INIT(&daemon->processes);
 
     // signal handlers
     if (
-            signal_register(&sigchld_handler, SIGCHLD, on_sigchld, daemon)
+            signal_init()
+        ||  signal_register(&sigchld_handler, SIGCHLD, on_sigchld, daemon)
         ||  signal_register(&sigint_handler,  SIGINT,  on_sigint,  daemon)
+        ||  signal_ignore(SIGPIPE)
     )
         return -1;
     
+    // fork off the zygote before we grow any further
+    if (options->zygote && zygote_start(&daemon->zygote, options->workers ? options->workers : 1))
+        return -1;
+
     // select loop
-    select_loop_init(&daemon->select_loop);
+    if (select_loop_init(&daemon->select_loop, options->select_backend))
+        return -1;
+
+    log_info("Using %s select loop backend", select_backend_names[daemon->select_loop.backend]);
+
+    // deliver signals via the select loop
+    if (signal_loop_add(&daemon->select_loop))
+        return -1;
+
+    // shards
+    if (daemon_init_shards(daemon, options))
+        return -1;
 
     // ok
     return 0;
@@ -77,80 +159,80 @@ int daemon_service_unix (struct daemon *daemon, const char *path)
     return 0;
 }
 
-int daemon_process_start (struct daemon *daemon, struct process **proc_ptr, const struct process_exec_info *exec_info)
+int daemon_service_tcp (struct daemon *daemon, const char *host, const char *port)
 {
-    struct process *process;
+    struct service *service;
 
-    // start
-    if (process_start(daemon, &process, exec_info))
+    // create
+    if (service_open_tcp(daemon, &service, host, port))
         return -1;
 
     // add
-    LIST_INSERT_HEAD(&daemon->processes, process, daemon_processes);
+    LIST_INSERT_HEAD(&daemon->services, service, daemon_services);
 
     // ok
-    *proc_ptr = process;
-
     return 0;
 }
 
-struct process *daemon_find_process (struct daemon *daemon, const char *proc_id)
+struct shard *daemon_shard_next (struct daemon *daemon)
 {
-    struct process *process;
-    
-    LIST_FOREACH(process, &daemon->processes, daemon_processes) {
-        // match
-        if (strcmp(process_id(process), proc_id) == 0)
-            break;
-    }
+    return &daemon->shards[daemon->shards_next++ % daemon->shards_count];
+}
 
-    return process;
+/**
+ * Stop the worker threads of the first count shards
+ */
+static void daemon_stop_shards (struct daemon *daemon, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        if (shard_stop(&daemon->shards[i]))
+            log_warn_errno("[%u] shard_stop", i);
+    }
 }
 
 int daemon_main (struct daemon *daemon)
 {
+    unsigned i;
     int err;
 
     // set flag
     daemon->running = true;
 
-    // run select loop with signal handling
+    // start worker threads
+    for (i = 0; i < daemon->shards_count; i++) {
+        if (shard_start(&daemon->shards[i]))
+            goto error;
+    }
+
+    // run select loop, which also runs the signal handlers
     while (daemon->running) {
-        // wait for activity on FDs or signal
+        // wait for activity on FDs
         if ((err = select_loop_run(&daemon->select_loop, NULL)) < 0) {
-            if (errno == EINTR) {
-                // run signal handlers
-                log_debug("select_loop_run: EINTR -> signal_run()");
-
-                if ((err = signal_run()) < 0)
-                    // quick exit
-                    return -1;
-
-                else if (!err)
-                    // no signals handled
-                    log_debug("Spurious EINTR, no signals handled...");
-
-            } else {
-                // select/handling raised system error
-                return err;
-            }
-
-        } else {
-            // check for signals
-            if ((err = signal_run()) < 0)
-                // quick exit
-                return -1;
-
-            else if (err)
-                // XXX: is this a bug? Not really...
-                log_debug("Signal without EINTR!");
+            if (errno == EINTR)
+                // stopped and continued
+                continue;
+
+            // select/handling raised system error
+            goto error;
         }
     }
 
     log_info("Exited main loop, cleaning up...");
 
-    // XXX: well, clean up
+    // wait for the worker threads to finish whatever they are handling
+    daemon_stop_shards(daemon, daemon->shards_count);
 
     return 0;
+
+error:
+    err = errno;
+
+    daemon_stop_shards(daemon, i);
+
+    errno = err;
+
+    return -1;
 }
 
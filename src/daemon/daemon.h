@@ -8,26 +8,68 @@
 
 #include "service.h"
 #include "process.h"
+#include "shard.h"
+#include "zygote.h"
 #include "shared/select.h"
 
+/**
+ * Daemon-wide tunables, given to daemon_init
+ */
+struct daemon_options {
+    /** select_loop implementation to use */
+    enum select_backend select_backend;
+
+    /** Number of worker threads to run shards in, or zero to run everything in the main loop */
+    unsigned workers;
+
+    /** Client outbound queue low/high watermarks and maximum size in bytes, or zero for the CLIENT_QUEUE_* defaults */
+    size_t client_queue_low, client_queue_high, client_queue_max;
+
+    /** Maximum number of requests received from a client per read, or zero for the CLIENT_RECV_BATCH default */
+    unsigned client_recv_batch;
+
+    /** Protocol features offered to clients, PROTO_CAP_* */
+    enum proto_caps caps;
+
+    /** Spawn processes via the zygote */
+    bool zygote;
+
+    /** Limit on the amount of stdin data queued per process in bytes, or zero for the PROCESS_STDIN_MAX default */
+    size_t process_stdin_max;
+
+    /** Memory used for output retained per process for replay on attach in bytes, or zero for the PROCESS_SCROLLBACK
+     * default */
+    size_t process_scrollback;
+};
+
 struct daemon {
+    /** Tunables, with defaults filled in */
+    struct daemon_options options;
+
     /** List of service-ports */
     LIST_HEAD(daemon_services, service) services;
 
-    /** List of running processes */
-    LIST_HEAD(daemon_processes, process) processes;
-
-    /** I/O reactor */
+    /** Main I/O reactor, for signals and services, as well as the shard if not using worker threads */
     struct select_loop select_loop;
 
+    /** Shards that processes and clients run on */
+    struct shard *shards;
+    unsigned shards_count;
+
+    /** Spawn helper, if used */
+    struct zygote zygote;
+
+    /** Next shard to hand a new client to */
+    unsigned shards_next;
+
     /** Still running? */
     bool running;
 };
 
 /**
- * Initialize daemon-state for use
+ * Initialize daemon-state for use with the given options
  */
-int daemon_init (struct daemon *daemon);
+int daemon_init (struct daemon *daemon, const struct daemon_options *options);
 
 /**
  * Start an AF_UNIX service on the given path
@@ -35,14 +77,14 @@ int daemon_init (struct daemon *daemon);
 int daemon_service_unix (struct daemon *daemon, const char *path);
 
 /**
- * Start a new process with the given parameters.
+ * Start a TCP service on the given host, or the loopback address if NULL, and port
  */
-int daemon_process_start (struct daemon *daemon, struct process **proc_ptr, const struct process_exec_info *exec_info);
+int daemon_service_tcp (struct daemon *daemon, const char *host, const char *port);
 
 /**
- * Find and return a process with the given ID, or NULL
+ * Pick the shard to run a new client on, round-robin
  */
-struct process *daemon_find_process (struct daemon *daemon, const char *process_id);
+struct shard *daemon_shard_next (struct daemon *daemon);
 
 /**
  * Run daemon mainloop
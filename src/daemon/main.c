@@ -1,6 +1,7 @@
 #include "service.h"
 #include "globals.h"
 #include "shared/log.h"
+#include "shared/util.h"
 
 // lib
 
@@ -16,6 +17,21 @@
  */
 struct daemon daemon_state;
 
+/**
+ * Look up a name in a NULL-terminated list of names, returning its index or -1
+ */
+static int lookup_name (const char *names[], const char *name)
+{
+    int i;
+
+    for (i = 0; names[i]; i++) {
+        if (strcasecmp(names[i], name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
 /**
  * Command-line options
  */
@@ -25,6 +41,15 @@ static const struct option options[] = {
     { "verbose",    false,  NULL,   'v' },
     { "debug",      false,  NULL,   'D' },
     { "unix",       true,   NULL,   'u' },
+    { "tcp",        true,   NULL,   't' },
+    { "backend",    true,   NULL,   'B' },
+    { "workers",    true,   NULL,   'W' },
+    { "queue",      true,   NULL,   'Q' },
+    { "recv-batch", true,   NULL,   'R' },
+    { "scrollback", true,   NULL,   'S' },
+    { "zygote",     false,  NULL,   'Z' },
+    { "stdin-queue", true,  NULL,   'I' },
+    { "caps",       true,   NULL,   'C' },
     { 0,            0,      0,      0   }
 };
 
@@ -38,7 +63,20 @@ void help (const char *argv0)
         "\t-q, --quiet          supress informational output\n"
         "\t-v, --verbose        display more informational output\n"
         "\t-d, --debug          equivalent to -v\n"
-        "\t-u, --unix=PATH      connect using the given UNIX socket\n"
+        "\t-u, --unix=PATH      listen on the given UNIX socket\n"
+        "\t-t, --tcp=[HOST:]PORT\n"
+        "\t                     listen on the given TCP port, on localhost unless a HOST is given\n"
+        "\t-B, --backend=NAME   use the given select loop backend: select, epoll, uring\n"
+        "\t-W, --workers=N      run processes and clients on N worker threads\n"
+        "\t-Q, --queue=LOW:HIGH[:MAX]\n"
+        "\t                     client output queue watermarks and limit, in bytes\n"
+        "\t-R, --recv-batch=N   receive up to N requests from a client at a time\n"
+        "\t-S, --scrollback=BYTES\n"
+        "\t                     memory used for output kept per process for replay on attach\n"
+        "\t-Z, --zygote         spawn processes from a helper process forked at startup\n"
+        "\t-I, --stdin-queue=BYTES\n"
+        "\t                     limit on stdin data queued per process\n"
+        "\t-C, --caps=NAME,...  offer only the given protocol features: lz, large, native, ring, all, none\n"
         "\n"
         "Examples:\n"
     );
@@ -52,10 +90,12 @@ void help (const char *argv0)
 int main (int argc, char **argv)
 {
     const char *service_unix_path = NULL;
-    int opt;
+    const char *service_tcp_host = NULL, *service_tcp_port = NULL;
+    struct daemon_options daemon_options = { .caps = PROTO_CAPS };
+    int opt, value;
 
     // parse arguments
-    while ((opt = getopt_long(argc, argv, "hqvDu:", options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hqvDu:t:B:W:Q:R:S:ZI:C:", options, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 // display help
@@ -82,6 +122,74 @@ int main (int argc, char **argv)
 
                 break;
 
+            case 't':
+                // listen on tcp service
+                if (parse_host_port(optarg, &service_tcp_host, &service_tcp_port))
+                    EXIT_WARN(EXIT_FAILURE, "Invalid TCP address: %s", optarg);
+
+                break;
+
+            case 'B':
+                // select loop implementation
+                if ((value = lookup_name(select_backend_names, optarg)) < 0)
+                    EXIT_WARN(EXIT_FAILURE, "Unknown select loop backend: %s", optarg);
+
+                daemon_options.select_backend = value;
+
+                break;
+
+            case 'W':
+                // worker threads
+                if ((value = atoi(optarg)) < 0)
+                    EXIT_WARN(EXIT_FAILURE, "Invalid number of workers: %s", optarg);
+
+                daemon_options.workers = value;
+
+                break;
+
+            case 'Q':
+                // client queue limits
+                if (sscanf(optarg, "%zu:%zu:%zu", &daemon_options.client_queue_low, &daemon_options.client_queue_high, &daemon_options.client_queue_max) < 2)
+                    EXIT_WARN(EXIT_FAILURE, "Invalid queue limits: %s", optarg);
+
+                break;
+
+            case 'R':
+                // client request batch size
+                if ((value = atoi(optarg)) <= 0)
+                    EXIT_WARN(EXIT_FAILURE, "Invalid receive batch size: %s", optarg);
+
+                daemon_options.client_recv_batch = value;
+
+                break;
+
+            case 'S':
+                // process scrollback size
+                if (sscanf(optarg, "%zu", &daemon_options.process_scrollback) < 1)
+                    EXIT_WARN(EXIT_FAILURE, "Invalid scrollback size: %s", optarg);
+
+                break;
+
+            case 'I':
+                // process stdin queue limit
+                if (sscanf(optarg, "%zu", &daemon_options.process_stdin_max) < 1)
+                    EXIT_WARN(EXIT_FAILURE, "Invalid stdin queue limit: %s", optarg);
+
+                break;
+
+            case 'C':
+                // protocol features
+                if (proto_caps_parse(optarg, &daemon_options.caps))
+                    EXIT_WARN(EXIT_FAILURE, "Invalid protocol features: %s", optarg);
+
+                break;
+
+            case 'Z':
+                // spawn helper
+                daemon_options.zygote = true;
+
+                break;
+
             case '?':
                 // useage error
                 help(argv[0]);
@@ -95,26 +203,37 @@ int main (int argc, char **argv)
     }
 
     // validate
-    if (!service_unix_path)
-        EXIT_WARN(EXIT_FAILURE, "No service (--unix) given");
+    if (!service_unix_path && !service_tcp_port)
+        EXIT_WARN(EXIT_FAILURE, "No service (--unix or --tcp) given");
 
 
     // init daemon
-    if (daemon_init(&daemon_state)) {
+    if (daemon_init(&daemon_state, &daemon_options)) {
         log_errno("daemon_init");
 
         goto error;
     }
 
-    // open service
-    if (daemon_service_unix(&daemon_state, service_unix_path) < 0) {
-        log_errno("daemon_service_unix: %s", service_unix_path);
-        
-        goto error;
+    // open services
+    if (service_unix_path) {
+        if (daemon_service_unix(&daemon_state, service_unix_path) < 0) {
+            log_errno("daemon_service_unix: %s", service_unix_path);
+            
+            goto error;
+        }
 
+        log_info("Started service on UNIX socket: %s", service_unix_path);
     }
 
-    log_info("Started service on UNIX socket: %s", service_unix_path);
+    if (service_tcp_port) {
+        if (daemon_service_tcp(&daemon_state, service_tcp_host, service_tcp_port) < 0) {
+            log_errno("daemon_service_tcp: %s:%s", service_tcp_host ? service_tcp_host : "localhost", service_tcp_port);
+
+            goto error;
+        }
+
+        log_info("Started service on TCP port: %s:%s", service_tcp_host ? service_tcp_host : "localhost", service_tcp_port);
+    }
 
     // run select loop
     log_info("Entering main loop");
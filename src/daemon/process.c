@@ -2,46 +2,110 @@
 #include "process.h"
 #include "shared/log.h"
 #include "shared/util.h"
+#include "shared/signal.h"
+#include "shared/lz.h"
 #include "client.h"
+#include "daemon.h"
+#include "zygote.h"
 
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <assert.h>
 
+/**
+ * Open a pidfd for the given child process
+ */
+static int pidfd_open (pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+
+    return -1;
+#endif
+}
+
+/**
+ * Send a signal to the process referred to by the given pidfd
+ */
+static int pidfd_send_signal (int pidfd, int sig)
+{
+#ifdef SYS_pidfd_send_signal
+    return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+#else
+    errno = ENOSYS;
+
+    return -1;
+#endif
+}
+
+/**
+ * Release the process state, once the select loop is done with it
+ */
+static void process_release (void *arg)
+{
+    struct process *process = arg;
+    struct process_input *input;
+    struct process_chunk *chunk;
+
+    while ((input = TAILQ_FIRST(&process->stdin_queue)) != NULL) {
+        TAILQ_REMOVE(&process->stdin_queue, input, process_stdin);
+
+        free(input);
+    }
+
+    while ((chunk = TAILQ_FIRST(&process->scrollback)) != NULL) {
+        TAILQ_REMOVE(&process->scrollback, chunk, process_scrollback);
+
+        proto_frame_unref(chunk->frame);
+        free(chunk);
+    }
+
+    free(process->name);
+    free(process);
+}
+
 /**
  * Clean up the given process, which shouldn't be running or have any attached clients.
  *
- * This will remove it from the list of processes, and close any remaining stdin/out/err pipes.
+ * This will remove it from the list of processes, and close any remaining stdin/out/err pipes. The process state
+ * itself is released at the end of the select loop run.
  */
 static void process_cleanup (struct process *process)
 {
     assert(process->pid < 0);
     assert(LIST_EMPTY(&process->clients));
 
-    // remove from daemon list
-    LIST_REMOVE(process, daemon_processes);
+    // remove from shard list and index
+    shard_remove_process(process->shard, process);
+
+    select_timer_cancel(process->shard->select_loop, &process->exit_timer);
 
     // cleanup stdin/out/err
-    if (process->std_in >= 0)
-        close(process->std_in);
+    if (select_fd_active(&process->std_in))
+        select_loop_close(process->shard->select_loop, &process->std_in);
 
-    if (select_fd_active(&process->std_out)) {
-        // XXX: select_fd_close
-        select_loop_del(&process->daemon->select_loop, &process->std_out);
-        close(process->std_out.fd);
-    }
+    if (select_fd_active(&process->pid_fd))
+        select_loop_close(process->shard->select_loop, &process->pid_fd);
 
-    if (select_fd_active(&process->std_err)) {
-        // XXX: select_fd_close
-        select_loop_del(&process->daemon->select_loop, &process->std_err);
-        close(process->std_err.fd);
-    }
+    if (select_fd_active(&process->std_out))
+        select_loop_close(process->shard->select_loop, &process->std_out);
+
+    if (select_fd_active(&process->std_err))
+        select_loop_close(process->shard->select_loop, &process->std_err);
 
     // done
-    free(process->name);
-    free(process);
+    select_loop_defer(process->shard->select_loop, &process->release);
 }
 
 /**
@@ -51,133 +115,894 @@ static int process_update (struct process *process, enum proto_process_status st
 {
     struct client *client;
 
-    switch (status) {
-        case PROCESS_RUN:
-            log_info("[%p] Running with pid=%d", process, code);
-            break;
+    switch (status) {
+        case PROCESS_RUN:
+            log_info("[%p] Running with pid=%d", process, code);
+            break;
+
+        case PROCESS_EXIT:
+            log_info("[%p] Exited with status=%d", process, code);
+            break;
+
+        case PROCESS_KILL:
+            log_info("[%p] Terminated with signal=%d", process, code);
+            break;
+    }
+
+    // store
+    process->status = status;
+    process->status_code = code;
+        
+    // notify attached clients
+    LIST_FOREACH(client, &process->clients, process_clients) {
+        // callback
+        client_on_process_status(process, status, code, client);
+    }
+
+    // ok
+    return 0;
+}
+
+/**
+ * Encode a CMD_DATA_LZ frame for the given output, compressing the data directly into place.
+ *
+ * Returns NULL with errno zero if the data does not compress well.
+ */
+static struct proto_frame *process_data_frame_lz (struct process_data *data, bool native)
+{
+    struct proto_data_lz fields = { .channel = data->channel, .len = data->len };
+    struct proto_frame *frame;
+    struct proto_msg msg;
+    size_t len;
+
+    if ((frame = proto_frame_new(PROCESS_DATA_HEADER(PROTO_V2) + sizeof(uint32_t) + data->len)) == NULL)
+        return NULL;
+
+    if (proto_frame_msg(frame, &msg))
+        goto error;
+
+    msg.native = native;
+
+    if (
+            proto_cmd_start(&msg, 0, CMD_DATA_LZ)
+        ||  proto_encode_data_lz(&msg, &fields)
+    )
+        goto error;
+
+    // only worth it if it saves at least an eighth
+    if (!(len = lz_compress(data->buf, data->len, msg.buf + msg.offset + sizeof(uint32_t), data->len - data->len / 8))) {
+        errno = 0;
+
+        goto error;
+    }
+
+    // fill in the length prefix for the data that is already there
+    if (proto_write_buf32_ptr(&msg, NULL, len))
+        goto error;
+
+    proto_frame_end(frame, &msg);
+
+    return frame;
+
+error:
+    proto_frame_unref(frame);
+
+    return NULL;
+}
+
+struct proto_frame *process_data_frame (struct process_data *data, enum proto_version version, enum proto_caps caps)
+{
+    bool native = caps & PROTO_CAP_NATIVE;
+    struct proto_data fields = { .channel = data->channel };
+    struct proto_frame *frame;
+    struct proto_msg msg;
+    char *buf;
+
+    if ((caps & PROTO_CAP_LZ) && data->len >= PROTO_LZ_MIN && !data->lz_skip) {
+        if (data->frames_lz[native])
+            return data->frames_lz[native];
+
+        if ((data->frames_lz[native] = process_data_frame_lz(data, native)))
+            return data->frames_lz[native];
+
+        if (errno)
+            return NULL;
+
+        // send as-is
+        data->lz_skip = true;
+    }
+
+    if (data->frames[native][version])
+        // already encoded
+        return data->frames[native][version];
+
+    if ((frame = proto_frame_new(PROCESS_DATA_HEADER(version) + data->len)) == NULL)
+        return NULL;
+
+    if (proto_frame_msg(frame, &msg))
+        goto error;
+
+    msg.native = native;
+
+    if (
+            proto_cmd_start(&msg, 0, CMD_DATA)
+        ||  proto_encode_data(&msg, &fields)
+        ||  proto_write_data_ptr(&msg, version, &buf, data->len)
+    )
+        goto error;
+
+    memcpy(buf, data->buf, data->len);
+
+    proto_frame_end(frame, &msg);
+
+    return data->frames[native][version] = frame;
+
+error:
+    proto_frame_unref(frame);
+
+    return NULL;
+}
+
+/**
+ * Release the frames encoded for the given output
+ */
+static void process_data_release (struct process_data *data)
+{
+    enum proto_version version;
+    int native;
+
+    for (native = 0; native < 2; native++) {
+        for (version = 0; version <= PROTO_VERSION; version++) {
+            if (data->frames[native][version])
+                proto_frame_unref(data->frames[native][version]);
+        }
+
+        if (data->frames_lz[native])
+            proto_frame_unref(data->frames_lz[native]);
+    }
+}
+
+/**
+ * Determine the most output to pass on in one frame: no more than the attached clients can take.
+ *
+ * Also returns whether all of the attached clients use native byte order, in which case the output is encoded for them.
+ */
+static size_t process_read_max (struct process *process, bool *native_ptr)
+{
+    size_t size = PROCESS_READ_MAX, max;
+    bool native = !LIST_EMPTY(&process->clients);
+    struct client *client;
+
+    LIST_FOREACH(client, &process->clients, process_clients) {
+        if ((max = client_data_max(client)) < size)
+            size = max;
+
+        if (!(client->caps & PROTO_CAP_NATIVE))
+            native = false;
+    }
+
+    *native_ptr = native;
+
+    return size;
+}
+
+/**
+ * Determine how much output to read from the given fd at a time: no more than the attached clients can take in one
+ * frame, and only as much as is available to read, so that short reads use small frames.
+ *
+ * Also returns whether all of the attached clients use native byte order, in which case the output is read into a
+ * frame encoded for them.
+ */
+static size_t process_read_size (struct process *process, int fd, bool *native_ptr)
+{
+    size_t size = process_read_max(process, native_ptr);
+    int avail;
+
+    if (size <= PROCESS_READ_SIZE)
+        return size;
+
+    if (ioctl(fd, FIONREAD, &avail) || avail <= PROCESS_READ_SIZE)
+        return PROCESS_READ_SIZE;
+
+    return (size_t) avail < size ? (size_t) avail : size;
+}
+
+/**
+ * Start encoding a PROTO_V2 CMD_DATA frame for the given channel in the given byte order, with room for up to size bytes
+ * of data, which go into place at the returned buf_ptr.
+ */
+static struct proto_frame *process_data_start (struct proto_msg *msg, enum proto_channel channel, size_t size, bool native, char **buf_ptr)
+{
+    struct proto_data fields = { .channel = channel };
+    struct proto_frame *frame;
+
+    if ((frame = proto_frame_new(PROCESS_DATA_HEADER(PROTO_V2) + size)) == NULL)
+        return NULL;
+
+    if (proto_frame_msg(frame, msg))
+        goto error;
+
+    msg->native = native;
+
+    // header
+    if (
+            proto_cmd_start(msg, 0, CMD_DATA)
+        ||  proto_encode_data(msg, &fields)
+    )
+        goto error;
+
+    // data goes after the length prefix
+    *buf_ptr = msg->buf + msg->offset + proto_data_prefix(PROTO_V2);
+
+    return frame;
+
+error:
+    proto_frame_unref(frame);
+
+    return NULL;
+}
+
+/**
+ * Finish encoding the CMD_DATA frame with the given length of data already in place, and return it via data.
+ */
+static int process_data_end (struct proto_frame *frame, struct proto_msg *msg, enum proto_channel channel, const char *buf, size_t len, bool native, struct process_data *data)
+{
+    // fill in the length prefix for the data that is already there
+    if (proto_write_data_ptr(msg, PROTO_V2, NULL, len))
+        return -1;
+
+    proto_frame_end(frame, msg);
+
+    data->channel = channel;
+    data->buf = buf;
+    data->len = len;
+    data->frames[native][PROTO_V2] = frame;
+
+    return 0;
+}
+
+/**
+ * Encode a PROTO_V2 CMD_DATA frame for the given channel in the given byte order, reading up to size bytes of data from
+ * the given fd directly into place.
+ *
+ * Returns the frame with the data read via data, or NULL on error.
+ */
+static struct proto_frame *process_read_frame (enum proto_channel channel, int fd, size_t size, bool native, struct process_data *data)
+{
+    struct proto_frame *frame;
+    struct proto_msg msg;
+    char *buf;
+    ssize_t ret;
+
+    if ((frame = process_data_start(&msg, channel, size, native, &buf)) == NULL)
+        return NULL;
+
+    // read chunk into place
+    if ((ret = read(fd, buf, size)) < 0)
+        goto error;
+
+    if (process_data_end(frame, &msg, channel, buf, ret, native, data))
+        goto error;
+
+    return frame;
+
+error:
+    proto_frame_unref(frame);
+
+    return NULL;
+}
+
+/**
+ * Encode a PROTO_V2 CMD_DATA frame for the given channel in the given byte order, copying in the given data.
+ *
+ * Returns the frame with the data via data, or NULL on error.
+ */
+static struct proto_frame *process_copy_frame (enum proto_channel channel, const char *src, size_t len, bool native, struct process_data *data)
+{
+    struct proto_frame *frame;
+    struct proto_msg msg;
+    char *buf;
+
+    if ((frame = process_data_start(&msg, channel, len, native, &buf)) == NULL)
+        return NULL;
+
+    memcpy(buf, src, len);
+
+    if (process_data_end(frame, &msg, channel, buf, len, native, data)) {
+        proto_frame_unref(frame);
+
+        return NULL;
+    }
+
+    return frame;
+}
+
+/**
+ * Return a reference to the given frame for keeping around, or to a compact copy of it if most of the frame is unused,
+ * as is the case for short reads.
+ */
+static struct proto_frame *process_frame_keep (struct proto_frame *frame)
+{
+    struct proto_frame *copy;
+
+    if (frame->len >= frame->size / 2)
+        return proto_frame_ref(frame);
+
+    if ((copy = proto_frame_new(frame->len)) == NULL)
+        return NULL;
+
+    memcpy(copy->buf, frame->buf, frame->len);
+    copy->len = frame->len;
+
+    return copy;
+}
+
+/**
+ * Retain the given chunk of output in the scrollback, dropping the oldest output to make room.
+ *
+ * The scrollback is limited by the memory held by the frames retained, not just the data in them. EOF is retained as an
+ * empty chunk.
+ */
+static int process_scrollback_append (struct process *process, enum proto_channel channel, struct proto_frame *frame, bool native, size_t len)
+{
+    size_t limit = process->shard->daemon->options.process_scrollback;
+    struct process_chunk *chunk;
+
+    if ((chunk = malloc(sizeof(*chunk))) == NULL)
+        return -1;
+
+    if ((chunk->frame = process_frame_keep(frame)) == NULL) {
+        free(chunk);
+
+        return -1;
+    }
+
+    chunk->offset = process->output_offset;
+    chunk->channel = channel;
+    chunk->native = native;
+    chunk->len = len;
+
+    TAILQ_INSERT_TAIL(&process->scrollback, chunk, process_scrollback);
+    process->scrollback_size += chunk->frame->size;
+
+    // trim, keeping at least the newest chunk
+    while (process->scrollback_size > limit && (chunk = TAILQ_FIRST(&process->scrollback)) != TAILQ_LAST(&process->scrollback, process_scrollback)) {
+        TAILQ_REMOVE(&process->scrollback, chunk, process_scrollback);
+        process->scrollback_size -= chunk->frame->size;
+
+        proto_frame_unref(chunk->frame);
+        free(chunk);
+    }
+
+    return 0;
+}
+
+uint64_t process_scrollback_start (struct process *process, uint64_t offset)
+{
+    struct process_chunk *chunk;
+
+    if (offset > process->output_offset)
+        // nothing to replay
+        return process->output_offset;
+
+    if (!(chunk = TAILQ_FIRST(&process->scrollback)))
+        // nothing retained
+        return process->output_offset;
+
+    if (offset < chunk->offset)
+        // older output is lost
+        return chunk->offset;
+
+    return offset;
+}
+
+int process_replay (struct process *process, struct client *client, uint64_t offset)
+{
+    size_t max = client_data_max(client), skip, end;
+    struct process_chunk *chunk;
+
+    log_debug("[%p] Replaying output from %llu to client [%p]", process, (unsigned long long) offset, client);
+
+    TAILQ_FOREACH(chunk, &process->scrollback, process_scrollback) {
+        if (chunk->len ? chunk->offset + chunk->len <= offset : chunk->offset < offset)
+            // already seen
+            continue;
+
+        skip = chunk->offset < offset ? offset - chunk->offset : 0;
+        end = chunk->len;
+
+        // in pieces that the client is able to take, with EOF as a single empty piece
+        do {
+            struct process_data data = {
+                .channel    = chunk->channel,
+                .buf        = chunk->frame->buf + chunk->frame->len - chunk->len + skip,
+                .len        = end - skip < max ? end - skip : max,
+            };
+
+            if (client->process != process)
+                // client was dropped
+                return 0;
+
+            if (data.len == chunk->len)
+                // the whole chunk, as read
+                data.frames[chunk->native][PROTO_V2] = proto_frame_ref(chunk->frame);
+
+            client_on_process_data(process, &data, client);
+
+            process_data_release(&data);
+
+            skip += data.len;
+
+        } while (skip < end);
+    }
+
+    return 0;
+}
+
+/**
+ * Report the exit status held back for the rest of the output
+ */
+static int process_exit_report (struct process *process)
+{
+    process->exit_pending = false;
+
+    select_timer_cancel(process->shard->select_loop, &process->exit_timer);
+
+    return process_update(process, process->exit_status, process->exit_code);
+}
+
+/**
+ * Pass on a chunk of output read from the process fd, which is closed on EOF
+ */
+static int process_output (struct process *process, enum proto_channel channel, struct select_fd *select_fd, struct proto_frame *frame, bool native, struct process_data *data)
+{
+    struct client *client;
+    size_t len = data->len;
+
+    if (len == 0) {
+        // eof, which is passed on as an empty CMD_DATA
+        select_loop_close(process->shard->select_loop, select_fd);
+    }
+
+    // pass off to each attached client
+    LIST_FOREACH(client, &process->clients, process_clients) {
+        // callback
+        client_on_process_data(process, data, client);
+    }
+
+    // and keep it around for any clients attaching later
+    if (process_scrollback_append(process, channel, frame, native, len))
+        log_warn_errno("[%p] Unable to retain output", process);
+
+    process->output_offset += len;
+
+    process_data_release(data);
+
+    // all output read after exit?
+    if (!len && process->exit_pending && !select_fd_active(&process->std_out) && !select_fd_active(&process->std_err))
+        return process_exit_report(process);
+
+    return 0;
+}
+
+/**
+ * Take the next chunk of output read from the process fd by the loop, and pass it on in pieces that all of the attached
+ * clients are able to take.
+ */
+static int process_on_recv (struct process *process, enum proto_channel channel, struct select_fd *select_fd)
+{
+    struct proto_frame *frame;
+    size_t max, len, offset = 0;
+    ssize_t ret;
+    bool native;
+    char *buf;
+
+    if ((ret = select_recv(select_fd, &buf)) < 0) {
+        if (errno == EAGAIN)
+            // spurious
+            return 0;
+
+        return -1;
+    }
+
+    max = process_read_max(process, &native);
+
+    // with EOF as a single empty piece
+    do {
+        struct process_data data = { };
+
+        len = (size_t) ret - offset < max ? (size_t) ret - offset : max;
+
+        if ((frame = process_copy_frame(channel, buf + offset, len, native, &data)) == NULL)
+            return -1;
+
+        if (process_output(process, channel, select_fd, frame, native, &data))
+            return -1;
+
+        offset += len;
+
+    } while (offset < (size_t) ret);
+
+    return 0;
+}
+
+/**
+ * Read-cctivity on process fd
+ */
+static int process_on_read (struct process *process, enum proto_channel channel, int fd, struct select_fd *select_fd)
+{
+    struct process_data data = { };
+    struct proto_frame *frame;
+    size_t size;
+    bool native;
+
+    if (select_fd_op_active(select_fd))
+        // already read by the loop
+        return process_on_recv(process, channel, select_fd);
+
+    size = process_read_size(process, fd, &native);
+
+    // read chunk, encoded once per protocol version and byte order for all clients
+    if ((frame = process_read_frame(channel, fd, size, native, &data)) == NULL)
+        goto error;
+
+    return process_output(process, channel, select_fd, frame, native, &data);
+
+error:
+    // XXX: kill process?
+    return -1;    
+}
+
+/**
+ * Remove the given segment from the stdin queue, and notify its client with the given error, if any
+ */
+static void process_stdin_done (struct process *process, struct process_input *input, int err)
+{
+    TAILQ_REMOVE(&process->stdin_queue, input, process_stdin);
+    process->stdin_size -= input->len;
+
+    if (input->client)
+        client_on_process_stdin(process, err, input->client);
+
+    free(input);
+}
+
+/**
+ * Close the process's stdin, failing any queued segments with the given error
+ */
+static void process_stdin_close (struct process *process, int err)
+{
+    struct process_input *input;
+
+    process->stdin_closed = true;
+
+    if (select_fd_active(&process->std_in))
+        select_loop_close(process->shard->select_loop, &process->std_in);
+
+    while ((input = TAILQ_FIRST(&process->stdin_queue)) != NULL)
+        process_stdin_done(process, input, err);
+}
+
+/**
+ * Write out as much of the queued stdin data as the process is able to take
+ */
+static int process_stdin_flush (struct process *process)
+{
+    struct process_input *input;
+    ssize_t ret;
+
+    while ((input = TAILQ_FIRST(&process->stdin_queue)) != NULL) {
+        if (!input->len) {
+            log_debug("[%p] EOF on stdin", process);
+
+            // done with stdin
+            select_loop_close(process->shard->select_loop, &process->std_in);
+
+            process_stdin_done(process, input, 0);
+
+            continue;
+        }
+
+        if ((ret = write(process->std_in.fd, input->buf + input->offset, input->len - input->offset)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                // wait for the process to read more
+                return select_want_write(&process->std_in, true);
+
+            log_warn_errno("[%p] write stdin", process);
+
+            // most likely EPIPE, as the process has closed its stdin
+            process_stdin_close(process, errno);
+
+            return 0;
+        }
+
+        if ((input->offset += ret) < input->len)
+            // partial write
+            continue;
+
+        process_stdin_done(process, input, 0);
+    }
+
+    // all written
+    if (select_fd_active(&process->std_in))
+        return select_want_write(&process->std_in, false);
+
+    return 0;
+}
+
+/**
+ * Process stdin is writable
+ */
+static int process_on_stdin (int fd, short what, void *ctx)
+{
+    struct process *process = ctx;
+
+    return process_stdin_flush(process);
+}
+
+/**
+ * Activity on process stdout
+ */
+static int process_on_stdout (int fd, short what, void *ctx)
+{
+    struct process *process = ctx;
+    
+    return process_on_read(process, CHANNEL_STDOUT, fd, &process->std_out);
+}
+
+/**
+ * Activity on process stderr
+ */
+static int process_on_stderr (int fd, short what, void *ctx)
+{
+    struct process *process = ctx;
+    
+    return process_on_read(process, CHANNEL_STDERR, fd, &process->std_err);
+}
+
+/**
+ * Process exited or was killed, update state
+ */
+static int process_exited (struct process *process, enum proto_process_status status, int code)
+{
+    // forget pid
+    process->pid = -1;
+
+    if (select_fd_active(&process->pid_fd)) {
+        // done with the pidfd
+        select_loop_close(process->shard->select_loop, &process->pid_fd);
+
+    } else {
+        // reaped via SIGCHLD
+        LIST_REMOVE(process, shard_reaps);
+    }
+
+    if (process->discarded) {
+        // failed to start, and now reaped
+        select_loop_defer(process->shard->select_loop, &process->release);
+
+        return 0;
+    }
+
+    if (select_fd_active(&process->std_out) || select_fd_active(&process->std_err)) {
+        // output still pending, possibly paused by slow clients; report once it has all been passed on
+        process->exit_pending = true;
+        process->exit_status = status;
+        process->exit_code = code;
+
+        select_timer_add(process->shard->select_loop, &process->exit_timer, PROCESS_EXIT_TIMEOUT);
+
+        return 0;
+    }
+
+    return process_update(process, status, code);
+}
+
+/**
+ * Timed out waiting for the rest of the output after exit, report the exit status anyway, after the output read so far
+ */
+static int process_on_exit_timeout (struct timer *timer, void *arg)
+{
+    struct process *process = arg;
+
+    if (process->output_paused) {
+        // waiting for slow clients rather than for the process
+        select_timer_add(process->shard->select_loop, timer, PROCESS_EXIT_TIMEOUT);
+
+        return 0;
+    }
+
+    log_warn("[%p] Output still open after exit", process);
+
+    return process_exit_report(process);
+}
+
+/**
+ * Process's pidfd became readable, i.e. the process has exited
+ */
+static int process_on_exit (int fd, short what, void *ctx)
+{
+    struct process *process = ctx;
+    siginfo_t info;
+
+    // reap exactly this child
+    info.si_pid = 0;
+
+    if (waitid(P_PIDFD, fd, &info, WEXITED | WNOHANG) < 0)
+        return -1;
+
+    if (!info.si_pid)
+        // not yet
+        return 0;
+
+    switch (info.si_code) {
+        case CLD_EXITED:
+            return process_exited(process, PROCESS_EXIT, info.si_status);
+
+        case CLD_KILLED:
+        case CLD_DUMPED:
+            return process_exited(process, PROCESS_KILL, info.si_status);
+
+        default:
+            // unkown status?!
+            return 0;
+    }
+}
+
+/**
+ * Track the newly started process's exit using the given pidfd, or a new pidfd if -1 and supported, or using SIGCHLD
+ * otherwise, such that it always gets reaped
+ */
+static void process_watch (struct process *process, int fd)
+{
+    if (fd < 0 && (fd = pidfd_open(process->pid)) < 0) {
+        log_warn_errno("[%p] pidfd_open, falling back to SIGCHLD", process);
+
+        goto fallback;
+    }
+
+    // pidfds are always O_CLOEXEC
+    select_fd_init(&process->pid_fd, fd, FD_READ, process_on_exit, process);
+
+    if (select_loop_add(process->shard->select_loop, &process->pid_fd)) {
+        log_warn_errno("[%p] select_loop_add pidfd, falling back to SIGCHLD", process);
 
-        case PROCESS_EXIT:
-            log_info("[%p] Exited with status=%d", process, code);
-            break;
+        close(fd);
+        select_fd_deinit(&process->pid_fd);
 
-        case PROCESS_KILL:
-            log_info("[%p] Terminated with signal=%d", process, code);
-            break;
+        goto fallback;
     }
 
-    // store
-    process->status = status;
-    process->status_code = code;
-        
-    // notify attached clients
-    LIST_FOREACH(client, &process->clients, process_clients) {
-        // callback
-        client_on_process_status(process, status, code, client);
-    }
+    return;
 
-    // ok
-    return 0;
+fallback:
+    LIST_INSERT_HEAD(&process->shard->reaps, process, shard_reaps);
 }
 
 /**
- * Read-cctivity on process fd
+ * Spawn the process with the given fds as its stdin/out/err, returning an error number on failure.
+ *
+ * This uses posix_spawn, which uses a vfork-style clone that does not need to copy our page tables, and thus does not
+ * slow down as the daemon grows. The child gets the signal mask from before we blocked the signals delivered via our
+ * signalfd, and does not inherit any other fds.
  */
-static int process_on_read (struct process *process, enum proto_channel channel, int fd, struct select_fd *select_fd)
+static int process_spawn_exec (pid_t *pid_ptr, const struct process_exec_info *exec_info, int std_in, int std_out, int std_err)
 {
-    char buf[4096];
-    ssize_t ret;
-    struct client *client;
+    posix_spawn_file_actions_t file_actions;
+    posix_spawnattr_t attr;
+    sigset_t mask, defaults;
+    int err;
 
-    // read chunk
-    if ((ret = read(fd, buf, sizeof(buf))) < 0)
-        goto error;
+    if ((err = posix_spawn_file_actions_init(&file_actions)))
+        return err;
 
-    else if (ret == 0) {
-        // eof
-        select_loop_del(&process->daemon->select_loop, select_fd);
+    if ((err = posix_spawnattr_init(&attr)))
+        goto error_attr;
 
-        // close fd
-        close(fd);
+    // setup stdin/out/err fds, which clears their O_CLOEXEC
+    if (
+            (err = posix_spawn_file_actions_adddup2(&file_actions, std_in,  STDIN_FILENO))
+        ||  (err = posix_spawn_file_actions_adddup2(&file_actions, std_out, STDOUT_FILENO))
+        ||  (err = posix_spawn_file_actions_adddup2(&file_actions, std_err, STDERR_FILENO))
+    )
+        goto error;
 
-        // deinit
-        select_fd_deinit(select_fd);
-    }
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+    // close anything else that was not already O_CLOEXEC
+    if ((err = posix_spawn_file_actions_addclosefrom_np(&file_actions, STDERR_FILENO + 1)))
+        goto error;
+#endif
 
-    // pass off to each attached client
-    LIST_FOREACH(client, &process->clients, process_clients) {
-        // callback
-        if (ret)
-            client_on_process_data(process, channel, buf, ret, client);
+    // unblock the signals that the daemon receives via signalfd, and restore the ones it ignores
+    signal_child_mask(&mask);
+    signal_child_default(&defaults);
 
-        else
-            client_on_process_eof(process, channel, client);
-    }
-    
-    // ok
-    return 0;
+    if (
+            (err = posix_spawnattr_setsigmask(&attr, &mask))
+        ||  (err = posix_spawnattr_setsigdefault(&attr, &defaults))
+        ||  (err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF))
+    )
+        goto error;
+
+    // exec
+    // XXX: char-constness fails here
+    err = posix_spawn(pid_ptr, exec_info->path, &file_actions, &attr, (char **) exec_info->argv, (char **) exec_info->envp);
 
 error:
-    // XXX: kill process?
-    return -1;    
+    posix_spawnattr_destroy(&attr);
+
+error_attr:
+    posix_spawn_file_actions_destroy(&file_actions);
+
+    return err;
 }
 
 /**
- * Activity on process stdout
+ * Close the given process fd, whether or not it has been added to the select loop yet
  */
-static int process_on_stdout (int fd, short what, void *ctx)
+static void process_close_fd (struct process *process, struct select_fd *fd)
 {
-    struct process *process = ctx;
-    
-    return process_on_read(process, CHANNEL_STDOUT, fd, &process->std_out);
+    if (select_fd_active(fd)) {
+        select_loop_close(process->shard->select_loop, fd);
+
+    } else if (fd->fd >= 0) {
+        close(fd->fd);
+
+        select_fd_deinit(fd);
+    }
 }
 
 /**
- * Activity on process stderr
+ * Set up the state for the newly spawned process, with the given pidfd, or -1, and our ends of its stdin/out/err.
+ *
+ * The process is always watched for its exit, and its stdin/out/err are closed on errors.
  */
-static int process_on_stderr (int fd, short what, void *ctx)
+static int process_setup (struct process *process, int pid_fd, int std_in, int std_out, int std_err)
 {
-    struct process *process = ctx;
-    
-    return process_on_read(process, CHANNEL_STDERR, fd, &process->std_err);
-}
+    // watch for exit first, so that the process gets reaped even if the rest fails
+    process_watch(process, pid_fd);
 
-/**
- * Set of process's stdin/out/err io info
- */
-struct process_io_info {
-    int std_in, std_out, std_err;
-};
+    // setup proc's io
+    select_fd_init(&process->std_in, std_in, 0, process_on_stdin, process);
+    select_fd_init(&process->std_out, std_out, FD_READ, process_on_stdout, process);
+    select_fd_init(&process->std_err, std_err, FD_READ, process_on_stderr, process);
 
-/**
- * Perform exec() with the given parameters
- */
-static void _process_exec (const struct process_exec_info *exec_info, const struct process_io_info *io_info)
-    __attribute__ ((noreturn));
+    // let the loop read the output for us where supported
+    select_fd_op(&process->std_out, SELECT_OP_READ);
+    select_fd_op(&process->std_err, SELECT_OP_READ);
 
-static void _process_exec (const struct process_exec_info *exec_info, const struct process_io_info *io_info)
-{
-    // setup stdin/out/err fds
+    // activate IO
     if (
-            dup2(io_info->std_in,  STDIN_FILENO ) < 0
-        ||  dup2(io_info->std_out, STDOUT_FILENO) < 0
-        ||  dup2(io_info->std_err, STDERR_FILENO) < 0
+            select_loop_add(process->shard->select_loop, &process->std_in)
+        ||  select_loop_add(process->shard->select_loop, &process->std_out)
+        ||  select_loop_add(process->shard->select_loop, &process->std_err)
     )
-        FATAL_ERRNO("dup2");
+        goto error;
 
-    // close old fds
-    // fine as long as io_info->std_in != STDIN_FILENO
-    close(io_info->std_in);
-    close(io_info->std_out);
-    close(io_info->std_err);
-    
-    // exec
-    // XXX: char-constness fails here
-    if (execve(exec_info->path, (char **) exec_info->argv, (char **) exec_info->envp) < 0)
-        // fail
-        FATAL_ERRNO("execve: %s", exec_info->path);
+    // update initial status
+    if (process_update(process, PROCESS_RUN, process->pid))
+        return -1;
 
-    else
-        FATAL("execve returned success");
+    return 0;
+
+error:
+    process_close_fd(process, &process->std_in);
+    process_close_fd(process, &process->std_out);
+    process_close_fd(process, &process->std_err);
+
+    return -1;
+}
+
+/**
+ * Close both ends of a pipe, if open
+ */
+static void process_close_pipe (int fd_read, int fd_write)
+{
+    if (fd_read >= 0)
+        close(fd_read);
+
+    if (fd_write >= 0)
+        close(fd_write);
 }
 
 /**
@@ -185,89 +1010,93 @@ static void _process_exec (const struct process_exec_info *exec_info, const stru
  */
 static int process_spawn (struct process *process, const struct process_exec_info *exec_info)
 {
-    struct process_io_info exec_io, proc_io;
-
-    // verify exec early
-    if (access(exec_info->path, X_OK) < 0)
-        return -1;
+    int exec_in = -1, exec_out = -1, exec_err = -1;
+    int proc_in = -1, proc_out = -1, proc_err = -1;
+    struct timespec start, end;
+    int err;
 
     // create stdin/out/err pipes
     if (
-            make_pipe(&exec_io.std_in,  &proc_io.std_in)
-        ||  make_pipe(&proc_io.std_out, &exec_io.std_out)
-        ||  make_pipe(&proc_io.std_err, &exec_io.std_err)
+            make_pipe(&exec_in,  &proc_in)
+        ||  make_pipe(&proc_out, &exec_out)
+        ||  make_pipe(&proc_err, &exec_err)
     )
         goto error;
 
     // set flags
     if (
-            fd_flags(proc_io.std_in,  O_NONBLOCK)
-        ||  fd_flags(proc_io.std_out, O_NONBLOCK)
-        ||  fd_flags(proc_io.std_err, O_NONBLOCK)
+            fd_flags(proc_in,  O_NONBLOCK)
+        ||  fd_flags(proc_out, O_NONBLOCK)
+        ||  fd_flags(proc_err, O_NONBLOCK)
     )
         goto error;
 
-    log_debug("[%p] stdin -> %d, stdout -> %d, stderr -> %d", process, proc_io.std_in, proc_io.std_out, proc_io.std_err);
+    log_debug("[%p] stdin -> %d, stdout -> %d, stderr -> %d", process, proc_in, proc_out, proc_err);
 
-    // setup proc's io
-    process->std_in = proc_io.std_in;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    if (
-            select_fd_init(&process->std_out, proc_io.std_out, FD_READ, process_on_stdout, process)
-        ||  select_fd_init(&process->std_err, proc_io.std_err, FD_READ, process_on_stderr, process)
-    )
-        goto error;
+    // spawn
+    if ((err = process_spawn_exec(&process->pid, exec_info, exec_in, exec_out, exec_err))) {
+        errno = err;
 
-    // activate IO
-    if (
-            select_loop_add(&process->daemon->select_loop, &process->std_out)
-        ||  select_loop_add(&process->daemon->select_loop, &process->std_err)
-    )
         goto error;
+    }
 
-    // perform fork
-    if ((process->pid = fork()) < 0) {
-        goto error;
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    } else if (process->pid == 0) {
-        // clean up parent's pipes
-        close(proc_io.std_in);
-        close(proc_io.std_out);
-        close(proc_io.std_err);
+    log_info("[%p] Spawned pid=%d in %ldus", process, process->pid,
+        (long) ((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000)
+    );
 
-        // child performs exec()
-        _process_exec(exec_info, &exec_io);
+    // clean up child's pipes
+    close(exec_in);
+    close(exec_out);
+    close(exec_err);
 
-     } else {
-        // clean up child's pipes
-        close(exec_io.std_in);
-        close(exec_io.std_out);
-        close(exec_io.std_err);
+    // child started
+    return process_setup(process, -1, proc_in, proc_out, proc_err);
 
-        // update initial status
-        if (process_update(process, PROCESS_RUN, process->pid))
-            goto error;
+error:
+    err = errno;
 
-        // child started, parent continues
-        return 0;
-    }
+    // clean up any pipes
+    process_close_pipe(exec_in, proc_in);
+    process_close_pipe(proc_out, exec_out);
+    process_close_pipe(proc_err, exec_err);
+
+    errno = err;
 
-error:
-    // XXX: cleanup pipes
     return -1;
 }
 
-int process_start (struct daemon *daemon, struct process **proc_ptr, const struct process_exec_info *exec_info)
+/**
+ * Allocate and initialize a new process state
+ */
+static struct process *process_create (struct shard *shard)
 {
     struct process *process;
 
     // alloc
     if ((process = calloc(1, sizeof(*process))) == NULL)
-        return -1;
+        return NULL;
 
     // init
-    process->daemon = daemon;
+    process->shard = shard;
     LIST_INIT(&process->clients);
+    TAILQ_INIT(&process->stdin_queue);
+    TAILQ_INIT(&process->scrollback);
+    select_defer_init(&process->release, process_release, process);
+    timer_init(&process->exit_timer, process_on_exit_timeout, process);
+
+    return process;
+}
+
+int process_start (struct shard *shard, struct process **proc_ptr, const struct process_exec_info *exec_info)
+{
+    struct process *process;
+
+    if ((process = process_create(shard)) == NULL)
+        return -1;
 
     log_info("[%p] Spawning process: %s ...", process, exec_info->argv[0]);
 
@@ -287,12 +1116,109 @@ int process_start (struct daemon *daemon, struct process **proc_ptr, const struc
     return 0;
 
 error:
-    // cleanup
-    process_destroy(process);
+    // cleanup, once reaped if started
+    process_discard(process);
+
+    return -1;
+}
+
+int process_start_zygote (struct shard *shard, struct process **proc_ptr, const struct process_exec_info *exec_info)
+{
+    struct process *process;
+
+    if ((process = process_create(shard)) == NULL)
+        return -1;
+
+    // the ID is generated once we know the pid
+    if ((process->name = strdup(exec_info->path)) == NULL)
+        goto error;
+
+    log_info("[%p] Spawning process via zygote: %s ...", process, exec_info->argv[0]);
+
+    clock_gettime(CLOCK_MONOTONIC, &process->spawn_time);
+
+    if (zygote_send(shard->zygote_fd.fd, exec_info))
+        goto error;
+
+    // ok
+    *proc_ptr = process;
+
+    return 0;
+
+error:
+    process_discard(process);
 
     return -1;
 }
 
+int process_on_spawn (struct process *process, const struct zygote_reply *reply)
+{
+    struct timespec now;
+    char *name;
+
+    process->pid = reply->pid;
+
+    if (reply->err) {
+        if (process->pid > 0)
+            // the child exits right after failing to exec, and is reaped once discarded
+            process_watch(process, reply->pid_fd);
+        else
+            process->pid = -1;
+
+        errno = reply->err;
+
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    log_info("[%p] Spawned pid=%d in %ldus", process, process->pid,
+        (long) ((now.tv_sec - process->spawn_time.tv_sec) * 1000000 + (now.tv_nsec - process->spawn_time.tv_nsec) / 1000)
+    );
+
+    if (process_setup(process, reply->pid_fd, reply->std_in, reply->std_out, reply->std_err))
+        return -1;
+
+    // generate ID
+    if ((name = strfmt("%s:%d", process->name, process->pid)) == NULL)
+        return -1;
+
+    free(process->name);
+    process->name = name;
+
+    log_info("[%p] Spawned process as %s", process, process->name);
+
+    return 0;
+}
+
+void process_discard (struct process *process)
+{
+    assert(LIST_EMPTY(&process->clients));
+
+    if (select_fd_active(&process->std_in))
+        select_loop_close(process->shard->select_loop, &process->std_in);
+
+    if (select_fd_active(&process->std_out))
+        select_loop_close(process->shard->select_loop, &process->std_out);
+
+    if (select_fd_active(&process->std_err))
+        select_loop_close(process->shard->select_loop, &process->std_err);
+
+    if (process->pid > 0) {
+        log_debug("[%p] Killing pid=%d after failing to start", process, process->pid);
+
+        // released by process_exited once reaped, without waiting for it here
+        process->discarded = true;
+
+        if (kill(process->pid, SIGKILL))
+            log_warn_errno("[%p] kill", process);
+
+        return;
+    }
+
+    select_loop_defer(process->shard->select_loop, &process->release);
+}
+
 int process_attach (struct process *process, struct client *client)
 {
     // add to list
@@ -306,8 +1232,16 @@ int process_attach (struct process *process, struct client *client)
 
 void process_detach (struct process *process, struct client *client)
 {
+    struct process_input *input;
+
     // remove from list
     LIST_REMOVE(client, process_clients);
+
+    // any data it queued is still written
+    TAILQ_FOREACH(input, &process->stdin_queue, process_stdin) {
+        if (input->client == client)
+            input->client = NULL;
+    }
     
     log_debug("[%p] Client [%p] detached", process, client);
 
@@ -319,32 +1253,131 @@ void process_detach (struct process *process, struct client *client)
     }
 }
 
-int process_stdin_data (struct process *process, const char *buf, size_t len)
+/**
+ * Update read interest on stdout/err
+ */
+static int process_output_update (struct process *process)
 {
-    ssize_t ret;
- 
-    // XXX: blocking, should buffer
-    while (len) {
-        if ((ret = write(process->std_in, buf, len)) < 0)
-            return -1;
+    bool want_read = !process->output_paused;
+
+    if (
+            select_want_read(&process->std_out, want_read)
+        ||  select_want_read(&process->std_err, want_read)
+    )
+        return -1;
 
-        buf += ret;
-        len -= ret;
-    }
-    
     return 0;
 }
 
-int process_stdin_eof (struct process *process)
+int process_output_pause (struct process *process)
+{
+    if (process->output_paused++)
+        return 0;
+
+    log_debug("[%p] Output paused", process);
+
+    return process_output_update(process);
+}
+
+int process_output_resume (struct process *process)
+{
+    assert(process->output_paused);
+
+    if (--process->output_paused)
+        return 0;
+
+    log_debug("[%p] Output resumed", process);
+
+    return process_output_update(process);
+}
+
+/**
+ * Queue the given segment of stdin data for the given client, to be written once the process's stdin is writable
+ */
+static int process_stdin_queue (struct process *process, struct client *client, const char *buf, size_t len, size_t offset)
 {
-    log_debug("[%p] EOF on stdin", process);
+    struct process_input *input;
 
-    if (close(process->std_in))
+    if ((input = malloc(sizeof(*input) + len)) == NULL)
         return -1;
 
-    process->std_in = -1;
+    input->client = client;
+    input->len = len;
+    input->offset = offset;
 
-    return 0;
+    if (len)
+        memcpy(input->buf, buf, len);
+
+    TAILQ_INSERT_TAIL(&process->stdin_queue, input, process_stdin);
+    process->stdin_size += len;
+
+    if (select_want_write(&process->std_in, true))
+        return -1;
+
+    return 1;
+}
+
+int process_stdin_data (struct process *process, struct client *client, const char *buf, size_t len)
+{
+    size_t limit = process->shard->daemon->options.process_stdin_max;
+    ssize_t ret = 0;
+
+    if (process->stdin_closed || !select_fd_active(&process->std_in)) {
+        errno = EPIPE;
+
+        return -1;
+    }
+
+    if (process->stdin_size + len > limit) {
+        errno = ENOBUFS;
+
+        return -1;
+    }
+
+    if (TAILQ_EMPTY(&process->stdin_queue)) {
+        // try writing directly
+        if ((ret = write(process->std_in.fd, buf, len)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_warn_errno("[%p] write stdin", process);
+
+                // most likely EPIPE, as the process has closed its stdin
+                process_stdin_close(process, errno);
+
+                return -1;
+            }
+
+            ret = 0;
+
+        } else if (ret == len) {
+            return 0;
+        }
+    }
+
+    // keep the rest in order behind anything already queued
+    return process_stdin_queue(process, client, buf, len, ret);
+}
+
+int process_stdin_eof (struct process *process, struct client *client)
+{
+    if (process->stdin_closed || !select_fd_active(&process->std_in)) {
+        errno = EPIPE;
+
+        return -1;
+    }
+
+    // no more data after this
+    process->stdin_closed = true;
+
+    if (TAILQ_EMPTY(&process->stdin_queue)) {
+        log_debug("[%p] EOF on stdin", process);
+
+        select_loop_close(process->shard->select_loop, &process->std_in);
+
+        return 0;
+    }
+
+    // close once written
+    return process_stdin_queue(process, client, NULL, 0, 0);
 }
 
 int process_kill (struct process *process, int sig)
@@ -356,9 +1389,14 @@ int process_kill (struct process *process, int sig)
         return -1;
     }
 
-    // send signal
-    if (kill(process->pid, sig))
+    // send signal, via the pidfd if we have one, such that we never signal a recycled pid
+    if (select_fd_active(&process->pid_fd)) {
+        if (pidfd_send_signal(process->pid_fd.fd, sig))
+            return -1;
+
+    } else if (kill(process->pid, sig)) {
         return -1;
+    }
 
     log_debug("[%p] Sent signal %d", process, sig);
 
@@ -375,7 +1413,7 @@ void process_destroy (struct process *process)
         ;
 
     // detach all clients
-    LIST_FOREACH(client, &process->clients, process_clients) {
+    while ((client = LIST_FIRST(&process->clients)) != NULL) {
         process_detach(process, client);
     }
     
@@ -387,53 +1425,41 @@ void process_destroy (struct process *process)
  */
 static int process_reap_update (struct process *process, int status)
 {
-    // forget pid
-    process->pid = -1;
-
     // decode status
     if (WIFEXITED(status))
-        return process_update(process, PROCESS_EXIT, WEXITSTATUS(status));
+        return process_exited(process, PROCESS_EXIT, WEXITSTATUS(status));
 
     else if (WIFSIGNALED(status))
-        return process_update(process, PROCESS_KILL, WTERMSIG(status));
+        return process_exited(process, PROCESS_KILL, WTERMSIG(status));
 
     else
         // unkown status?!
         return 0;
 }
 
-int process_reap (struct daemon *daemon)
+int process_reap (struct shard *shard)
 {
     pid_t pid;
     int status;
-    struct process *process;
+    struct process *process, *next;
 
-    // figure out which child(ren) want(s) our attention
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        // find process
-        LIST_FOREACH(process, &daemon->processes, daemon_processes) {
-            if (process->pid == pid)
-                break;
-        }
+    // children with a pidfd are reaped by process_on_exit, so only wait on the specific children we need to, so as to
+    // not reap any of the others
+    for (process = LIST_FIRST(&shard->reaps); process; process = next) {
+        // removed once reaped
+        next = LIST_NEXT(process, shard_reaps);
 
-        if (!process) {
-            // eek, unknown child!
-            log_warn("Unknown child process updated!");
+        if ((pid = waitpid(process->pid, &status, WNOHANG)) < 0) {
+            // uh oh
+            return -1;
 
-        } else {
+        } else if (pid) {
             // update state
             if (process_reap_update(process, status))
                 return -1;
         }
     }
 
-    // ignore ECHILD: no children to wait on
-    if (pid < 0 && errno != ECHILD)
-        // uh oh
-        return -1;
-
-    else // pid >= 0
-        // ok
-        return 0;
+    // ok
+    return 0;
 }
-
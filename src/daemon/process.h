@@ -6,8 +6,100 @@
  */
 #include "shared/select.h"
 #include "shared/proto.h"
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <time.h>
+
+struct zygote_reply;
+
+/**
+ * Amount of output read from a process at a time while any attached client is limited to small frames
+ */
+#define PROCESS_READ_SIZE 4096
+
+/**
+ * Maximum amount of output read from a process at a time while all attached clients take large frames
+ */
+#define PROCESS_READ_MAX (256 * 1024)
+
+/**
+ * Size of the CMD_DATA header preceding the output data, for the given protocol version: message id, command, channel,
+ * and length prefix
+ */
+#define PROCESS_DATA_HEADER(version) (sizeof(uint32_t) + 2 * sizeof(uint16_t) + proto_data_prefix(version))
+
+/**
+ * Default amount of memory used for retaining recent output per process for replay to newly attached clients, in bytes
+ */
+#define PROCESS_SCROLLBACK (64 * 1024)
+
+/**
+ * Default limit on the amount of stdin data queued per process, in bytes
+ */
+#define PROCESS_STDIN_MAX (256 * 1024)
+
+/**
+ * How long to hold back the exit status of a process for the rest of its output, in ms. The output may never end, if
+ * the process left behind children of its own holding its stdout/err open.
+ */
+#define PROCESS_EXIT_TIMEOUT 1000
+
+/**
+ * Segment of stdin data waiting for the process to read it
+ */
+struct process_input {
+    /** Our entry in the process's stdin queue */
+    TAILQ_ENTRY(process_input) process_stdin;
+
+    /** Client waiting for the data to be written, if still around */
+    struct client *client;
+
+    /** Segment data, and how much of it has been written so far; an empty segment closes stdin */
+    size_t len, offset;
+    char buf[];
+};
+
+/**
+ * Chunk of process output retained in the scrollback
+ */
+struct process_chunk {
+    /** Output stream offset of the first byte of data */
+    uint64_t offset;
+
+    /** Channel the data was read from */
+    enum proto_channel channel;
+
+    /** Reference to the PROTO_V2 CMD_DATA frame the output was read into, or a compact copy of it, which ends with the
+     * len bytes of data */
+    struct proto_frame *frame;
+    size_t len;
+
+    /** The frame is encoded in host byte order */
+    bool native;
+
+    /** Our entry in the process's scrollback */
+    TAILQ_ENTRY(process_chunk) process_scrollback;
+};
+
+/**
+ * Chunk of process output being passed to attached clients
+ */
+struct process_data {
+    /** Channel the data was read from */
+    enum proto_channel channel;
+
+    /** Output data, empty for EOF */
+    const char *buf;
+    size_t len;
+
+    /** CMD_DATA frames encoded for the data so far, by byte order and protocol version */
+    struct proto_frame *frames[2][PROTO_VERSION + 1];
+
+    /** CMD_DATA_LZ frames, by byte order, or the data did not compress well */
+    struct proto_frame *frames_lz[2];
+    bool lz_skip;
+};
 
 /**
  * Info required for process exec
@@ -27,8 +119,8 @@ struct process_exec_info {
  * Per-process state
  */
 struct process {
-    /** Daemon state we are running under */
-    struct daemon *daemon;
+    /** Shard we are running on */
+    struct shard *shard;
 
     /** The process name */
     char *name;
@@ -36,31 +128,99 @@ struct process {
     /** Currently running process ID */
     pid_t pid;
 
-    /** stdin fd */
-    int std_in;
+    /** pidfd for the running process in select loop, to be notified of its exit, or -1 if not supported */
+    struct select_fd pid_fd;
+
+    /** stdin fd in select loop, only writable while there is queued data */
+    struct select_fd std_in;
+
+    /** Queued stdin segments waiting for the process to read them, and their total size */
+    TAILQ_HEAD(process_stdin, process_input) stdin_queue;
+    size_t stdin_size;
+
+    /** No more stdin data is accepted, after EOF or once the process has closed its stdin */
+    bool stdin_closed;
 
     /** stdout/err fds in select loop */
     struct select_fd std_out, std_err;
 
+    /** Number of attached clients that are not able to take any more output, pausing reads on stdout/err */
+    unsigned output_paused;
+
     /** Current status */
     enum proto_process_status status;
     int status_code;
 
+    /** Output stream offset, i.e. total number of stdout/err bytes read so far */
+    uint64_t output_offset;
+
+    /** Recent output, oldest first, and the total size of the frames holding it */
+    TAILQ_HEAD(process_scrollback, process_chunk) scrollback;
+    size_t scrollback_size;
+
+    /** Exit status, held back until all of the remaining output has been read, or the timer expires */
+    bool exit_pending;
+    enum proto_process_status exit_status;
+    int exit_code;
+    struct timer exit_timer;
+
     /** List of attached clients */
     LIST_HEAD(process_clients, client) clients;
 
-    /** Member of daemon process list */
-    LIST_ENTRY(process) daemon_processes;
+    /** Member of shard process list */
+    LIST_ENTRY(process) shard_processes;
+
+    /** Member of shard process ID index bucket, and the hash of our ID */
+    LIST_ENTRY(process) shard_process_ids;
+    uint32_t id_hash;
+
+    /** Member of shard list of processes without a pidfd, which are reaped on SIGCHLD */
+    LIST_ENTRY(process) shard_reaps;
+
+    /** Being spawned via the zygote: when the request was sent, and the client waiting for it, if any */
+    struct timespec spawn_time;
+    struct client *spawn_client;
+
+    /** Member of shard's list of processes being spawned via the zygote */
+    TAILQ_ENTRY(process) shard_spawns;
+
+    /** Failed to start, and released once reaped */
+    bool discarded;
+
+    /** Deferred release after cleanup */
+    struct select_defer release;
 };
 
 /**
  * Construct a new process state, and fork off to exec it with the given arguments/environment.
  *
- * @param daemon    daemon context
+ * @param shard     shard to run on
  * @param proc_ptr  returned process struct
  * @param exec_info info required for exec
  */
-int process_start (struct daemon *daemon, struct process **proc_ptr, const struct process_exec_info *exec_info);
+int process_start (struct shard *shard, struct process **proc_ptr, const struct process_exec_info *exec_info);
+
+/**
+ * Construct a new process state, and send a request to spawn it with the given arguments/environment to the shard's
+ * zygote.
+ *
+ * The process must be passed to process_on_spawn once the reply is received.
+ */
+int process_start_zygote (struct shard *shard, struct process **proc_ptr, const struct process_exec_info *exec_info);
+
+/**
+ * Complete spawning the process via the zygote with the given reply.
+ *
+ * On errors, the process must be released using process_discard.
+ */
+int process_on_spawn (struct process *process, const struct zygote_reply *reply);
+
+/**
+ * Release a process that failed to start, which must not have been added to the shard.
+ *
+ * Any child that was started for it is killed, and the process is released once the child has been reaped.
+ */
+void process_discard (struct process *process);
 
 /**
  * Return the opaque process ID as a NUL-terminated string
@@ -72,27 +232,67 @@ static inline const char *process_id (struct process *process)
 
 
 
+/**
+ * Return the CMD_DATA frame for the given output as encoded for the given protocol version and features, encoding it
+ * on first use. With PROTO_CAP_LZ, this is a CMD_DATA_LZ frame if the data compresses well, and with PROTO_CAP_NATIVE
+ * it is encoded in host byte order.
+ *
+ * The frame is shared by all clients using the same encoding, and is owned by the process_data.
+ */
+struct proto_frame *process_data_frame (struct process_data *data, enum proto_version version, enum proto_caps caps);
+
 /**
  * Attach this client to this process, streaming out stdout/err data
  */
 int process_attach (struct process *process, struct client *client);
 
+/**
+ * Return the output stream offset that a replay of the scrollback from the given offset would start at.
+ *
+ * This is later than the given offset if that part of the output is no longer retained, or the current output offset
+ * if the given offset is past the end of the output.
+ */
+uint64_t process_scrollback_start (struct process *process, uint64_t offset);
+
+/**
+ * Replay the retained output from the given offset onwards to the given attached client, as CMD_DATA.
+ */
+int process_replay (struct process *process, struct client *client, uint64_t offset);
+
 /**
  * Detach given process
  */
 void process_detach (struct process *process, struct client *client);
 
 /**
- * Send data to process stdin.
+ * Stop reading the process's output, until a matching process_output_resume.
+ *
+ * Used by attached clients that are not able to keep up with the output.
+ */
+int process_output_pause (struct process *process);
+
+/**
+ * Resume reading the process's output once no client has it paused anymore
+ */
+int process_output_resume (struct process *process);
+
+/**
+ * Send data to process stdin on behalf of the given client.
  *
- * This garuntees that the given data segment will be written atomically
+ * This garuntees that the given data segment will be written atomically, i.e. not interleaved with any other segments.
+ *
+ * Returns 0 if written, or 1 if queued until the process is able to read it, in which case client_on_process_stdin is
+ * called once it has been written. Fails with ENOBUFS if the process's stdin queue is full, or EPIPE if the process's
+ * stdin is closed.
  */
-int process_stdin_data (struct process *process, const char *buf, size_t len);
+int process_stdin_data (struct process *process, struct client *client, const char *buf, size_t len);
 
 /**
- * Close the process's stdin
+ * Close the process's stdin once any queued data has been written, on behalf of the given client.
+ *
+ * Returns 0 or 1 as per process_stdin_data.
  */
-int process_stdin_eof (struct process *process);
+int process_stdin_eof (struct process *process, struct client *client);
 
 /**
  * Send signal to process
@@ -105,8 +305,9 @@ int process_kill (struct process *process, int sig);
 void process_destroy (struct process *process);
 
 /**
- * Poll for changes in process state after SIGCHLD; this will greedily reap all children
+ * Poll for changes in process state after SIGCHLD; this will greedily reap all of the shard's children that are not
+ * tracked using a pidfd, which are reaped as their pidfd becomes readable instead.
  */
-int process_reap (struct daemon *daemon);
+int process_reap (struct shard *shard);
 
 #endif
@@ -6,10 +6,15 @@
 #include "shared/util.h"
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <errno.h>
 
 /**
@@ -25,14 +30,24 @@ static inline int service_sock (struct service *service)
  */
 static const char *service_name (struct service *service)
 {
-    static char name[512];
-    struct sockaddr_un sa;
-    socklen_t sa_len = sizeof(sa);
+    static char name[NI_MAXHOST + 1 + NI_MAXSERV];
+    struct sockaddr_storage ss;
+    struct sockaddr_un *sun = (struct sockaddr_un *) &ss;
+    socklen_t ss_len = sizeof(ss);
+    char host[NI_MAXHOST], port[NI_MAXSERV];
 
-    if (getsockname(service_sock(service), (struct sockaddr *) &sa, &sa_len) < 0)
+    if (getsockname(service_sock(service), (struct sockaddr *) &ss, &ss_len) < 0)
         return "";
 
-    strncpy(name, sa.sun_path, sizeof(name));
+    if (ss.ss_family == AF_UNIX) {
+        strncpy(name, sun->sun_path, sizeof(name));
+
+    } else if (getnameinfo((struct sockaddr *) &ss, ss_len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+        snprintf(name, sizeof(name), "%s:%s", host, port);
+
+    } else {
+        return "";
+    }
 
     return name;
 }
@@ -44,17 +59,21 @@ static int service_on_accept (int fd, short what, void *arg)
 {
     struct service *service = arg;
 
-    int client_sock;
+    int client_sock, nodelay = 1;
 
-    // try accept()
-    if ((client_sock = accept(fd, NULL, 0)) < 0)
+    // try accept(), without leaking the socket into processes spawned by other shards in the meantime
+    if ((client_sock = select_accept(&service->fd)) < 0)
         return SELECT_ERR;
 
     log_info("Accept service connection on [%s]: fd=%d", service_name(service), client_sock);
+
+    // replies and output are sent as soon as they are ready
+    if (service->stream && setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0)
+        log_warn_errno("setsockopt TCP_NODELAY");
     
     // construct client state
-    if (client_add_seqpacket(service->daemon, client_sock) < 0) {
-        log_warn("Dropping client connection: client_add_seqpacket: %s", strerror(errno));
+    if ((service->stream ? client_add_stream(service->daemon, client_sock) : client_add_seqpacket(service->daemon, client_sock)) < 0) {
+        log_warn("Dropping client connection: client_add: %s", strerror(errno));
 
         close(client_sock);
 
@@ -64,6 +83,16 @@ static int service_on_accept (int fd, short what, void *arg)
     return SELECT_OK;
 }
 
+/**
+ * Release the service state, once the select loop is done with it
+ */
+static void service_release (void *arg)
+{
+    struct service *service = arg;
+
+    free(service);
+}
+
 int service_open_unix (struct daemon *daemon, struct service **service_ptr, const char *path)
 {
     struct service *service = NULL;
@@ -88,10 +117,15 @@ int service_open_unix (struct daemon *daemon, struct service **service_ptr, cons
 
     // init
     service->daemon = daemon;
+    select_fd_init(&service->fd, -1, FD_READ, service_on_accept, service);
+    select_fd_op(&service->fd, SELECT_OP_ACCEPT);
+    select_defer_init(&service->release, service_release, service);
 
     // construct socket
     if ((sock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
         goto error;
+
+    service->fd.fd = sock;
     
     // test for existing socket
     if (stat(path, &st) < 0) {
@@ -121,11 +155,9 @@ int service_open_unix (struct daemon *daemon, struct service **service_ptr, cons
     if (fd_flags(sock, O_NONBLOCK|O_CLOEXEC))
         goto error;
 
-    // init selectable
-    select_fd_init(&service->fd, sock, FD_READ, service_on_accept, service);
-
     // activate
-    select_loop_add(&daemon->select_loop, &service->fd);
+    if (select_loop_add(&daemon->select_loop, &service->fd))
+        goto error;
 
     // ok
     *service_ptr = service;
@@ -140,17 +172,104 @@ error:
     return -1;
 }
 
+/**
+ * Construct a listening TCP socket for the given address
+ */
+static int service_listen_tcp (const struct addrinfo *ai)
+{
+    int sock, reuse = 1;
+
+    // construct socket
+    if ((sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+        return -1;
+
+    // restart without waiting for old connections to time out
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+        goto error;
+
+    // bind to address
+    if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0)
+        goto error;
+
+    // and do listen
+    if (listen(sock, SERVICE_LISTEN_BACKLOG) < 0)
+        goto error;
+
+    // set flags
+    if (fd_flags(sock, O_NONBLOCK|O_CLOEXEC))
+        goto error;
+
+    return sock;
+
+error:
+    close(sock);
+
+    return -1;
+}
+
+int service_open_tcp (struct daemon *daemon, struct service **service_ptr, const char *host, const char *port)
+{
+    struct service *service = NULL;
+    // not AI_PASSIVE, as anyone able to connect can run commands: a NULL host is the loopback address
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *ai = NULL, *addr;
+    int sock = -1, err;
+
+    // resolve
+    if ((err = getaddrinfo(host, port, &hints, &ai))) {
+        if (err != EAI_SYSTEM)
+            errno = EADDRNOTAVAIL;
+
+        return -1;
+    }
+
+    // alloc
+    if ((service = calloc(1, sizeof(*service))) == NULL)
+        goto error;  // ENOMEM
+
+    // init
+    service->daemon = daemon;
+    service->stream = true;
+    select_fd_init(&service->fd, -1, FD_READ, service_on_accept, service);
+    select_fd_op(&service->fd, SELECT_OP_ACCEPT);
+    select_defer_init(&service->release, service_release, service);
+
+    // listen on the first address that works
+    for (addr = ai; addr && sock < 0; addr = addr->ai_next)
+        sock = service_listen_tcp(addr);
+
+    if (sock < 0)
+        goto error;
+
+    service->fd.fd = sock;
+
+    // activate
+    if (select_loop_add(&daemon->select_loop, &service->fd))
+        goto error;
+
+    freeaddrinfo(ai);
+
+    // ok
+    *service_ptr = service;
+
+    return 0;
+
+error:
+    // cleanup
+    freeaddrinfo(ai);
+
+    if (service)
+        service_destroy(service);
+
+    return -1;
+}
+
 void service_destroy (struct service *service)
 {
-    // remove from select loop
-    // XXX: still unsafe
-    select_loop_del(&service->daemon->select_loop, &service->fd);
-    
-    // close socket
-    if (service->fd.fd >= 0)
-        close(service->fd.fd);
+    // remove from select loop, and close socket
+    select_loop_close(&service->daemon->select_loop, &service->fd);
     
     // release
-    free(service);
+    select_loop_defer(&service->daemon->select_loop, &service->release);
 }
 
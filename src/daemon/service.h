@@ -8,6 +8,8 @@
  */
 #include "shared/select.h"
 
+#include <stdbool.h>
+
 /**
  * Listen backlog used
  */
@@ -23,6 +25,12 @@ struct service {
     /** socket IO info */
     struct select_fd fd;
 
+    /** Connections are SOCK_STREAM, using length-prefixed messages */
+    bool stream;
+
+    /** Deferred release after destroy */
+    struct select_defer release;
+
     /** List member */
     LIST_ENTRY(service) daemon_services;
 };
@@ -39,7 +47,22 @@ struct service {
  */
 int service_open_unix (struct daemon *daemon, struct service **service_ptr, const char *path);
 
-
+/**
+ * Construct a new service listen()'ing on the given TCP host and port.
+ *
+ * Each message on the resulting SOCK_STREAM connections is framed using a uint32_t length prefix, and TCP_NODELAY is
+ * set on each connection.
+ *
+ * Connections are not authenticated, so listening on anything but the loopback address requires an explicit host. The
+ * first of the host's addresses that can be listened on is used.
+ *
+ * @param daemon shared daemon state
+ * @param service_ptr returned service struct
+ * @param host local address to listen on, or NULL for the loopback address
+ * @param port TCP port number or service name
+ * @return zero on success, <0 on error
+ */
+int service_open_tcp (struct daemon *daemon, struct service **service_ptr, const char *host, const char *port);
 
 /**
  * Close the service socket and release any resources associated with the service itself
@@ -0,0 +1,450 @@
+#define _GNU_SOURCE
+#include "shard.h"
+#include "daemon.h"
+#include "process.h"
+#include "client.h"
+#include "zygote.h"
+#include "shared/log.h"
+#include "shared/proto.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+
+void shard_msg_init (struct shard_msg *msg, shard_func func, void *arg)
+{
+    msg->func = func;
+    msg->arg = arg;
+    msg->pending = false;
+}
+
+/**
+ * Run all queued messages
+ */
+static int shard_on_mailbox (int fd, short what, void *arg)
+{
+    struct shard *shard = arg;
+    struct shard_msg *msg;
+    uint64_t count;
+
+    // clear wakeup
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return -1;
+
+    while (true) {
+        // take the next message
+        pthread_mutex_lock(&shard->mailbox_lock);
+
+        if ((msg = TAILQ_FIRST(&shard->mailbox)) != NULL) {
+            TAILQ_REMOVE(&shard->mailbox, msg, shard_mailbox);
+
+            msg->pending = false;
+        }
+
+        pthread_mutex_unlock(&shard->mailbox_lock);
+
+        if (!msg)
+            break;
+
+        // the handler may release the message
+        msg->func(shard, msg->arg);
+    }
+
+    return 0;
+}
+
+/**
+ * Stop the worker thread once the current select_loop_run returns
+ */
+static void shard_on_stop (struct shard *shard, void *arg)
+{
+    shard->stopped = true;
+}
+
+/**
+ * Reap any processes that are not tracked using a pidfd after SIGCHLD
+ */
+static void shard_on_reap (struct shard *shard, void *arg)
+{
+    if (process_reap(shard))
+        log_warn_errno("[%u] process_reap", shard->index);
+}
+
+/**
+ * Hash a process ID for the shard's process index, using FNV-1a
+ */
+static uint32_t shard_process_hash (const char *proc_id)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *proc_id; proc_id++) {
+        hash ^= (unsigned char) *proc_id;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Double the number of buckets in the process index, rehashing the existing entries
+ */
+static int shard_process_grow (struct shard *shard)
+{
+    unsigned size = shard->process_ids_size * 2;
+    struct shard_process_ids *buckets;
+    struct process *process;
+
+    if ((buckets = calloc(size, sizeof(*buckets))) == NULL)
+        return -1;
+
+    LIST_FOREACH(process, &shard->processes, shard_processes) {
+        LIST_INSERT_HEAD(&buckets[process->id_hash & (size - 1)], process, shard_process_ids);
+    }
+
+    free(shard->process_ids);
+
+    shard->process_ids = buckets;
+    shard->process_ids_size = size;
+
+    return 0;
+}
+
+/**
+ * Add a newly started process to the shard's process list and index
+ */
+static void shard_add_process (struct shard *shard, struct process *process)
+{
+    // keep the chains short
+    if (shard->processes_count >= shard->process_ids_size * SHARD_PROCESS_LOAD && shard_process_grow(shard))
+        log_warn_errno("[%u] shard_process_grow", shard->index);
+
+    process->id_hash = shard_process_hash(process_id(process));
+
+    LIST_INSERT_HEAD(&shard->processes, process, shard_processes);
+    LIST_INSERT_HEAD(&shard->process_ids[process->id_hash & (shard->process_ids_size - 1)], process, shard_process_ids);
+
+    shard->processes_count++;
+}
+
+/**
+ * Spawn via the zygote completed with the given error, if any
+ */
+static void shard_spawned (struct shard *shard, struct process *process, int err)
+{
+    struct client *client = process->spawn_client;
+
+    process->spawn_client = NULL;
+
+    if (!err)
+        // running
+        shard_add_process(shard, process);
+
+    if (client)
+        client_on_spawn(client, process, err);
+
+    if (err)
+        process_discard(process);
+}
+
+/**
+ * Zygote went away, fail any outstanding spawns and spawn directly from now on
+ */
+static void shard_zygote_lost (struct shard *shard)
+{
+    struct process *process;
+
+    log_warn("[%u] Lost zygote, spawning processes directly", shard->index);
+
+    select_loop_close(shard->select_loop, &shard->zygote_fd);
+
+    while ((process = TAILQ_FIRST(&shard->spawns)) != NULL) {
+        TAILQ_REMOVE(&shard->spawns, process, shard_spawns);
+
+        shard_spawned(shard, process, EPIPE);
+    }
+}
+
+/**
+ * Replies from the zygote
+ */
+static int shard_on_zygote (int fd, short what, void *arg)
+{
+    struct shard *shard = arg;
+    struct zygote_reply reply;
+    struct process *process;
+    int ret;
+
+    while (true) {
+        if ((ret = zygote_recv(fd, &reply)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            log_warn_errno("[%u] zygote_recv", shard->index);
+
+            shard_zygote_lost(shard);
+
+            return 0;
+
+        } else if (ret) {
+            shard_zygote_lost(shard);
+
+            return 0;
+        }
+
+        if ((process = TAILQ_FIRST(&shard->spawns)) == NULL) {
+            log_warn("[%u] Unexpected reply from zygote for pid=%d", shard->index, reply.pid);
+
+            zygote_reply_close(&reply);
+
+            continue;
+        }
+
+        TAILQ_REMOVE(&shard->spawns, process, shard_spawns);
+
+        shard_spawned(shard, process, process_on_spawn(process, &reply) ? errno : 0);
+    }
+}
+
+int shard_init (struct shard *shard, struct daemon *daemon, unsigned index, struct select_loop *loop, enum select_backend backend)
+{
+    int fd;
+
+    shard->daemon = daemon;
+    shard->index = index;
+
+    LIST_INIT(&shard->processes);
+    LIST_INIT(&shard->reaps);
+    shard->processes_count = 0;
+
+    // empty buckets are all-zero
+    if ((shard->process_ids = calloc(SHARD_PROCESS_IDS, sizeof(*shard->process_ids))) == NULL)
+        return -1;
+
+    shard->process_ids_size = SHARD_PROCESS_IDS;
+
+    // warm buffers shared by all clients on this shard
+    if ((shard->recv = proto_batch_new(daemon->options.client_recv_batch)) == NULL)
+        return -1;
+
+    if ((errno = posix_memalign((void **) &shard->reply_buf, PROTO_BUF_ALIGN, ND_PROTO_MSG_MAX)))
+        return -1;
+
+    TAILQ_INIT(&shard->mailbox);
+    TAILQ_INIT(&shard->spawns);
+    shard_msg_init(&shard->reap_msg, shard_on_reap, NULL);
+    shard_msg_init(&shard->stop_msg, shard_on_stop, NULL);
+    shard->stopped = false;
+
+    if ((errno = pthread_mutex_init(&shard->mailbox_lock, NULL)))
+        return -1;
+
+    if (loop) {
+        // run within the given loop
+        shard->select_loop = loop;
+        shard->threaded = false;
+
+    } else {
+        // run our own loop in our own thread
+        if (select_loop_init(&shard->loop, backend))
+            return -1;
+
+        shard->select_loop = &shard->loop;
+        shard->threaded = true;
+    }
+
+    // mailbox
+    if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+
+    select_fd_init(&shard->mailbox_fd, fd, FD_READ, shard_on_mailbox, shard);
+
+    if (select_loop_add(shard->select_loop, &shard->mailbox_fd))
+        return -1;
+
+    // zygote
+    if (daemon->options.zygote) {
+        select_fd_init(&shard->zygote_fd, daemon->zygote.socks[index], FD_READ, shard_on_zygote, shard);
+
+        if (select_loop_add(shard->select_loop, &shard->zygote_fd))
+            return -1;
+    }
+
+    // ok
+    return 0;
+}
+
+/**
+ * Worker thread main loop
+ */
+static void *shard_main (void *arg)
+{
+    struct shard *shard = arg;
+
+    while (!shard->stopped) {
+        // wait for activity on FDs
+        if (select_loop_run(shard->select_loop, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            // select/handling raised system error, which is as fatal as in the main loop
+            log_errno("[%u] select_loop_run", shard->index);
+
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return NULL;
+}
+
+int shard_start (struct shard *shard)
+{
+    if (!shard->threaded)
+        // runs on the main loop
+        return 0;
+
+    if ((errno = pthread_create(&shard->thread, NULL, shard_main, shard)))
+        return -1;
+
+    log_info("[%u] Started worker thread", shard->index);
+
+    // ok
+    return 0;
+}
+
+int shard_stop (struct shard *shard)
+{
+    if (!shard->threaded)
+        return 0;
+
+    if (shard_send(shard, &shard->stop_msg))
+        return -1;
+
+    if ((errno = pthread_join(shard->thread, NULL)))
+        return -1;
+
+    log_info("[%u] Stopped worker thread", shard->index);
+
+    // ok
+    return 0;
+}
+
+int shard_send (struct shard *shard, struct shard_msg *msg)
+{
+    uint64_t wakeup = 1;
+    bool empty;
+
+    pthread_mutex_lock(&shard->mailbox_lock);
+
+    if (msg->pending) {
+        // already queued
+        pthread_mutex_unlock(&shard->mailbox_lock);
+
+        return 0;
+    }
+
+    empty = TAILQ_EMPTY(&shard->mailbox);
+
+    TAILQ_INSERT_TAIL(&shard->mailbox, msg, shard_mailbox);
+
+    msg->pending = true;
+
+    pthread_mutex_unlock(&shard->mailbox_lock);
+
+    // the shard drains its mailbox until empty, so it only needs to be woken up for the first message
+    if (empty && write(shard->mailbox_fd.fd, &wakeup, sizeof(wakeup)) < 0 && errno != EAGAIN) {
+        int err = errno;
+
+        pthread_mutex_lock(&shard->mailbox_lock);
+
+        if (!msg->pending) {
+            // already taken by the shard while draining its mailbox
+            err = 0;
+        } else {
+            // unqueue, so that the caller can handle the failure
+            TAILQ_REMOVE(&shard->mailbox, msg, shard_mailbox);
+
+            msg->pending = false;
+        }
+
+        pthread_mutex_unlock(&shard->mailbox_lock);
+
+        if (err) {
+            errno = err;
+
+            return -1;
+        }
+    }
+
+    // ok
+    return 0;
+}
+
+struct shard *shard_next (struct shard *shard)
+{
+    struct daemon *daemon = shard->daemon;
+
+    return &daemon->shards[(shard->index + 1) % daemon->shards_count];
+}
+
+int shard_process_start (struct shard *shard, struct process **proc_ptr, const struct process_exec_info *exec_info)
+{
+    struct process *process;
+
+    // start
+    if (process_start(shard, &process, exec_info))
+        return -1;
+
+    // add
+    shard_add_process(shard, process);
+
+    // ok
+    *proc_ptr = process;
+
+    return 0;
+}
+
+int shard_process_spawn (struct shard *shard, struct process **proc_ptr, const struct process_exec_info *exec_info)
+{
+    struct process *process;
+
+    if (!select_fd_active(&shard->zygote_fd)) {
+        errno = ENOTCONN;
+
+        return -1;
+    }
+
+    // send request
+    if (process_start_zygote(shard, &process, exec_info))
+        return -1;
+
+    // wait for reply
+    TAILQ_INSERT_TAIL(&shard->spawns, process, shard_spawns);
+
+    *proc_ptr = process;
+
+    return 0;
+}
+
+struct process *shard_find_process (struct shard *shard, const char *proc_id)
+{
+    uint32_t hash = shard_process_hash(proc_id);
+    struct process *process;
+
+    LIST_FOREACH(process, &shard->process_ids[hash & (shard->process_ids_size - 1)], shard_process_ids) {
+        // match
+        if (process->id_hash == hash && strcmp(process_id(process), proc_id) == 0)
+            break;
+    }
+
+    return process;
+}
+
+void shard_remove_process (struct shard *shard, struct process *process)
+{
+    LIST_REMOVE(process, shard_processes);
+    LIST_REMOVE(process, shard_process_ids);
+
+    shard->processes_count--;
+}
@@ -0,0 +1,181 @@
+#ifndef DAEMON_SHARD_H
+#define DAEMON_SHARD_H
+
+/**
+ * @file
+ *
+ * Event loop shards.
+ *
+ * Each shard owns a select loop, along with the processes running on it and the clients attached to them. With worker
+ * threads, each shard runs its own select loop in its own thread; otherwise the single shard runs on the daemon's main
+ * loop.
+ *
+ * Shards never touch each other's state. Cross-shard operations are performed by passing a shard_msg to the other
+ * shard's mailbox, which is then run from within that shard's select loop.
+ */
+#include "shared/select.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+
+/**
+ * Initial number of buckets in the process ID index
+ */
+#define SHARD_PROCESS_IDS 64
+
+/**
+ * Average number of processes per index bucket before growing the index
+ */
+#define SHARD_PROCESS_LOAD 2
+
+struct shard;
+struct daemon;
+struct process;
+struct process_exec_info;
+
+/**
+ * Message handler, run from within the receiving shard's select loop.
+ *
+ * The shard_msg is no longer queued when this is called, and may be re-sent or released.
+ */
+typedef void (*shard_func) (struct shard *shard, void *arg);
+
+/**
+ * Per-message state, embedded in whatever object is being passed
+ */
+struct shard_msg {
+    /** Handler */
+    shard_func func;
+    void *arg;
+
+    /** Queued in a mailbox */
+    bool pending;
+
+    /** Our entry in the shard's mailbox */
+    TAILQ_ENTRY(shard_msg) shard_mailbox;
+};
+
+/**
+ * Per-shard state
+ */
+struct shard {
+    /** Daemon we are running under */
+    struct daemon *daemon;
+
+    /** Index into the daemon's shards */
+    unsigned index;
+
+    /** The select loop we are running on */
+    struct select_loop *select_loop;
+
+    /** Our own select loop, if running in our own thread */
+    struct select_loop loop;
+
+    /** Worker thread, if any */
+    bool threaded;
+    pthread_t thread;
+
+    /** List of running processes */
+    LIST_HEAD(shard_processes, process) processes;
+    unsigned processes_count;
+
+    /** Hash index of running processes by process ID, with a power-of-two number of buckets */
+    LIST_HEAD(shard_process_ids, process) *process_ids;
+    unsigned process_ids_size;
+
+    /** Running processes without a pidfd, which must be reaped on SIGCHLD */
+    LIST_HEAD(shard_reaps, process) reaps;
+
+    /** Queue of incoming messages, and its lock */
+    TAILQ_HEAD(shard_mailbox, shard_msg) mailbox;
+    pthread_mutex_t mailbox_lock;
+
+    /** eventfd used to wake up the shard's select loop for new messages */
+    struct select_fd mailbox_fd;
+
+    /** Message used to reap processes after SIGCHLD */
+    struct shard_msg reap_msg;
+
+    /** Message used to stop the worker thread, and set once it has been handled */
+    struct shard_msg stop_msg;
+    bool stopped;
+
+    /** Our socket to the zygote, if in use */
+    struct select_fd zygote_fd;
+
+    /** Processes being spawned via the zygote, in request order */
+    TAILQ_HEAD(shard_spawns, process) spawns;
+
+    /** Requests received from whichever client is being read, reused for each read */
+    struct proto_batch *recv;
+
+    /** ND_PROTO_MSG_MAX buffer used to encode the reply to the request being handled */
+    char *reply_buf;
+
+    /** RING_MSG_MAX buffer that requests are copied into from the rings of PROTO_CAP_RING clients, once needed */
+    char *ring_buf;
+};
+
+/**
+ * Set up shard_msg values
+ */
+void shard_msg_init (struct shard_msg *msg, shard_func func, void *arg);
+
+/**
+ * Initialize the given shard.
+ *
+ * @param shard     shard to initialize
+ * @param daemon    daemon we are running under
+ * @param index     index into the daemon's shards
+ * @param loop      select loop to run on, or NULL to use our own loop in a worker thread
+ * @param backend   select loop backend to use for our own loop
+ */
+int shard_init (struct shard *shard, struct daemon *daemon, unsigned index, struct select_loop *loop, enum select_backend backend);
+
+/**
+ * Start the shard's worker thread, if it has one
+ */
+int shard_start (struct shard *shard);
+
+/**
+ * Stop the shard's worker thread, if it has one, and wait for it to exit. Any processes and clients remain on the shard.
+ */
+int shard_stop (struct shard *shard);
+
+/**
+ * Queue the given message to be run by the given shard. This is safe to call from any thread.
+ *
+ * Does nothing if the message is already queued. On error, the message is not queued.
+ */
+int shard_send (struct shard *shard, struct shard_msg *msg);
+
+/**
+ * Return the next shard after this one, wrapping around
+ */
+struct shard *shard_next (struct shard *shard);
+
+/**
+ * Start a new process on this shard with the given parameters.
+ */
+int shard_process_start (struct shard *shard, struct process **proc_ptr, const struct process_exec_info *exec_info);
+
+/**
+ * Start spawning a new process on this shard via the zygote. The process is added to the shard once spawned, and
+ * client_on_spawn is called for its process->spawn_client, if any.
+ *
+ * Fails with ENOTCONN if the shard is not using the zygote.
+ */
+int shard_process_spawn (struct shard *shard, struct process **proc_ptr, const struct process_exec_info *exec_info);
+
+/**
+ * Find and return a process on this shard with the given ID, or NULL
+ */
+struct process *shard_find_process (struct shard *shard, const char *process_id);
+
+/**
+ * Remove a process from this shard's process list and index, once it is no longer running.
+ */
+void shard_remove_process (struct shard *shard, struct process *process);
+
+#endif
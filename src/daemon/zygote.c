@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include "zygote.h"
+#include "shared/proto.h"
+#include "shared/signal.h"
+#include "shared/util.h"
+#include "shared/log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <linux/sched.h>
+#include <errno.h>
+
+/**
+ * Number of fds passed back in a successful reply: pidfd, stdin, stdout, stderr
+ */
+#define ZYGOTE_REPLY_FDS 4
+
+/**
+ * Exec the spawned process, reporting any error back to the zygote over the given O_CLOEXEC pipe
+ */
+static void zygote_exec (const struct process_exec_info *exec_info, int std_in, int std_out, int std_err, int err_fd)
+    __attribute__ ((noreturn));
+
+static void zygote_exec (const struct process_exec_info *exec_info, int std_in, int std_out, int std_err, int err_fd)
+{
+    struct sigaction action = { .sa_handler = SIG_DFL };
+    sigset_t mask;
+    int sig, err;
+
+    // restore signals that the daemon ignores
+    signal_child_default(&mask);
+
+    for (sig = 1; sig < NSIG; sig++) {
+        if (sigismember(&mask, sig) == 1 && sigaction(sig, &action, NULL))
+            goto error;
+    }
+
+    // unblock the signals that the daemon receives via signalfd
+    signal_child_mask(&mask);
+
+    if (sigprocmask(SIG_SETMASK, &mask, NULL))
+        goto error;
+
+    // setup stdin/out/err fds, which clears their O_CLOEXEC
+    if (
+            dup2(std_in,  STDIN_FILENO ) < 0
+        ||  dup2(std_out, STDOUT_FILENO) < 0
+        ||  dup2(std_err, STDERR_FILENO) < 0
+    )
+        goto error;
+
+#ifdef SYS_close_range
+    // close anything else that was not already O_CLOEXEC, keeping the error pipe
+    if (err_fd > STDERR_FILENO + 1)
+        syscall(SYS_close_range, STDERR_FILENO + 1, err_fd - 1, 0);
+
+    syscall(SYS_close_range, err_fd + 1, ~0U, 0);
+#endif
+
+    // exec
+    // XXX: char-constness fails here
+    execve(exec_info->path, (char **) exec_info->argv, (char **) exec_info->envp);
+
+error:
+    err = errno;
+
+    // report back, and let the daemon reap us. If this fails, the daemon still sees us exit without having exec'd, so
+    // the result is ignored, which warn_unused_result only allows for a negated call
+    (void) !write(err_fd, &err, sizeof(err));
+
+    _exit(127);
+}
+
+/**
+ * Spawn a new process for the daemon, filling in the reply
+ */
+static void zygote_spawn (const struct process_exec_info *exec_info, struct zygote_reply *reply)
+{
+    int exec_in = -1, exec_out = -1, exec_err = -1, err_read = -1, err_write = -1;
+    struct clone_args args = { };
+    ssize_t ret;
+    int err;
+
+    reply->err = 0;
+    reply->pid = -1;
+    reply->pid_fd = reply->std_in = reply->std_out = reply->std_err = -1;
+
+    // create stdin/out/err pipes, and the pipe used to report exec errors
+    if (
+            make_pipe(&exec_in, &reply->std_in)
+        ||  make_pipe(&reply->std_out, &exec_out)
+        ||  make_pipe(&reply->std_err, &exec_err)
+        ||  make_pipe(&err_read, &err_write)
+    )
+        goto error;
+
+    // set flags on the daemon's ends
+    if (
+            fd_flags(reply->std_in,  O_NONBLOCK)
+        ||  fd_flags(reply->std_out, O_NONBLOCK)
+        ||  fd_flags(reply->std_err, O_NONBLOCK)
+    )
+        goto error;
+
+    // clone as a child of the daemon; the exit signal is the same as ours
+    args.flags = CLONE_PIDFD | CLONE_PARENT;
+    args.pidfd = (uintptr_t) &reply->pid_fd;
+
+    if ((reply->pid = syscall(SYS_clone3, &args, sizeof(args))) < 0) {
+        goto error;
+
+    } else if (reply->pid == 0) {
+        // child performs exec()
+        zygote_exec(exec_info, exec_in, exec_out, exec_err, err_write);
+    }
+
+    // clean up child's pipes
+    close(exec_in);
+    close(exec_out);
+    close(exec_err);
+    close(err_write);
+
+    exec_in = exec_out = exec_err = err_write = -1;
+
+    // wait for exec, which closes the error pipe
+    if ((ret = read(err_read, &err, sizeof(err))) < 0)
+        goto error;
+
+    close(err_read);
+
+    if (ret == sizeof(err)) {
+        // exec failed, and the child exits
+        reply->err = err;
+
+        goto fail;
+    }
+
+    return;
+
+error:
+    reply->err = errno;
+
+    if (err_read >= 0)
+        close(err_read);
+
+    if (err_write >= 0)
+        close(err_write);
+
+    if (exec_in >= 0)
+        close(exec_in);
+
+    if (exec_out >= 0)
+        close(exec_out);
+
+    if (exec_err >= 0)
+        close(exec_err);
+
+fail:
+    // the pidfd is still passed back, if the child exists, for it to be reaped
+    if (reply->std_in >= 0)
+        close(reply->std_in);
+
+    if (reply->std_out >= 0)
+        close(reply->std_out);
+
+    if (reply->std_err >= 0)
+        close(reply->std_err);
+
+    reply->std_in = reply->std_out = reply->std_err = -1;
+}
+
+/**
+ * Decode a uint16_t-count-prefixed array of strings, returning a NULL-terminated array that must be free'd
+ */
+static int zygote_decode_strs (struct proto_msg *msg, const char ***strs_ptr)
+{
+    const char **strs;
+    uint16_t count, i;
+
+    if (proto_read_uint16(msg, &count))
+        return -1;
+
+    if ((strs = calloc(count + 1, sizeof(*strs))) == NULL)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        if (proto_read_str(msg, &strs[i])) {
+            free(strs);
+
+            return -1;
+        }
+    }
+
+    *strs_ptr = strs;
+
+    return 0;
+}
+
+/**
+ * Handle one request from the daemon, and send back the reply.
+ *
+ * Returns 1 on EOF.
+ */
+static int zygote_serve (int sock)
+{
+    char buf[ND_PROTO_MSG_MAX];
+    char cmsg_buf[CMSG_SPACE(sizeof(int) * ZYGOTE_REPLY_FDS)] = { };
+    struct process_exec_info exec_info = { };
+    struct zygote_reply reply;
+    struct proto_msg msg;
+    struct msghdr msghdr = { };
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int fds[ZYGOTE_REPLY_FDS], nfds = 0;
+    ssize_t ret;
+
+    if ((ret = recv(sock, buf, sizeof(buf), 0)) < 0)
+        return -1;
+
+    else if (!ret)
+        return 1;
+
+    // decode request
+    if (
+            proto_msg_init(&msg, buf, ret)
+        ||  proto_read_str(&msg, &exec_info.path)
+        ||  zygote_decode_strs(&msg, &exec_info.argv)
+        ||  zygote_decode_strs(&msg, &exec_info.envp)
+    ) {
+        reply.err = errno;
+        reply.pid = -1;
+
+    } else {
+        zygote_spawn(&exec_info, &reply);
+    }
+
+    free(exec_info.argv);
+    free(exec_info.envp);
+
+    // encode reply
+    if (
+            proto_msg_init(&msg, buf, sizeof(buf))
+        ||  proto_write_int32(&msg, reply.err)
+        ||  proto_write_int32(&msg, reply.pid)
+    )
+        return -1;
+
+    iov.iov_base = msg.buf;
+    iov.iov_len = msg.offset;
+
+    msghdr.msg_iov = &iov;
+    msghdr.msg_iovlen = 1;
+
+    if (reply.pid > 0) {
+        fds[nfds++] = reply.pid_fd;
+
+        if (!reply.err) {
+            fds[nfds++] = reply.std_in;
+            fds[nfds++] = reply.std_out;
+            fds[nfds++] = reply.std_err;
+        }
+
+        msghdr.msg_control = cmsg_buf;
+        msghdr.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        cmsg = CMSG_FIRSTHDR(&msghdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    ret = sendmsg(sock, &msghdr, MSG_NOSIGNAL);
+
+    // the daemon has its own copies now
+    while (nfds > 0)
+        close(fds[--nfds]);
+
+    if (ret < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Zygote main loop, serving requests until the daemon goes away
+ */
+static void zygote_main (int *socks, unsigned count)
+    __attribute__ ((noreturn));
+
+static void zygote_main (int *socks, unsigned count)
+{
+    struct pollfd *pollfds;
+    unsigned i;
+    int ret;
+
+    // do not outlive the daemon
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL))
+        FATAL_ERRNO("prctl");
+
+    if ((pollfds = calloc(count, sizeof(*pollfds))) == NULL)
+        FATAL_ERRNO("calloc");
+
+    for (i = 0; i < count; i++) {
+        pollfds[i].fd = socks[i];
+        pollfds[i].events = POLLIN;
+    }
+
+    while (true) {
+        if (poll(pollfds, count, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            FATAL_ERRNO("poll");
+        }
+
+        for (i = 0; i < count; i++) {
+            if (!pollfds[i].revents)
+                continue;
+
+            if ((ret = zygote_serve(socks[i])) < 0)
+                FATAL_ERRNO("zygote_serve");
+
+            else if (ret)
+                // daemon closed its end
+                _exit(EXIT_SUCCESS);
+        }
+    }
+}
+
+int zygote_start (struct zygote *zygote, unsigned count)
+{
+    int *zygote_socks, fds[2];
+    unsigned i;
+
+    zygote->count = count;
+
+    if ((zygote->socks = calloc(count, sizeof(*zygote->socks))) == NULL)
+        return -1;
+
+    if ((zygote_socks = calloc(count, sizeof(*zygote_socks))) == NULL)
+        return -1;
+
+    // one socket per shard
+    for (i = 0; i < count; i++) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds))
+            return -1;
+
+        zygote->socks[i] = fds[0];
+        zygote_socks[i] = fds[1];
+    }
+
+    // fork off
+    if ((zygote->pid = fork()) < 0) {
+        return -1;
+
+    } else if (zygote->pid == 0) {
+        // close daemon's sockets
+        for (i = 0; i < count; i++)
+            close(zygote->socks[i]);
+
+        zygote_main(zygote_socks, count);
+    }
+
+    // close zygote's sockets
+    for (i = 0; i < count; i++)
+        close(zygote_socks[i]);
+
+    free(zygote_socks);
+
+    for (i = 0; i < count; i++) {
+        if (fd_flags(zygote->socks[i], O_NONBLOCK))
+            return -1;
+    }
+
+    log_info("Started zygote with pid=%d", zygote->pid);
+
+    return 0;
+}
+
+int zygote_send (int sock, const struct process_exec_info *exec_info)
+{
+    char buf[ND_PROTO_MSG_MAX];
+    struct proto_msg msg;
+
+    // encode request
+    if (
+            proto_msg_init(&msg, buf, sizeof(buf))
+        ||  proto_write_str(&msg, exec_info->path)
+        ||  proto_write_str_array(&msg, exec_info->argv)
+        ||  proto_write_str_array(&msg, exec_info->envp)
+    )
+        return -1;
+
+    if (send(sock, msg.buf, msg.offset, MSG_NOSIGNAL) < 0)
+        return -1;
+
+    return 0;
+}
+
+int zygote_recv (int sock, struct zygote_reply *reply)
+{
+    char buf[64];
+    char cmsg_buf[CMSG_SPACE(sizeof(int) * ZYGOTE_REPLY_FDS)];
+    int fds[ZYGOTE_REPLY_FDS] = { -1, -1, -1, -1 };
+    int32_t err, pid;
+    struct proto_msg msg;
+    struct msghdr msghdr = { };
+    struct iovec iov = { buf, sizeof(buf) };
+    struct cmsghdr *cmsg;
+    unsigned nfds = 0, i;
+    size_t count;
+    ssize_t ret;
+    bool overflow = false;
+    int fd;
+
+    msghdr.msg_iov = &iov;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = cmsg_buf;
+    msghdr.msg_controllen = sizeof(cmsg_buf);
+
+    if ((ret = recvmsg(sock, &msghdr, MSG_CMSG_CLOEXEC)) < 0)
+        return -1;
+
+    else if (!ret)
+        return 1;
+
+    // passed fds, which are ours to close from here on, including any that we did not expect
+    for (cmsg = CMSG_FIRSTHDR(&msghdr); cmsg; cmsg = CMSG_NXTHDR(&msghdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (i = 0; i < count; i++) {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+            if (nfds < ZYGOTE_REPLY_FDS) {
+                fds[nfds++] = fd;
+            } else {
+                close(fd);
+                overflow = true;
+            }
+        }
+    }
+
+    // any fds that did not fit have been dropped along the way
+    if (overflow || (msghdr.msg_flags & MSG_CTRUNC)) {
+        errno = EBADMSG;
+
+        goto error;
+    }
+
+    // decode
+    if (
+            proto_msg_init(&msg, buf, ret)
+        ||  proto_read_int32(&msg, &err)
+        ||  proto_read_int32(&msg, &pid)
+    )
+        goto error;
+
+    reply->err = err;
+    reply->pid = pid;
+    reply->pid_fd = fds[0];
+    reply->std_in = fds[1];
+    reply->std_out = fds[2];
+    reply->std_err = fds[3];
+
+    return 0;
+
+error:
+    err = errno;
+
+    while (nfds > 0)
+        close(fds[--nfds]);
+
+    errno = err;
+
+    return -1;
+}
+
+void zygote_reply_close (struct zygote_reply *reply)
+{
+    int *fds[] = { &reply->pid_fd, &reply->std_in, &reply->std_out, &reply->std_err };
+    unsigned i;
+
+    for (i = 0; i < ZYGOTE_REPLY_FDS; i++) {
+        if (*fds[i] >= 0)
+            close(*fds[i]);
+
+        *fds[i] = -1;
+    }
+}
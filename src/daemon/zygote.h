@@ -0,0 +1,77 @@
+#ifndef DAEMON_ZYGOTE_H
+#define DAEMON_ZYGOTE_H
+
+/**
+ * @file
+ *
+ * Pre-forked spawn helper.
+ *
+ * The zygote is a small helper process forked off at daemon startup, before the daemon has grown, which spawns new
+ * processes on behalf of the daemon, such that the shard's select loop only has to pass a message to it and wait for
+ * the reply.
+ *
+ * Each shard has its own SOCK_SEQPACKET socket to the zygote, and the zygote handles the requests on each socket in
+ * order, so the replies come back in the same order as the requests were sent.
+ *
+ * The processes are cloned using CLONE_PARENT, so that they are children of the daemon itself rather than the zygote,
+ * and the daemon reaps them via the pidfd passed back in the reply, exactly as if it had spawned them itself.
+ */
+#include "process.h"
+
+#include <sys/types.h>
+
+/**
+ * Daemon-side zygote state
+ */
+struct zygote {
+    /** Helper process */
+    pid_t pid;
+
+    /** Per-shard sockets to the helper process */
+    int *socks;
+    unsigned count;
+};
+
+/**
+ * Result of a spawn request
+ */
+struct zygote_reply {
+    /** Zero on success, or the error from spawning the process */
+    int err;
+
+    /** The spawned process, which is our child, or -1 if it could not be created */
+    pid_t pid;
+
+    /** pidfd for the spawned process, which must be reaped via this even if err is set, or -1 */
+    int pid_fd;
+
+    /** Our non-blocking ends of the process's stdin/out/err pipes, or -1 on error */
+    int std_in, std_out, std_err;
+};
+
+/**
+ * Fork off the zygote process, with the given number of sockets to it.
+ */
+int zygote_start (struct zygote *zygote, unsigned count);
+
+/**
+ * Send a request to spawn a new process with the given parameters on the given socket to the zygote.
+ *
+ * Fails with EAGAIN if the zygote is too far behind on requests.
+ */
+int zygote_send (int sock, const struct process_exec_info *exec_info);
+
+/**
+ * Receive the reply to the oldest outstanding request on the given socket to the zygote.
+ *
+ * Returns 1 on EOF, i.e. if the zygote has gone away. Fails with EBADMSG if the reply is malformed or carries more fds
+ * than expected, in which case all of its fds are closed.
+ */
+int zygote_recv (int sock, struct zygote_reply *reply);
+
+/**
+ * Close the fds of a reply that is not handed off to a process.
+ */
+void zygote_reply_close (struct zygote_reply *reply);
+
+#endif
@@ -1,13 +1,19 @@
 #define _GNU_SOURCE
 #include "client_internal.h"
 #include "shared/proto.h"
+#include "shared/ring.h"
 #include "commands.h"
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <errno.h>
 #include <assert.h>
 
@@ -19,12 +25,107 @@ static proto_msg_id_t nd_msg_id (struct nd_client *client)
     return ++client->last_id;
 }
 
+/**
+ * Initialize the given msg for a command, in the byte order agreed upon in the handshake
+ */
+static int nd_cmd_init (struct nd_client *client, struct proto_msg *msg, char *buf, size_t len, proto_msg_id_t id, enum proto_cmd cmd)
+{
+    if (proto_msg_init(msg, buf, len))
+        return -1;
+
+    msg->native = client->caps & PROTO_CAP_NATIVE;
+
+    return proto_cmd_start(msg, id, cmd);
+}
+
+/**
+ * Wait for the server to make room in the outbound ring, or to close the socket
+ */
+static int nd_ring_wait (struct nd_client *client)
+{
+    struct pollfd fds[2] = {
+        { .fd = client->sock,               .events = POLLIN },
+        { .fd = client->ring->wait_fd,      .events = POLLIN },
+    };
+    uint64_t count;
+
+    if (poll(fds, 2, -1) < 0)
+        return -1;
+
+    if (fds[0].revents) {
+        // nothing else is sent on the socket once using the rings
+        errno = EPIPE;
+
+        return -1;
+    }
+
+    // clear wakeup
+    if (read(client->ring->wait_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return -1;
+
+    // which may also have been for messages, which nd_poll_fd must remain readable for
+    if (ring_pending(&client->ring->rx) && ring_wakeup(client->ring->wait_fd))
+        return -1;
+
+    return 0;
+}
+
 /**
  * Send a proto_msg to the service
  */
 static int nd_send_msg (struct nd_client *client, struct proto_msg *msg)
 {
-    return proto_send_seqpacket(client->sock, msg);
+    size_t offset = 0;
+
+    if (client->ring) {
+        while (ring_write(&client->ring->tx, msg->buf, msg->offset)) {
+            if (errno != EAGAIN || nd_ring_wait(client))
+                return -1;
+        }
+
+        return 0;
+    }
+
+    if (client->stream)
+        return proto_send_stream(client->sock, msg->buf, msg->offset, &offset);
+    else
+        return proto_send_seqpacket(client->sock, msg);
+}
+
+/**
+ * Maximum length of a message in either direction: large messages are only used on SOCK_STREAM transports and rings,
+ * once negotiated, and are limited to what fits into a ring
+ */
+static size_t nd_msg_max (struct nd_client *client)
+{
+    if (!(client->caps & PROTO_CAP_LARGE))
+        return ND_PROTO_MSG_MAX;
+    else if (client->ring)
+        return RING_MSG_MAX;
+    else if (client->stream)
+        return ND_PROTO_STREAM_MSG_MAX;
+    else
+        return ND_PROTO_MSG_MAX;
+}
+
+/**
+ * Send a proto_iov message to the service
+ */
+static int nd_send_iov (struct nd_client *client, struct proto_iov *iov)
+{
+    if (client->ring) {
+        while (proto_send_iov_ring(&client->ring->tx, iov)) {
+            if (errno != EAGAIN || nd_ring_wait(client))
+                return -1;
+        }
+
+        return 0;
+    }
+
+    if (client->stream)
+        return proto_send_iov_stream(client->sock, iov);
+    else
+        return proto_send_iov_seqpacket(client->sock, iov);
 }
 
 int nd_create (struct nd_client **client_ptr, const struct nd_callbacks *cb_funcs, void *cb_arg)
@@ -37,7 +138,9 @@ int nd_create (struct nd_client **client_ptr, const struct nd_callbacks *cb_func
 
     // init
     client->sock = -1;
+    client->poll_fd = -1;
     client->last_id = 1;
+    client->request_caps = PROTO_CAPS;
 
     // store
     client->cb_funcs = *cb_funcs;
@@ -79,6 +182,9 @@ int nd_open_unix (struct nd_client *client, const char *path)
     if (connect(client->sock, (struct sockaddr *) &sa, SUN_LEN(&sa)) < 0)
         goto error;
 
+    // same host
+    client->local = true;
+
     return 0;
 
 error:
@@ -92,17 +198,75 @@ error:
     return -1;
 }
 
+int nd_open_tcp (struct nd_client *client, const char *host, const char *port)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *ai = NULL, *addr;
+    int err, nodelay = 1;
+
+    // not already connected
+    if (client->sock != -1) {
+        errno = EALREADY;
+
+        return -1;
+    }
+
+    // resolve
+    if ((err = getaddrinfo(host, port, &hints, &ai))) {
+        if (err != EAI_SYSTEM)
+            errno = EADDRNOTAVAIL;
+
+        return -1;
+    }
+
+    // try each address in turn
+    for (addr = ai; addr; addr = addr->ai_next) {
+        if ((client->sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0)
+            continue;
+
+        if (connect(client->sock, addr->ai_addr, addr->ai_addrlen) == 0)
+            break;
+
+        close(client->sock);
+        client->sock = -1;
+    }
+
+    freeaddrinfo(ai);
+
+    if (client->sock < 0)
+        return -1;
+
+    // commands are sent as soon as they are ready
+    if (setsockopt(client->sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0)
+        goto error;
+
+    client->stream = true;
+
+    return 0;
+
+error:
+    // cleanup
+    close(client->sock);
+
+    client->sock = -1;
+
+    return -1;
+}
+
 int nd_cmd_hello (struct nd_client *client)
 {
     char buf[512];
     struct proto_msg msg;
 
     // init with CMD_HELLO
-    if (proto_cmd_init(&msg, buf, sizeof(buf), /* nd_msg_id(client) */ 0, CMD_HELLO))
+    if (nd_cmd_init(client, &msg, buf, sizeof(buf), /* nd_msg_id(client) */ 0, CMD_HELLO))
         return -1;
 
-    // add current proto version
-    if (proto_write_uint16(&msg, PROTO_VERSION))
+    // add current proto version, and the features we support
+    if (
+            proto_write_uint16(&msg, PROTO_VERSION)
+        ||  proto_write_uint32(&msg, client->local ? client->request_caps : client->request_caps & ~(PROTO_CAP_NATIVE | PROTO_CAP_RING))
+    )
         return -1;
 
     // send
@@ -115,7 +279,7 @@ int nd_cmd_start (struct nd_client *client, const char *path, const char **argv,
     struct proto_msg msg;
 
     // start CMD_EXEC
-    if (proto_cmd_init(&msg, buf, sizeof(buf), nd_msg_id(client), CMD_START))
+    if (nd_cmd_init(client, &msg, buf, sizeof(buf), nd_msg_id(client), CMD_START))
         goto error;
 
     // write fields
@@ -139,21 +303,23 @@ error:
 
 int nd_cmd_data (struct nd_client *client, enum proto_channel channel, const char *buf, size_t len)
 {
-    char msg_buf[ND_PROTO_MSG_MAX];
-    struct proto_msg msg;
+    struct proto_iov msg;
+    struct proto_data fields = { .channel = channel };
 
-    if (proto_cmd_init(&msg, msg_buf, sizeof(msg_buf), nd_msg_id(client), CMD_DATA))
+    if (proto_iov_init(&msg, client->caps & PROTO_CAP_NATIVE, nd_msg_id(client), CMD_DATA))
         goto error;
 
-    // write fields
+    proto_iov_limit(&msg, nd_msg_max(client));
+
+    // write fields, sending the data directly from the caller's buffer
     if (
-            proto_write_uint16(&msg, channel)
-        ||  proto_write_buf(&msg, buf, len)
+            proto_encode_data(&msg.msg, &fields)
+        ||  proto_iov_write_data(&msg, client->version, buf, len)
     )
         goto error;
     
     // send
-    if (nd_send_msg(client, &msg))
+    if (nd_send_iov(client, &msg))
         goto error;
 
     // ok
@@ -163,15 +329,18 @@ error:
     return -1;
 }
 
-int nd_cmd_attach (struct nd_client *client, const char *process_id)
+int nd_cmd_attach (struct nd_client *client, const char *process_id, uint64_t offset)
 {
     char msg_buf[4096];
     struct proto_msg msg;
 
-    if (proto_cmd_init(&msg, msg_buf, sizeof(msg_buf), nd_msg_id(client), CMD_ATTACH))
+    if (nd_cmd_init(client, &msg, msg_buf, sizeof(msg_buf), nd_msg_id(client), CMD_ATTACH))
         return -1;
     
-    if (proto_write_str(&msg, process_id))
+    if (
+            proto_write_str(&msg, process_id)
+        ||  proto_encode_offset(&msg, &(struct proto_offset) { .offset = offset })
+    )
         return -1;
 
     if (nd_send_msg(client, &msg))
@@ -186,7 +355,7 @@ int nd_cmd_list (struct nd_client *client)
     char msg_buf[4096];
     struct proto_msg msg;
 
-    if (proto_cmd_init(&msg, msg_buf, sizeof(msg_buf), nd_msg_id(client), CMD_LIST))
+    if (nd_cmd_init(client, &msg, msg_buf, sizeof(msg_buf), nd_msg_id(client), CMD_LIST))
         return -1;
     
     if (nd_send_msg(client, &msg))
@@ -200,11 +369,12 @@ int nd_cmd_kill (struct nd_client *client, int sig)
 {
     char msg_buf[512];
     struct proto_msg msg;
+    struct proto_kill fields = { .signal = sig };
 
-    if (proto_cmd_init(&msg, msg_buf, sizeof(msg_buf), nd_msg_id(client), CMD_KILL))
+    if (nd_cmd_init(client, &msg, msg_buf, sizeof(msg_buf), nd_msg_id(client), CMD_KILL))
         return -1;
     
-    if (proto_write_uint16(&msg, sig))
+    if (proto_encode_kill(&msg, &fields))
         return -1;
 
     if (nd_send_msg(client, &msg))
@@ -245,6 +415,87 @@ static int nd_poll_select (struct nd_client *client, struct timeval *tv)
     }
 }
 
+/**
+ * Receive one message from the rings, waiting for up to the given timeout, or receive whatever there is on the socket.
+ *
+ * Returns 1 if a message was received, or 0 if there were no more messages after a wakeup.
+ */
+static int nd_recv_ring (struct nd_client *client, struct proto_msg *msg, struct timeval *tv)
+{
+    struct ring_link *ring = client->ring;
+    struct pollfd fds[2] = {
+        { .fd = client->sock,       .events = POLLIN },
+        { .fd = ring->wait_fd,      .events = POLLIN },
+    };
+    uint64_t count;
+    size_t len;
+    int ret;
+
+    while (true) {
+        if ((ret = ring_read(&ring->rx, msg->buf, msg->len, &len)) < 0) {
+            return -1;
+
+        } else if (ret) {
+            msg->len = len;
+
+            return 1;
+        }
+
+        // empty, so clear any wakeup
+        count = 0;
+
+        if (read(ring->wait_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            return -1;
+
+        if (!ring_idle(&ring->rx)) {
+            // raced with the server, which will not wake us up for the rest, so nd_poll_fd must remain readable
+            if (ring_wakeup(ring->wait_fd))
+                return -1;
+
+            continue;
+        }
+
+        if (count)
+            // woken up for messages that have already been handled
+            return 0;
+
+        // wait
+        if ((ret = poll(fds, 2, tv ? tv->tv_sec * 1000 + tv->tv_usec / 1000 : -1)) < 0) {
+            return -1;
+
+        } else if (ret == 0) {
+            errno = ETIMEDOUT;
+
+            return -1;
+
+        } else if (fds[0].revents) {
+            // nothing else is sent on the socket, so this is most likely EOF
+            return proto_recv_seqpacket(client->sock, msg) ? -1 : 1;
+        }
+    }
+}
+
+/**
+ * Handle a received message, failing with EBADMSG for anything but PROTO_CMD_BEFORE_HELLO commands until the CMD_HELLO
+ * reply has been handled.
+ */
+static int nd_cmd_dispatch (struct nd_client *client, struct proto_msg *msg)
+{
+    const struct proto_cmd_handler *handler;
+
+    if (!(handler = proto_cmd_lookup(&client_command_handlers, msg->cmd)))
+        return -1;
+
+    // check protocol state
+    if (!client->version && !(handler->flags & PROTO_CMD_BEFORE_HELLO)) {
+        errno = EBADMSG;
+
+        return -1;
+    }
+
+    return proto_cmd_call(handler, msg, NULL, client);
+}
+
 /**
  * Recieve one message using the given timeout.
  *
@@ -254,28 +505,71 @@ static int nd_poll_select (struct nd_client *client, struct timeval *tv)
 static int nd_poll_internal (struct nd_client *client, struct timeval *tv)
 {
     struct proto_msg msg;
-    char buf[ND_PROTO_MSG_MAX];
+    size_t size;
+    char *buf;
     int err;
 
-    if (tv)
+    if (tv && !client->ring)
         // wait timeout
         if (nd_poll_select(client, tv))
             return -1;
 
+    size = nd_msg_max(client);
+
+    if (size > client->recv_size) {
+        if ((buf = realloc(client->recv_buf, size)) == NULL)
+            return -1;
+
+        client->recv_buf = buf;
+        client->recv_size = size;
+    }
+
     // setup msg buf
-    if (proto_msg_init(&msg, buf, sizeof(buf)))
+    if (proto_msg_init(&msg, client->recv_buf, client->recv_size))
         return -1;
 
     // recieve the message
-    if (proto_recv_seqpacket(client->sock, &msg))
-        return -1;
+    if (client->ring) {
+        if ((err = nd_recv_ring(client, &msg, tv)) < 0)
+            return -1;
+
+        if (!err) {
+            // nothing to handle
+            client->last_res = 0;
+
+            return 0;
+        }
+
+    } else if (client->stream) {
+        if (proto_recv_stream_msg(client->sock, &msg))
+            return -1;
+
+    } else if (!client->version) {
+        // the rings are passed along with the CMD_HELLO reply
+        client->ring_fds_count = RING_LINK_FDS;
+
+        if (proto_recv_fds_seqpacket(client->sock, &msg, client->ring_fds, &client->ring_fds_count))
+            return -1;
+
+    } else {
+        if (proto_recv_seqpacket(client->sock, &msg))
+            return -1;
+    }
+
+    // parse, in the byte order agreed upon in the handshake
+    msg.native = client->caps & PROTO_CAP_NATIVE;
 
-    // parse
     if (proto_cmd_parse(&msg))
         return -1;
 
     // handle it
-    if ((err = proto_cmd_dispatch(client_command_handlers, &msg, NULL, client)) < 0) {
+    err = nd_cmd_dispatch(client, &msg);
+
+    // any fds not taken up by the CMD_HELLO handler
+    while (client->ring_fds_count)
+        close(client->ring_fds[--client->ring_fds_count]);
+
+    if (err < 0) {
         // internal error
         return -1;
 
@@ -326,6 +620,40 @@ static int nd_poll_cmd (struct nd_client *client)
         return client->last_res;
 }
 
+int nd_set_caps (struct nd_client *client, uint32_t caps)
+{
+    if (client->version) {
+        // already negotiated
+        errno = EALREADY;
+
+        return -1;
+    }
+
+    client->request_caps = caps & PROTO_CAPS;
+
+    return 0;
+}
+
+uint32_t nd_caps (struct nd_client *client)
+{
+    return client->caps;
+}
+
+int nd_hello (struct nd_client *client)
+{
+    // send the command
+    if (nd_cmd_hello(client))
+        return -1;
+
+    // the reply is not tied to a message ID, so wait until it has been handled
+    while (!client->version) {
+        if (nd_poll_internal(client, NULL) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
 int nd_start (struct nd_client *client, const char *path, const char **argv, const char **envp)
 {
     // send the command
@@ -337,9 +665,14 @@ int nd_start (struct nd_client *client, const char *path, const char **argv, con
 }
 
 int nd_attach (struct nd_client *client, const char *process_id)
+{
+    return nd_attach_offset(client, process_id, 0);
+}
+
+int nd_attach_offset (struct nd_client *client, const char *process_id, uint64_t offset)
 {
     // send the command
-    if (nd_cmd_attach(client, process_id))
+    if (nd_cmd_attach(client, process_id, offset))
         return -1;
 
     // wait for and return reply
@@ -391,6 +724,11 @@ const char *nd_process_id (struct nd_client *client)
     return client->process_id;
 }
 
+uint64_t nd_output_offset (struct nd_client *client)
+{
+    return client->output_offset;
+}
+
 int nd_process_running (struct nd_client *client)
 {
     if (!client->process_id)
@@ -404,7 +742,7 @@ int nd_poll_fd (struct nd_client *client, bool *want_read, bool *want_write)
     *want_read = true;
     *want_write = false;
 
-    return client->sock;
+    return client->ring ? client->poll_fd : client->sock;
 }
 
 int nd_poll (struct nd_client *client, struct timeval *tv)
@@ -438,12 +776,79 @@ void nd_destroy (struct nd_client *client)
     if (client->sock)
         close(client->sock);
 
+    if (client->ring) {
+        ring_link_close(client->ring);
+        free(client->ring);
+    }
+
+    if (client->poll_fd >= 0)
+        close(client->poll_fd);
+
+    while (client->ring_fds_count)
+        close(client->ring_fds[--client->ring_fds_count]);
+
     free(client->err_msg);
     free(client->process_id);
+    free(client->recv_buf);
+    free(client->data_buf);
 
     free(client);
 }
 
+int nd_ring_open (struct nd_client *client)
+{
+    struct epoll_event event = { .events = EPOLLIN };
+    int err;
+
+    if (client->ring_fds_count != RING_LINK_FDS) {
+        errno = EBADMSG;
+
+        return -1;
+    }
+
+    if ((client->ring = malloc(sizeof(*client->ring))) == NULL)
+        return -1;
+
+    // taken over, or closed on errors
+    client->ring_fds_count = 0;
+
+    if (ring_link_open(client->ring, client->ring_fds)) {
+        free(client->ring);
+        client->ring = NULL;
+
+        return -1;
+    }
+
+    // readable for either wakeups via the rings, or the socket being closed
+    if ((client->poll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        goto error;
+
+    if (
+            epoll_ctl(client->poll_fd, EPOLL_CTL_ADD, client->sock, &event)
+        ||  epoll_ctl(client->poll_fd, EPOLL_CTL_ADD, client->ring->wait_fd, &event)
+    )
+        goto error;
+
+    return 0;
+
+error:
+    err = errno;
+
+    // as if the ring was never opened
+    if (client->poll_fd >= 0)
+        close(client->poll_fd);
+
+    client->poll_fd = -1;
+
+    ring_link_close(client->ring);
+    free(client->ring);
+    client->ring = NULL;
+
+    errno = err;
+
+    return -1;
+}
+
 int nd_store_error (struct nd_client *client, int err_code, const char *err_msg)
 {
     if (client->err_msg)
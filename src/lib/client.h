@@ -8,6 +8,7 @@
  */
 #include <sys/time.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 /**
@@ -22,10 +23,12 @@ struct nd_client;
  * from the running nd_* function.
  */
 struct nd_callbacks {
-    /** Recieved data from process on stdout. In case of EOF, len == 0 */
+    /** Recieved data from process on stdout. In case of EOF, len == 0. The data is not NUL-terminated, and is only valid
+     * for the duration of the call */
     int (*on_stdout) (struct nd_client *client, const char *buf, size_t len, void *arg);
 
-    /** Recieved data from process on stderr. Incase of EOF, len == 0 */
+    /** Recieved data from process on stderr. Incase of EOF, len == 0. The data is not NUL-terminated, and is only valid
+     * for the duration of the call */
     int (*on_stderr) (struct nd_client *client, const char *buf, size_t len, void *arg);
 
     /** Process exited */
@@ -57,12 +60,43 @@ int nd_create (struct nd_client **client_ptr, const struct nd_callbacks *cb_func
 int nd_open_unix (struct nd_client *client, const char *path);
 
 /**
- * Send a CMD_HELLO message to the service
+ * Open the client connection to the server over TCP to the given host and port.
+ *
+ * @param host hostname or address to connect() to, or NULL for localhost
+ * @param port TCP port number or service name
+ *
+ * @return zero on success, <0 on error
+ */
+int nd_open_tcp (struct nd_client *client, const char *host, const char *port);
+
+/**
+ * Send a CMD_HELLO message to the service.
+ *
+ * The reply must be handled before sending any further commands, as those are encoded for the negotiated protocol
+ * version and features.
  *
  * XXX: do this automatically
  */
 int nd_cmd_hello (struct nd_client *client);
 
+/**
+ * Send a CMD_HELLO message to the service, and wait for the reply to negotiate the protocol version used.
+ */
+int nd_hello (struct nd_client *client);
+
+/**
+ * Set the optional protocol features (PROTO_CAP_*) to request in CMD_HELLO; by default, all supported features are
+ * requested.
+ *
+ * Fails with EALREADY once the handshake is done.
+ */
+int nd_set_caps (struct nd_client *client, uint32_t caps);
+
+/**
+ * Return the protocol features (PROTO_CAP_*) in use, as agreed upon in the handshake
+ */
+uint32_t nd_caps (struct nd_client *client);
+
 /**
  * Start a new process and automatically attach to it.
  * Use nd_process_id to retreieve the new process's ID.
@@ -75,12 +109,25 @@ int nd_cmd_hello (struct nd_client *client);
 int nd_start (struct nd_client *client, const char *path, const char **argv, const char **envp);
 
 /**
- * Attach to a pre-existing process using the given name.
+ * Output stream offset past the end of any output, for attaching without any replay
+ */
+#define ND_OFFSET_END UINT64_MAX
+
+/**
+ * Attach to a pre-existing process using the given name, replaying all of its retained output.
  *
  * Fails with ENOENT if the named process does not exist.
  */
 int nd_attach (struct nd_client *client, const char *process_id);
 
+/**
+ * Attach to a pre-existing process using the given name, replaying its retained output from the given output stream
+ * offset onwards, as returned by nd_output_offset before reconnecting.
+ *
+ * Fails with ENOENT if the named process does not exist.
+ */
+int nd_attach_offset (struct nd_client *client, const char *process_id, uint64_t offset);
+
 /**
  * Retrieve a listing of processes from the server.
  *
@@ -91,7 +138,8 @@ int nd_list (struct nd_client *client);
 /**
  * Send data to stdin on the attached process.
  *
- * The data will be written atomically
+ * The data will be written atomically, and fails with EOVERFLOW if it does not fit into a single message for the
+ * connection.
  */
 int nd_stdin_data (struct nd_client *client, const char *buf, size_t len);
 
@@ -116,6 +164,14 @@ int nd_kill (struct nd_client *client, int sig);
  */
 const char *nd_process_id (struct nd_client *client);
 
+/**
+ * Get the output stream offset of the attached process following the last output received.
+ *
+ * After attaching, this is the offset the replayed output starts at, which is later than the requested one if some of
+ * the output was lost.
+ */
+uint64_t nd_output_offset (struct nd_client *client);
+
 /**
  * Is the attached process running?
  *
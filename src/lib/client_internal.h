@@ -6,6 +6,7 @@
  */
 #include "client.h"
 #include "shared/proto.h"
+#include "shared/ring.h"
 
 /**
  * Per-client state for the connection to the server
@@ -14,8 +15,34 @@ struct nd_client {
     /** The communication socket */
     int sock;
 
-    /** Protocol handshake ok */
-    bool proto_version;
+    /** Connected using SOCK_STREAM, with length-prefixed messages */
+    bool stream;
+
+    /** Connected over AF_UNIX, so on the same host */
+    bool local;
+
+    /** Protocol features to request in handshake */
+    enum proto_caps request_caps;
+
+    /** Protocol version and features agreed upon in handshake, or zero until then */
+    enum proto_version version;
+    enum proto_caps caps;
+
+    /** fds received along with the CMD_HELLO reply, for the rings */
+    int ring_fds[RING_LINK_FDS];
+    unsigned ring_fds_count;
+
+    /** Shared memory rings used in place of the socket with PROTO_CAP_RING, and an epoll fd for both, for nd_poll_fd */
+    struct ring_link *ring;
+    int poll_fd;
+
+    /** Buffer for received messages, sized for the transport and features in use */
+    char *recv_buf;
+    size_t recv_size;
+
+    /** Buffer for decompressed CMD_DATA_LZ, grown as needed */
+    char *data_buf;
+    size_t data_size;
 
     /** Callback info */
     struct nd_callbacks cb_funcs;
@@ -33,11 +60,19 @@ struct nd_client {
     /** Attached process ID */
     char *process_id;
 
+    /** Output stream offset following the last CMD_DATA received */
+    uint64_t output_offset;
+
     /** Last status */
     enum proto_process_status status;
     int status_code;
 };
 
+/**
+ * Start using the rings passed along with the CMD_HELLO reply, failing with EBADMSG if there were none.
+ */
+int nd_ring_open (struct nd_client *client);
+
 /**
  * Allocate and return storage for new error msg
  */
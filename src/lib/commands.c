@@ -1,6 +1,7 @@
 #include "commands.h"
 #include "client_internal.h"
 #include "shared/log.h" // only log_debug
+#include "shared/lz.h"
 
 #include <errno.h>
 
@@ -11,22 +12,40 @@ static int cmd_hello (struct proto_msg *in, struct proto_msg *unused, void *ctx)
 {
     struct nd_client *client = ctx;
     uint16_t proto_version;
+    uint32_t caps = 0;
 
     if (proto_read_uint16(in, &proto_version))
         return -1;
+
+    // older servers do not use any features
+    if (in->offset < in->len && proto_read_uint32(in, &caps))
+        return -1;
     
-    switch (proto_version) {
-        case PROTO_V1:
-            log_debug("CMD_HELLO: proto_version=%d (current)", proto_version);
-            break;
+    if (proto_version < PROTO_V1) {
+        log_debug("CMD_HELLO: proto_version=%d (unknown)", proto_version);
 
-        default:
-            log_debug("CMD_HELLO: proto_version=%d (unknown)", proto_version);
-            break;
+        errno = EINVAL;
+
+        return -1;
+
+    } else if (proto_version > PROTO_VERSION) {
+        log_debug("CMD_HELLO: proto_version=%d (newer, using %d)", proto_version, PROTO_VERSION);
+
+        proto_version = PROTO_VERSION;
+
+    } else {
+        log_debug("CMD_HELLO: proto_version=%d", proto_version);
     }
 
+    log_debug("CMD_HELLO: caps=%#x", caps);
+
     // ok
-    client->proto_version = true;
+    client->version = proto_version;
+    client->caps = caps & client->request_caps;
+
+    // everything else goes via the rings passed along with this reply
+    if (client->caps & PROTO_CAP_RING)
+        return nd_ring_open(client);
 
     return 0;
 }
@@ -35,15 +54,18 @@ static int cmd_hello (struct proto_msg *in, struct proto_msg *unused, void *ctx)
 static int cmd_error_abort (struct proto_msg *in, struct proto_msg *unused, void *ctx)
 {
     struct nd_client *client = ctx;
+    struct proto_error fields;
     int32_t err_code;
     const char *err_msg;
     
     if (
-            proto_read_int32(in, &err_code)
+            proto_decode_error(in, &fields)
         ||  proto_read_str(in, &err_msg)
     )
         return -1;
 
+    err_code = fields.err_code;
+
     // store error message
     if (nd_store_error(client, err_code, err_msg))
         return -1;
@@ -84,73 +106,120 @@ static int cmd_attached (struct proto_msg *in, struct proto_msg *unused, void *c
     struct nd_client *client = ctx;
 
     const char *process_id;
-    uint16_t status, status_code;
+    struct proto_status fields;
+    struct proto_offset offset = { .offset = 0 };
     
     if (
             proto_read_str(in, &process_id)
-        ||  proto_read_uint16(in, &status)
-        ||  proto_read_uint16(in, &status_code)
+        ||  proto_decode_status(in, &fields)
     )
         return -1;
 
-    log_debug("CMD_ATTACHED: id=%d, process_id=%s, status=%d:%d", in->id, process_id, status, status_code);
+    // older servers do not replay any output
+    if (in->offset < in->len && proto_decode_offset(in, &offset))
+        return -1;
+
+    log_debug("CMD_ATTACHED: id=%d, process_id=%s, status=%d:%d, offset=%llu", in->id, process_id, fields.status, fields.code, (unsigned long long) offset.offset);
+
+    // output follows from here
+    client->output_offset = offset.offset;
 
     // store new ID
     if (nd_store_process_id(client, process_id))
         return -1;
 
     // and status
-    if (nd_update_status(client, status, status_code))
+    if (nd_update_status(client, fields.status, fields.code))
         return -1;
 
     // yay
     return 0;
 }
 
+/**
+ * Pass on data from the process to the callbacks
+ */
+static int on_data (struct nd_client *client, uint16_t channel, const char *buf, size_t len)
+{
+    client->output_offset += len;
+
+    // callback
+    switch (channel) {
+        case CHANNEL_STDOUT:
+            return client->cb_funcs.on_stdout(client, buf, len, client->cb_arg);
+        
+        case CHANNEL_STDERR:
+            return client->cb_funcs.on_stderr(client, buf, len, client->cb_arg);
+
+        default:
+            // unknown channel
+            errno = ECHRNG;
+
+            return -1;
+    }
+}
+
 // data from process
 static int cmd_data (struct proto_msg *in, struct proto_msg *unused, void *ctx)
 {
     struct nd_client *client = ctx;
 
     uint16_t channel;
-    uint16_t len;
-    char *buf;
+    const char *buf;
+    size_t len;
+
+    // read data in place
+    if (proto_read_data(in, client->version, &channel, &buf, &len))
+        return -1;
+
+    // report
+    log_debug("CMD_DATA: channel=%u, data=%zu:%.*s", channel, len, (int) len, buf);
+
+    return on_data(client, channel, buf, len);
+}
+
+// compressed data from process
+static int cmd_data_lz (struct proto_msg *in, struct proto_msg *unused, void *ctx)
+{
+    struct nd_client *client = ctx;
+
+    struct proto_data_lz fields;
+    uint16_t channel;
+    uint32_t len;
+    const char *buf;
+    size_t buf_len;
+    char *data;
 
-    // read header
     if (
-            proto_read_uint16(in, &channel)
-        ||  proto_read_uint16(in, &len)
+            proto_decode_data_lz(in, &fields)
+        ||  proto_read_buf32_ptr(in, &buf, &buf_len)
     )
         return -1;
 
-    // alloc storage
-    if ((buf = alloca(len + 1)) == NULL)
-        return -1;
+    channel = fields.channel;
+    len = fields.len;
+
+    if (len > ND_PROTO_STREAM_MSG_MAX) {
+        errno = EMSGSIZE;
 
-    // read data
-    if (proto_read(in, buf, len))
         return -1;
+    }
 
-    // terminate NUL for convenience
-    buf[len] = '\0';
+    // grow storage
+    if (len > client->data_size) {
+        if ((data = realloc(client->data_buf, len)) == NULL)
+            return -1;
 
-    // report
-    log_debug("CMD_DATA: channel=%u, data=%u:%.*s", channel, len, (int) len, buf);
+        client->data_buf = data;
+        client->data_size = len;
+    }
 
-    // callback
-    switch (channel) {
-        case CHANNEL_STDOUT:
-            return client->cb_funcs.on_stdout(client, buf, len, client->cb_arg);
-        
-        case CHANNEL_STDERR:
-            return client->cb_funcs.on_stderr(client, buf, len, client->cb_arg);
+    if (lz_decompress(buf, buf_len, client->data_buf, len))
+        return -1;
 
-        default:
-            // unknown channel
-            errno = ECHRNG;
+    log_debug("CMD_DATA_LZ: channel=%u, data=%zu->%u:%.*s", channel, buf_len, len, (int) len, client->data_buf);
 
-            return -1;
-    }
+    return on_data(client, channel, client->data_buf, len);
 }
 
 // process status changed
@@ -158,15 +227,16 @@ static int cmd_status (struct proto_msg *in, struct proto_msg *unused, void *ctx
 {
     struct nd_client *client = ctx;
 
+    struct proto_status fields;
     uint16_t status, code;
 
     // read
-    if (
-            proto_read_uint16(in, &status)
-        ||  proto_read_uint16(in, &code)
-    )
+    if (proto_decode_status(in, &fields))
         return -1;
 
+    status = fields.status;
+    code = fields.code;
+
     // update
     log_debug("CMD_STATUS: status=%d, code=%d", status, code);
 
@@ -208,17 +278,16 @@ static int cmd_list (struct proto_msg *in, struct proto_msg *unused, void *ctx)
 
     while (count--) {
         const char *proc_id;
-        uint16_t status, status_code;
+        struct proto_status fields;
 
         if (
                 proto_read_str(in, &proc_id)
-            ||  proto_read_uint16(in, &status)
-            ||  proto_read_uint16(in, &status_code)
+            ||  proto_decode_status(in, &fields)
         )
             return -1;
 
         // notify
-        if ((err = client->cb_funcs.on_list(client, proc_id, status, status_code, client->cb_arg)))
+        if ((err = client->cb_funcs.on_list(client, proc_id, fields.status, fields.code, client->cb_arg)))
             return err;
     }
 
@@ -226,15 +295,31 @@ static int cmd_list (struct proto_msg *in, struct proto_msg *unused, void *ctx)
     return 0;
 }
 
-struct proto_cmd_handler client_command_handlers[] = {
-    { CMD_LIST,         cmd_list                },
-    { CMD_STATUS,       cmd_status              },
-    { CMD_DATA,         cmd_data                },
-    { CMD_ATTACHED,     cmd_attached            },
-    { CMD_OK,           cmd_ok                  },
-    { CMD_ERROR,        cmd_error_abort         },
-    { CMD_ABORT,        cmd_error_abort         },
-    { CMD_HELLO,        cmd_hello               },
-    { 0,                NULL                    },
+static const struct proto_cmd_handler client_commands_session[PROTO_CMD_PAGE_SIZE] = {
+    PROTO_CMD(  CMD_HELLO,      cmd_hello,          PROTO_CMD_BEFORE_HELLO,     sizeof(uint16_t)                        ),
 };
 
+static const struct proto_cmd_handler client_commands_process[PROTO_CMD_PAGE_SIZE] = {
+    PROTO_CMD(  CMD_LIST,       cmd_list,           0,                          sizeof(uint16_t)                        ),
+    PROTO_CMD(  CMD_ATTACHED,   cmd_attached,       0,                          PROTO_LEN_STR + PROTO_LEN_status        ),
+};
+
+static const struct proto_cmd_handler client_commands_data[PROTO_CMD_PAGE_SIZE] = {
+    PROTO_CMD(  CMD_DATA,       cmd_data,           0,                          PROTO_LEN_data + sizeof(uint16_t)       ),
+    PROTO_CMD(  CMD_STATUS,     cmd_status,         0,                          PROTO_LEN_status                        ),
+    PROTO_CMD(  CMD_DATA_LZ,    cmd_data_lz,        0,                          PROTO_LEN_data_lz + sizeof(uint32_t)    ),
+};
+
+static const struct proto_cmd_handler client_commands_reply[PROTO_CMD_PAGE_SIZE] = {
+    PROTO_CMD(  CMD_OK,         cmd_ok,             0,                          0                                       ),
+    PROTO_CMD(  CMD_ERROR,      cmd_error_abort,    PROTO_CMD_BEFORE_HELLO,     PROTO_LEN_error + PROTO_LEN_STR         ),
+    PROTO_CMD(  CMD_ABORT,      cmd_error_abort,    PROTO_CMD_BEFORE_HELLO,     PROTO_LEN_error + PROTO_LEN_STR         ),
+};
+
+const struct proto_cmd_table client_command_handlers = { .pages = {
+    [PROTO_CMD_PAGE(CMD_HELLO)]     = client_commands_session,
+    [PROTO_CMD_PAGE(CMD_LIST)]      = client_commands_process,
+    [PROTO_CMD_PAGE(CMD_DATA)]      = client_commands_data,
+    [PROTO_CMD_PAGE(CMD_OK)]        = client_commands_reply,
+} };
+
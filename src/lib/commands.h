@@ -10,6 +10,6 @@
 /**
  * ctx should be the `struct nd_client *`
  */
-extern struct proto_cmd_handler client_command_handlers[];
+extern const struct proto_cmd_table client_command_handlers;
 
 #endif
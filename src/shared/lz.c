@@ -0,0 +1,247 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/**
+ * Size of the hash table of recent positions used to find matches
+ */
+#define LZ_HASH_BITS 12
+
+/**
+ * Shortest back-reference
+ */
+#define LZ_MIN_MATCH 4
+
+/**
+ * Furthest back-reference, limited by the uint16_t offset
+ */
+#define LZ_MAX_OFFSET 65535
+
+/**
+ * The block format requires the last bytes to be literals, and the last match to start before this many bytes from
+ * the end
+ */
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+/**
+ * Run lengths of this or longer are continued in the following bytes
+ */
+#define LZ_RUN_MASK 15
+
+static inline uint32_t lz_read32 (const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static inline unsigned lz_hash (uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Number of bytes used to encode a run of the given length, beyond the token
+ */
+static inline size_t lz_run_size (size_t len)
+{
+    return len < LZ_RUN_MASK ? 0 : 1 + (len - LZ_RUN_MASK) / 255;
+}
+
+/**
+ * Encode the continuation bytes for a run of the given length
+ */
+static unsigned char *lz_put_run (unsigned char *op, size_t len)
+{
+    if (len < LZ_RUN_MASK)
+        return op;
+
+    for (len -= LZ_RUN_MASK; len >= 255; len -= 255)
+        *op++ = 255;
+
+    *op++ = len;
+
+    return op;
+}
+
+/**
+ * Decode the continuation bytes for a run, adding them to *len_ptr
+ */
+static int lz_get_run (const unsigned char **ip_ptr, const unsigned char *end, size_t *len_ptr)
+{
+    const unsigned char *ip = *ip_ptr;
+    unsigned char b;
+
+    if (*len_ptr < LZ_RUN_MASK)
+        return 0;
+
+    do {
+        if (ip >= end)
+            return -1;
+
+        b = *ip++;
+        *len_ptr += b;
+
+    } while (b == 255);
+
+    *ip_ptr = ip;
+
+    return 0;
+}
+
+size_t lz_compress (const char *src, size_t len, char *dst, size_t size)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = { };
+    const unsigned char *base = (const unsigned char *) src, *end = base + len;
+    const unsigned char *ip = base, *anchor = base, *ref, *match;
+    unsigned char *op = (unsigned char *) dst, *op_end = op + size, *token;
+    size_t literals, match_len, offset;
+    uint32_t seq;
+    unsigned hash;
+
+    // inputs too short for any matches are all literals
+    while (len >= LZ_MATCH_LIMIT && ip < end - LZ_MATCH_LIMIT) {
+        seq = lz_read32(ip);
+        hash = lz_hash(seq);
+        ref = base + table[hash];
+        table[hash] = ip - base;
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+            // skip ahead faster through data that does not seem to match
+            ip += 1 + ((ip - anchor) >> 6);
+
+            continue;
+        }
+
+        // extend forwards, leaving the last bytes as literals
+        for (match = ip + LZ_MIN_MATCH, ref += LZ_MIN_MATCH; match < end - LZ_LAST_LITERALS && *match == *ref; match++, ref++)
+            ;
+
+        ref -= match - ip;
+
+        // and backwards into the literals
+        while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+
+        literals = ip - anchor;
+        match_len = match - ip - LZ_MIN_MATCH;
+        offset = ip - ref;
+
+        if (1 + lz_run_size(literals) + literals + 2 + lz_run_size(match_len) > op_end - op)
+            return 0;
+
+        // token with the literal and match lengths, followed by the literals
+        token = op++;
+        *token = (literals < LZ_RUN_MASK ? literals : LZ_RUN_MASK) << 4;
+
+        op = lz_put_run(op, literals);
+        memcpy(op, anchor, literals);
+        op += literals;
+
+        // back-reference
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+
+        *token |= match_len < LZ_RUN_MASK ? match_len : LZ_RUN_MASK;
+        op = lz_put_run(op, match_len);
+
+        anchor = ip = match;
+
+        // the data just before the next position is likely to be repeated
+        if (ip < end - LZ_MATCH_LIMIT)
+            table[lz_hash(lz_read32(ip - 2))] = ip - 2 - base;
+    }
+
+    // trailing literals
+    literals = end - anchor;
+
+    if (1 + lz_run_size(literals) + literals > op_end - op)
+        return 0;
+
+    token = op++;
+    *token = (literals < LZ_RUN_MASK ? literals : LZ_RUN_MASK) << 4;
+
+    op = lz_put_run(op, literals);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return op - (unsigned char *) dst;
+}
+
+int lz_decompress (const char *src, size_t len, char *dst, size_t size)
+{
+    const unsigned char *ip = (const unsigned char *) src, *end = ip + len, *ref;
+    unsigned char *op = (unsigned char *) dst, *op_end = op + size;
+    size_t literals, match_len, offset;
+    unsigned char token;
+
+    while (ip < end) {
+        token = *ip++;
+
+        // literals
+        literals = token >> 4;
+
+        if (lz_get_run(&ip, end, &literals))
+            goto error;
+
+        if (literals > end - ip || literals > op_end - op)
+            goto error;
+
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        if (ip == end)
+            // last sequence has no match
+            break;
+
+        // back-reference
+        if (end - ip < 2)
+            goto error;
+
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > op - (unsigned char *) dst)
+            goto error;
+
+        match_len = token & LZ_RUN_MASK;
+
+        if (lz_get_run(&ip, end, &match_len))
+            goto error;
+
+        match_len += LZ_MIN_MATCH;
+
+        if (match_len > op_end - op)
+            goto error;
+
+        ref = op - offset;
+
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+
+        } else {
+            // overlapping, repeats the last offset bytes
+            while (match_len--)
+                *op++ = *ref++;
+        }
+    }
+
+    if (op != op_end)
+        goto error;
+
+    return 0;
+
+error:
+    errno = EBADMSG;
+
+    return -1;
+}
@@ -0,0 +1,28 @@
+#ifndef SHARED_LZ_H
+#define SHARED_LZ_H
+
+/**
+ * @file
+ *
+ * Fast LZ77 compression for CMD_DATA_LZ, using the LZ4 block format: a sequence of literal runs and back-references of
+ * at least four bytes within the preceding 64k, greedily matched using a single hash table lookup per position.
+ *
+ * Each block is self-contained, so that frames can be compressed once and sent to any number of clients.
+ */
+#include <stddef.h>
+
+/**
+ * Compress len bytes of src into at most size bytes of dst.
+ *
+ * Returns the length of the compressed data, or zero if it does not fit, i.e. the data is not compressible enough.
+ */
+size_t lz_compress (const char *src, size_t len, char *dst, size_t size);
+
+/**
+ * Decompress len bytes of compressed src into exactly size bytes of dst.
+ *
+ * Fails with EBADMSG if the compressed data is invalid, or does not decompress to exactly size bytes.
+ */
+int lz_decompress (const char *src, size_t len, char *dst, size_t size);
+
+#endif
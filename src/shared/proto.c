@@ -1,11 +1,78 @@
+#define _GNU_SOURCE
 #include "proto.h"
+#include "ring.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 
+/**
+ * Names of the PROTO_CAP_* features
+ */
+static const struct proto_cap_name {
+    const char *name;
+    enum proto_caps caps;
+} proto_cap_names[] = {
+    { "none",   0                   },
+    { "all",    PROTO_CAPS          },
+    { "lz",     PROTO_CAP_LZ        },
+    { "large",  PROTO_CAP_LARGE     },
+    { "native", PROTO_CAP_NATIVE    },
+    { "ring",   PROTO_CAP_RING      },
+    { NULL,     0                   }
+};
+
+int proto_caps_parse (const char *str, enum proto_caps *caps_ptr)
+{
+    const struct proto_cap_name *cap;
+    enum proto_caps caps = 0;
+    size_t len;
+
+    while (*str) {
+        len = strcspn(str, ",");
+
+        for (cap = proto_cap_names; cap->name; cap++) {
+            if (strlen(cap->name) == len && strncmp(cap->name, str, len) == 0)
+                break;
+        }
+
+        if (!cap->name) {
+            errno = EINVAL;
+
+            return -1;
+        }
+
+        caps |= cap->caps;
+
+        // next
+        str += len;
+
+        if (*str)
+            str++;
+    }
+
+    *caps_ptr = caps;
+
+    return 0;
+}
+
 int proto_cmd_parse (struct proto_msg *msg)
 {
+    const struct proto_data_head *head;
+
+    if ((head = proto_msg_head(msg, PROTO_HEAD_SIZE)) && msg->offset == 0) {
+        // direct access
+        msg->id = head->id;
+        msg->cmd = head->cmd;
+        msg->offset = PROTO_HEAD_SIZE;
+
+        return 0;
+    }
+
     // read the message id and cmd
     if (
             proto_read_uint32(msg, &msg->id)
@@ -17,24 +84,41 @@ int proto_cmd_parse (struct proto_msg *msg)
     return 0;
 }
 
-int proto_cmd_dispatch (struct proto_cmd_handler cmd_handlers[], struct proto_msg *in, struct proto_msg *out, void *ctx)
+const struct proto_cmd_handler *proto_cmd_lookup (const struct proto_cmd_table *table, uint16_t cmd)
 {
-    struct proto_cmd_handler *cmd_handler;
+    const struct proto_cmd_handler *page, *handler;
 
-    // find the right handler
-    for (cmd_handler = cmd_handlers; cmd_handler->cmd && cmd_handler->handler_func; cmd_handler++) {
-        if (cmd_handler->cmd == in->cmd)
-            break;
+    if (!(page = table->pages[PROTO_CMD_PAGE(cmd)]) || !(handler = &page[PROTO_CMD_INDEX(cmd)])->handler_func) {
+        errno = ENOTSUP;
+
+        return NULL;
     }
 
-    if (!(cmd_handler->cmd && cmd_handler->handler_func)) {
-        errno = ENOTSUP;
-        
+    return handler;
+}
+
+int proto_cmd_call (const struct proto_cmd_handler *handler, struct proto_msg *in, struct proto_msg *out, void *ctx)
+{
+    // fixed-size fields
+    if (in->len - in->offset < handler->min_len) {
+        errno = EBADMSG;
+
         return -1;
     }
 
     // dispatch
-    return cmd_handler->handler_func(in, out, ctx);
+    return handler->handler_func(in, out, ctx);
+}
+
+int proto_cmd_dispatch (const struct proto_cmd_table *table, struct proto_msg *in, struct proto_msg *out, void *ctx)
+{
+    const struct proto_cmd_handler *handler;
+
+    // find the right handler
+    if (!(handler = proto_cmd_lookup(table, in->cmd)))
+        return -1;
+
+    return proto_cmd_call(handler, in, out, ctx);
 }
 
 int proto_msg_init (struct proto_msg *msg, char *buf, size_t len)
@@ -47,6 +131,7 @@ int proto_msg_init (struct proto_msg *msg, char *buf, size_t len)
     // info
     msg->id = 0;
     msg->cmd = 0;
+    msg->native = false;
     
     // ok
     return 0;
@@ -72,6 +157,9 @@ int proto_cmd_start (struct proto_msg *msg, uint32_t id, enum proto_cmd cmd)
 
 int proto_cmd_reply (struct proto_msg *msg, struct proto_msg *req, enum proto_cmd cmd)
 {
+    // in the same byte order
+    msg->native = req->native;
+
     // just use the req's id as the resp id
     return proto_cmd_start(msg, req->id, cmd);
 }
@@ -155,7 +243,8 @@ int proto_read_uint16 (struct proto_msg *msg, uint16_t *val_ptr)
         return -1;
 
     // convert
-    *val_ptr = ntohs(*val_ptr);
+    if (!msg->native)
+        *val_ptr = ntohs(*val_ptr);
 
     // ok
     return 0;
@@ -167,7 +256,21 @@ int proto_read_uint32 (struct proto_msg *msg, uint32_t *val_ptr)
         return -1;
 
     // convert
-    *val_ptr = ntohl(*val_ptr);
+    if (!msg->native)
+        *val_ptr = ntohl(*val_ptr);
+
+    // ok
+    return 0;
+}
+
+int proto_read_uint64 (struct proto_msg *msg, uint64_t *val_ptr)
+{
+    if (proto_read(msg, val_ptr, sizeof(*val_ptr)))
+        return -1;
+
+    // convert
+    if (!msg->native)
+        *val_ptr = be64toh(*val_ptr);
 
     // ok
     return 0;
@@ -179,7 +282,8 @@ int proto_read_int32 (struct proto_msg *msg, int32_t *val_ptr)
         return -1;
 
     // convert
-    *val_ptr = ntohl(*val_ptr);
+    if (!msg->native)
+        *val_ptr = ntohl(*val_ptr);
 
     // ok
     return 0;
@@ -194,7 +298,26 @@ int proto_read_buf_ptr (struct proto_msg *msg, const char **buf_ptr, size_t *len
         return -1;
 
     // get buf
-    *buf_ptr = proto_seek(msg, len);
+    if ((*buf_ptr = proto_seek(msg, len)) == NULL)
+        return -1;
+
+    // ret
+    *len_ptr = len;
+
+    return 0;
+}
+
+int proto_read_buf32_ptr (struct proto_msg *msg, const char **buf_ptr, size_t *len_ptr)
+{
+    uint32_t len;
+
+    // read len
+    if (proto_read_uint32(msg, &len))
+        return -1;
+
+    // get buf
+    if ((*buf_ptr = proto_seek(msg, len)) == NULL)
+        return -1;
 
     // ret
     *len_ptr = len;
@@ -202,6 +325,47 @@ int proto_read_buf_ptr (struct proto_msg *msg, const char **buf_ptr, size_t *len
     return 0;
 }
 
+int proto_read_data_ptr (struct proto_msg *msg, enum proto_version version, const char **buf_ptr, size_t *len_ptr)
+{
+    if (version >= PROTO_V2)
+        return proto_read_buf32_ptr(msg, buf_ptr, len_ptr);
+    else
+        return proto_read_buf_ptr(msg, buf_ptr, len_ptr);
+}
+
+int proto_read_data (struct proto_msg *msg, enum proto_version version, uint16_t *channel_ptr, const char **buf_ptr, size_t *len_ptr)
+{
+    const struct proto_data_head *head;
+    struct proto_data fields;
+
+    if (version >= PROTO_V2 && msg->offset == PROTO_HEAD_SIZE && (head = proto_msg_head(msg, sizeof(*head)))) {
+        // direct access
+        if (head->len > msg->len - sizeof(*head)) {
+            errno = EOVERFLOW;
+
+            return -1;
+        }
+
+        *channel_ptr = head->channel;
+        *buf_ptr = msg->buf + sizeof(*head);
+        *len_ptr = head->len;
+
+        msg->offset = sizeof(*head) + head->len;
+
+        return 0;
+    }
+
+    if (
+            proto_decode_data(msg, &fields)
+        ||  proto_read_data_ptr(msg, version, buf_ptr, len_ptr)
+    )
+        return -1;
+
+    *channel_ptr = fields.channel;
+
+    return 0;
+}
+
 int proto_read_str (struct proto_msg *msg, const char **str_ptr)
 {
     if ((*str_ptr = proto_seek_char(msg, '\0')) == NULL)
@@ -230,27 +394,44 @@ int proto_write (struct proto_msg *msg, const void *buf, size_t len)
 
 int proto_write_uint16 (struct proto_msg *msg, uint16_t val)
 {
-    val = htons(val);
+    if (!msg->native)
+        val = htons(val);
 
     return proto_write(msg, &val, sizeof(val));
 }
 
 int proto_write_uint32 (struct proto_msg *msg, uint32_t val)
 {
-    val = htonl(val);
+    if (!msg->native)
+        val = htonl(val);
+
+    return proto_write(msg, &val, sizeof(val));
+}
+
+int proto_write_uint64 (struct proto_msg *msg, uint64_t val)
+{
+    if (!msg->native)
+        val = htobe64(val);
 
     return proto_write(msg, &val, sizeof(val));
 }
 
 int proto_write_int32 (struct proto_msg *msg, int32_t val)
 {
-    val = htonl(val);
+    if (!msg->native)
+        val = htonl(val);
 
     return proto_write(msg, &val, sizeof(val));
 }
 
 int proto_write_buf (struct proto_msg *msg, const char *buf, size_t len)
 {
+    if (len > UINT16_MAX) {
+        errno = EOVERFLOW;
+
+        return -1;
+    }
+
     // write length prefix and data
     return (
             proto_write_uint16(msg, len)
@@ -258,6 +439,149 @@ int proto_write_buf (struct proto_msg *msg, const char *buf, size_t len)
     );
 }
 
+int proto_write_buf_ptr (struct proto_msg *msg, char **buf_ptr, size_t len)
+{
+    if (len > UINT16_MAX) {
+        errno = EOVERFLOW;
+
+        return -1;
+    }
+
+    // write length prefix
+    if (proto_write_uint16(msg, len))
+        return -1;
+
+    // reserve
+    if (msg->offset + len > msg->len) {
+        errno = EOVERFLOW;
+
+        return -1;
+    }
+
+    if (buf_ptr)
+        *buf_ptr = msg->buf + msg->offset;
+
+    msg->offset += len;
+
+    return 0;
+}
+
+int proto_write_buf32_ptr (struct proto_msg *msg, char **buf_ptr, size_t len)
+{
+    // write length prefix
+    if (proto_write_uint32(msg, len))
+        return -1;
+
+    // reserve
+    if (msg->offset + len > msg->len) {
+        errno = EOVERFLOW;
+
+        return -1;
+    }
+
+    if (buf_ptr)
+        *buf_ptr = msg->buf + msg->offset;
+
+    msg->offset += len;
+
+    return 0;
+}
+
+int proto_write_data_ptr (struct proto_msg *msg, enum proto_version version, char **buf_ptr, size_t len)
+{
+    if (version >= PROTO_V2)
+        return proto_write_buf32_ptr(msg, buf_ptr, len);
+    else
+        return proto_write_buf_ptr(msg, buf_ptr, len);
+}
+
+/**
+ * Append the given slice to the proto_iov
+ */
+static int proto_iov_add (struct proto_iov *iov, const void *base, size_t len)
+{
+    if (iov->iovcnt >= PROTO_IOV_MAX || iov->len + len > iov->max) {
+        errno = EOVERFLOW;
+
+        return -1;
+    }
+
+    iov->iov[iov->iovcnt].iov_base = (void *) base;
+    iov->iov[iov->iovcnt].iov_len = len;
+
+    iov->iovcnt++;
+    iov->len += len;
+
+    return 0;
+}
+
+/**
+ * Append any fields written since the last slice to the proto_iov
+ */
+static int proto_iov_mark (struct proto_iov *iov)
+{
+    size_t offset = iov->msg.offset;
+
+    if (offset == iov->mark)
+        return 0;
+
+    if (proto_iov_add(iov, iov->buf + iov->mark, offset - iov->mark))
+        return -1;
+
+    iov->mark = offset;
+
+    return 0;
+}
+
+int proto_iov_init (struct proto_iov *iov, bool native, uint32_t id, enum proto_cmd cmd)
+{
+    iov->mark = 0;
+    iov->len = 0;
+    iov->max = ND_PROTO_MSG_MAX;
+    iov->iovcnt = 0;
+
+    if (proto_msg_init(&iov->msg, iov->buf, sizeof(iov->buf)))
+        return -1;
+
+    iov->msg.native = native;
+
+    return proto_cmd_start(&iov->msg, id, cmd);
+}
+
+void proto_iov_limit (struct proto_iov *iov, size_t max)
+{
+    iov->max = max;
+}
+
+int proto_iov_write_buf (struct proto_iov *iov, const char *buf, size_t len)
+{
+    if (len > UINT16_MAX) {
+        errno = EOVERFLOW;
+
+        return -1;
+    }
+
+    // write length prefix in place, and reference the data
+    return (
+            proto_write_uint16(&iov->msg, len)
+        ||  proto_iov_mark(iov)
+        ||  proto_iov_add(iov, buf, len)
+    );
+}
+
+int proto_iov_write_data (struct proto_iov *iov, enum proto_version version, const char *buf, size_t len)
+{
+    if (version < PROTO_V2)
+        return proto_iov_write_buf(iov, buf, len);
+
+    // write length prefix in place, and reference the data
+    return (
+            proto_write_uint32(&iov->msg, len)
+        ||  proto_iov_mark(iov)
+        ||  proto_iov_add(iov, buf, len)
+    );
+}
+
 int proto_write_str (struct proto_msg *msg, const char *str)
 {
     size_t len = strlen(str);
@@ -287,49 +611,882 @@ int proto_write_str_array (struct proto_msg *msg, const char *str_array[])
     return 0;
 }
 
-int proto_send_seqpacket (int sock, struct proto_msg *msg)
+/**
+ * Unchecked access to fields within a block that has already been seeked past
+ */
+static inline void proto_get_uint16 (const struct proto_msg *msg, const char *p, uint16_t *val_ptr)
 {
-    ssize_t ret;
+    memcpy(val_ptr, p, sizeof(*val_ptr));
 
-    if ((ret = send(sock, msg->buf, msg->offset, 0)) < 0)
-        return -1;
+    if (!msg->native)
+        *val_ptr = ntohs(*val_ptr);
+}
 
-    // XXX: for now, assume that we can send complete messages...
-    if (ret < msg->offset) {
-        errno = EMSGSIZE;
+static inline void proto_get_uint32 (const struct proto_msg *msg, const char *p, uint32_t *val_ptr)
+{
+    memcpy(val_ptr, p, sizeof(*val_ptr));
 
-        return -1;
-    }
+    if (!msg->native)
+        *val_ptr = ntohl(*val_ptr);
+}
 
-    // ok
-    return 0;
+static inline void proto_get_uint64 (const struct proto_msg *msg, const char *p, uint64_t *val_ptr)
+{
+    memcpy(val_ptr, p, sizeof(*val_ptr));
+
+    if (!msg->native)
+        *val_ptr = be64toh(*val_ptr);
 }
 
-int proto_recv_seqpacket (int sock, struct proto_msg *msg)
+static inline void proto_get_int32 (const struct proto_msg *msg, const char *p, int32_t *val_ptr)
 {
-    ssize_t ret;
+    proto_get_uint32(msg, p, (uint32_t *) val_ptr);
+}
 
-    // try recv()
-    if ((ret = recv(sock, msg->buf, msg->len, MSG_TRUNC)) < 0) {
-        return -1;
-    
-    } else if (ret == 0) {
-        // EOF
-        errno = EINVAL;
+static inline void proto_put_uint16 (const struct proto_msg *msg, char *p, uint16_t val)
+{
+    if (!msg->native)
+        val = htons(val);
 
-        return -1;
+    memcpy(p, &val, sizeof(val));
+}
 
-    } else if (ret > msg->len) {
-        // truncated
-        errno = EMSGSIZE;
+static inline void proto_put_uint32 (const struct proto_msg *msg, char *p, uint32_t val)
+{
+    if (!msg->native)
+        val = htonl(val);
 
-        return -1;
+    memcpy(p, &val, sizeof(val));
+}
+
+static inline void proto_put_uint64 (const struct proto_msg *msg, char *p, uint64_t val)
+{
+    if (!msg->native)
+        val = htobe64(val);
+
+    memcpy(p, &val, sizeof(val));
+}
+
+static inline void proto_put_int32 (const struct proto_msg *msg, char *p, int32_t val)
+{
+    proto_put_uint32(msg, p, val);
+}
+
+#define PROTO_SCHEMA_GET(type, name) \
+    proto_get_ ## type(msg, p, &fields->name); \
+    p += sizeof(type ## _t);
+
+#define PROTO_SCHEMA_PUT(type, name) \
+    proto_put_ ## type(msg, p, fields->name); \
+    p += sizeof(type ## _t);
+
+#define PROTO_SCHEMA_DEFINE(name, FIELDS) \
+    int proto_decode_ ## name (struct proto_msg *msg, struct proto_ ## name *fields) \
+    { \
+        const char *p; \
+        \
+        if ((p = proto_seek(msg, PROTO_LEN_ ## name)) == NULL) \
+            return -1; \
+        \
+        FIELDS(PROTO_SCHEMA_GET) \
+        \
+        return 0; \
+    } \
+    \
+    int proto_encode_ ## name (struct proto_msg *msg, const struct proto_ ## name *fields) \
+    { \
+        char *p; \
+        \
+        if ((p = proto_seek(msg, PROTO_LEN_ ## name)) == NULL) \
+            return -1; \
+        \
+        FIELDS(PROTO_SCHEMA_PUT) \
+        \
+        return 0; \
     }
 
-    // set
-    msg->len = ret;
+PROTO_SCHEMA(PROTO_SCHEMA_DEFINE)
 
-    // ok
-    return 0;
+/**
+ * Per-thread pool of free PROTO_FRAME_POOL_SIZE frames
+ */
+static __thread struct proto_frame *proto_frame_pool;
+static __thread unsigned proto_frame_pool_count;
+
+struct proto_frame *proto_frame_new (size_t size)
+{
+    struct proto_frame *frame;
+
+    if (size > PROTO_FRAME_POOL_SIZE || size <= PROTO_FRAME_POOL_SIZE / 2) {
+        // not worth pooling
+        if ((frame = malloc(sizeof(*frame) + size)) == NULL)
+            return NULL;
+
+    } else if ((frame = proto_frame_pool) != NULL) {
+        // reuse
+        proto_frame_pool = frame->pool_next;
+        proto_frame_pool_count--;
+
+        size = PROTO_FRAME_POOL_SIZE;
+
+    } else {
+        // recycled on unref
+        size = PROTO_FRAME_POOL_SIZE;
+
+        if ((errno = posix_memalign((void **) &frame, PROTO_BUF_ALIGN, sizeof(*frame) + size)))
+            return NULL;
+    }
+
+    frame->refs = 1;
+    frame->size = size;
+    frame->len = 0;
+    frame->pool_next = NULL;
+
+    return frame;
 }
 
+int proto_frame_msg (struct proto_frame *frame, struct proto_msg *msg)
+{
+    return proto_msg_init(msg, frame->buf, frame->size);
+}
+
+void proto_frame_end (struct proto_frame *frame, struct proto_msg *msg)
+{
+    frame->len = msg->offset;
+}
+
+struct proto_frame *proto_frame_copy (struct proto_msg *msg)
+{
+    struct proto_frame *frame;
+
+    if ((frame = proto_frame_new(msg->offset)) == NULL)
+        return NULL;
+
+    memcpy(frame->buf, msg->buf, msg->offset);
+    frame->len = msg->offset;
+
+    return frame;
+}
+
+void proto_frame_unref (struct proto_frame *frame)
+{
+    if (--frame->refs)
+        return;
+
+    if (frame->size == PROTO_FRAME_POOL_SIZE && proto_frame_pool_count < PROTO_FRAME_POOL_MAX) {
+        // keep for reuse by this thread, which may not be the thread that allocated it
+        frame->pool_next = proto_frame_pool;
+        proto_frame_pool = frame;
+        proto_frame_pool_count++;
+
+        return;
+    }
+
+    free(frame);
+}
+
+int proto_send_buf_seqpacket (int sock, const char *buf, size_t len)
+{
+    ssize_t ret;
+
+    if ((ret = send(sock, buf, len, MSG_NOSIGNAL)) < 0)
+        return -1;
+
+    // complete messages only
+    if (ret < len) {
+        errno = EMSGSIZE;
+
+        return -1;
+    }
+
+    // ok
+    return 0;
+}
+
+int proto_send_seqpacket (int sock, struct proto_msg *msg)
+{
+    return proto_send_buf_seqpacket(sock, msg->buf, msg->offset);
+}
+
+int proto_send_iov_seqpacket (int sock, struct proto_iov *iov)
+{
+    struct msghdr msg = { };
+    ssize_t ret;
+
+    // any trailing fields
+    if (proto_iov_mark(iov))
+        return -1;
+
+    msg.msg_iov = iov->iov;
+    msg.msg_iovlen = iov->iovcnt;
+
+    if ((ret = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0)
+        return -1;
+
+    // complete messages only
+    if (ret < iov->len) {
+        errno = EMSGSIZE;
+
+        return -1;
+    }
+
+    // ok
+    return 0;
+}
+
+int proto_send_fds_seqpacket (int sock, const char *buf, size_t len, const int *fds, unsigned count)
+{
+    struct iovec iov = { .iov_base = (char *) buf, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    char control[CMSG_SPACE(sizeof(int) * PROTO_FDS_MAX)] = { };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    if (count > PROTO_FDS_MAX) {
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    if ((ret = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0)
+        return -1;
+
+    // complete messages only
+    if (ret < len) {
+        errno = EMSGSIZE;
+
+        return -1;
+    }
+
+    // ok
+    return 0;
+}
+
+int proto_send_frame_seqpacket (int sock, struct proto_frame *frame)
+{
+    return proto_send_buf_seqpacket(sock, frame->buf, frame->len);
+}
+
+int proto_recv_seqpacket (int sock, struct proto_msg *msg)
+{
+    ssize_t ret;
+
+    // try recv()
+    if ((ret = recv(sock, msg->buf, msg->len, MSG_TRUNC)) < 0) {
+        return -1;
+    
+    } else if (ret == 0) {
+        // EOF
+        errno = EINVAL;
+
+        return -1;
+
+    } else if (ret > msg->len) {
+        // truncated
+        errno = EMSGSIZE;
+
+        return -1;
+    }
+
+    // set
+    msg->len = ret;
+
+    // ok
+    return 0;
+}
+
+int proto_recv_fds_seqpacket (int sock, struct proto_msg *msg, int *fds, unsigned *count_ptr)
+{
+    struct iovec iov = { .iov_base = msg->buf, .iov_len = msg->len };
+    struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1 };
+    char control[CMSG_SPACE(sizeof(int) * PROTO_FDS_MAX)];
+    struct cmsghdr *cmsg;
+    unsigned count = 0, i;
+    ssize_t ret;
+
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    if ((ret = recvmsg(sock, &hdr, MSG_TRUNC | MSG_CMSG_CLOEXEC)) < 0)
+        return -1;
+
+    // take any fds first, so that they are not leaked on errors
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        for (i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+            int fd;
+
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+
+            if (count < *count_ptr)
+                fds[count++] = fd;
+            else
+                close(fd);
+        }
+    }
+
+    *count_ptr = count;
+
+    if (ret == 0) {
+        // EOF
+        errno = EINVAL;
+
+        goto error;
+
+    } else if (ret > msg->len) {
+        // truncated
+        errno = EMSGSIZE;
+
+        goto error;
+    }
+
+    // set
+    msg->len = ret;
+
+    // ok
+    return 0;
+
+error:
+    while (count--)
+        close(fds[count]);
+
+    *count_ptr = 0;
+
+    return -1;
+}
+
+int proto_send_iov_ring (struct ring *ring, struct proto_iov *iov)
+{
+    // any trailing fields
+    if (proto_iov_mark(iov))
+        return -1;
+
+    return ring_writev(ring, iov->iov, iov->iovcnt);
+}
+
+
+/**
+ * Write the uint32_t length prefix for a message of the given length
+ */
+static void proto_stream_prefix (char *buf, size_t len)
+{
+    uint32_t prefix = htonl(len);
+
+    memcpy(buf, &prefix, sizeof(prefix));
+}
+
+int proto_send_stream (int sock, const char *buf, size_t len, size_t *offset_ptr)
+{
+    char prefix[PROTO_STREAM_PREFIX];
+    struct iovec iov[2];
+    struct msghdr msg = { };
+    size_t offset;
+    ssize_t ret;
+
+    proto_stream_prefix(prefix, len);
+
+    while ((offset = *offset_ptr) < sizeof(prefix) + len) {
+        // the rest of the prefix, if any, followed by the rest of the message
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 0;
+
+        if (offset < sizeof(prefix)) {
+            iov[msg.msg_iovlen++] = (struct iovec) { prefix + offset, sizeof(prefix) - offset };
+
+            offset = sizeof(prefix);
+        }
+
+        iov[msg.msg_iovlen++] = (struct iovec) { (char *) buf + offset - sizeof(prefix), sizeof(prefix) + len - offset };
+
+        if ((ret = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0)
+            return -1;
+
+        *offset_ptr += ret;
+    }
+
+    // done
+    *offset_ptr = 0;
+
+    return 0;
+}
+
+int proto_send_iov_stream (int sock, struct proto_iov *iov)
+{
+    char prefix[PROTO_STREAM_PREFIX];
+    struct iovec iovs[1 + PROTO_IOV_MAX], *next = iovs;
+    struct msghdr msg = { };
+    unsigned count;
+    ssize_t ret;
+
+    // any trailing fields
+    if (proto_iov_mark(iov))
+        return -1;
+
+    proto_stream_prefix(prefix, iov->len);
+
+    iovs[0] = (struct iovec) { prefix, sizeof(prefix) };
+    memcpy(&iovs[1], iov->iov, iov->iovcnt * sizeof(*iov->iov));
+    count = 1 + iov->iovcnt;
+
+    while (count) {
+        msg.msg_iov = next;
+        msg.msg_iovlen = count;
+
+        if ((ret = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0)
+            return -1;
+
+        // skip past whatever was sent
+        while (count && ret >= next->iov_len) {
+            ret -= next->iov_len;
+            next++;
+            count--;
+        }
+
+        if (count) {
+            next->iov_base = (char *) next->iov_base + ret;
+            next->iov_len -= ret;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Read exactly the given number of bytes from a blocking socket
+ */
+static int proto_read_stream (int sock, char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        if ((ret = read(sock, buf, len)) < 0) {
+            return -1;
+
+        } else if (ret == 0) {
+            // EOF
+            errno = EINVAL;
+
+            return -1;
+        }
+
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+int proto_recv_stream_msg (int sock, struct proto_msg *msg)
+{
+    uint32_t prefix;
+    size_t len;
+
+    if (proto_read_stream(sock, (char *) &prefix, sizeof(prefix)))
+        return -1;
+
+    if ((len = ntohl(prefix)) > msg->len) {
+        errno = EMSGSIZE;
+
+        return -1;
+    }
+
+    if (proto_read_stream(sock, msg->buf, len))
+        return -1;
+
+    // set
+    msg->len = len;
+
+    return 0;
+}
+
+struct proto_stream {
+    /** Reassembly buffer, and the maximum length of a message */
+    char *buf;
+    size_t size, max;
+
+    /** Offset of the first frame not yet taken, and the end of the data read so far */
+    size_t start, end;
+
+    /** The last message taken */
+    struct proto_msg msg;
+};
+
+/**
+ * Return the total length of the frame at the start of the stream, once its prefix has been read, or zero
+ */
+static size_t proto_stream_frame (const struct proto_stream *stream)
+{
+    uint32_t prefix;
+
+    if (stream->end - stream->start < sizeof(prefix))
+        return 0;
+
+    memcpy(&prefix, stream->buf + stream->start, sizeof(prefix));
+
+    return sizeof(prefix) + ntohl(prefix);
+}
+
+struct proto_stream *proto_stream_new (size_t max)
+{
+    struct proto_stream *stream;
+
+    if ((stream = calloc(1, sizeof(*stream))) == NULL)
+        return NULL;
+
+    if ((stream->buf = malloc(PROTO_STREAM_BUF)) == NULL) {
+        free(stream);
+
+        return NULL;
+    }
+
+    stream->size = PROTO_STREAM_BUF;
+    stream->max = max;
+
+    return stream;
+}
+
+void proto_stream_limit (struct proto_stream *stream, size_t max)
+{
+    stream->max = max;
+}
+
+void proto_stream_free (struct proto_stream *stream)
+{
+    free(stream->buf);
+    free(stream);
+}
+
+int proto_recv_stream (int sock, struct proto_stream *stream)
+{
+    size_t frame;
+    ssize_t ret;
+    char *buf;
+
+    if (stream->start) {
+        // move any partial frame to the front
+        memmove(stream->buf, stream->buf + stream->start, stream->end - stream->start);
+
+        stream->end -= stream->start;
+        stream->start = 0;
+    }
+
+    if ((frame = proto_stream_frame(stream)) > PROTO_STREAM_PREFIX + stream->max) {
+        errno = EMSGSIZE;
+
+        return -1;
+
+    } else if (frame > stream->size) {
+        // grow to fit
+        if ((buf = realloc(stream->buf, frame)) == NULL)
+            return -1;
+
+        stream->buf = buf;
+        stream->size = frame;
+    }
+
+    if ((ret = read(sock, stream->buf + stream->end, stream->size - stream->end)) < 0) {
+        return -1;
+
+    } else if (ret == 0) {
+        // EOF
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    stream->end += ret;
+
+    return 0;
+}
+
+int proto_stream_feed (struct proto_stream *stream, const char *buf, size_t len)
+{
+    size_t size;
+    char *new_buf;
+
+    if (stream->start) {
+        // move any partial frame to the front
+        memmove(stream->buf, stream->buf + stream->start, stream->end - stream->start);
+
+        stream->end -= stream->start;
+        stream->start = 0;
+    }
+
+    if (stream->end + len > stream->size) {
+        // grow to fit, which is bounded by the frame check below
+        for (size = stream->size; size < stream->end + len; size *= 2)
+            ;
+
+        if ((new_buf = realloc(stream->buf, size)) == NULL)
+            return -1;
+
+        stream->buf = new_buf;
+        stream->size = size;
+    }
+
+    memcpy(stream->buf + stream->end, buf, len);
+    stream->end += len;
+
+    if (proto_stream_frame(stream) > PROTO_STREAM_PREFIX + stream->max) {
+        errno = EMSGSIZE;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+struct proto_msg *proto_stream_next (struct proto_stream *stream)
+{
+    size_t frame;
+
+    if (!proto_stream_pending(stream))
+        return NULL;
+
+    frame = proto_stream_frame(stream);
+
+    proto_msg_init(&stream->msg, stream->buf + stream->start + PROTO_STREAM_PREFIX, frame - PROTO_STREAM_PREFIX);
+
+    stream->start += frame;
+
+    return &stream->msg;
+}
+
+int proto_stream_pending (const struct proto_stream *stream)
+{
+    size_t frame = proto_stream_frame(stream);
+
+    return frame && stream->end - stream->start >= frame;
+}
+
+struct proto_batch {
+    /** Number of slots, and the number of messages received into them and already taken */
+    unsigned size, count, index;
+
+    /** Per-slot recvmmsg state */
+    struct mmsghdr *hdrs;
+    struct iovec *iovs;
+
+    /** Per-slot received messages, and their ND_PROTO_MSG_MAX buffers */
+    struct proto_msg *msgs;
+    char *bufs;
+};
+
+struct proto_batch *proto_batch_new (unsigned size)
+{
+    struct proto_batch *batch;
+    unsigned i;
+
+    if ((batch = calloc(1, sizeof(*batch))) == NULL)
+        return NULL;
+
+    batch->size = size;
+
+    if (
+            (batch->hdrs = calloc(size, sizeof(*batch->hdrs))) == NULL
+        ||  (batch->iovs = calloc(size, sizeof(*batch->iovs))) == NULL
+        ||  (batch->msgs = calloc(size, sizeof(*batch->msgs))) == NULL
+    )
+        goto error;
+
+    if ((errno = posix_memalign((void **) &batch->bufs, PROTO_BUF_ALIGN, size * ND_PROTO_MSG_MAX)))
+        goto error;
+
+    // the slots always point at the same buffers
+    for (i = 0; i < size; i++) {
+        batch->iovs[i].iov_base = batch->bufs + i * ND_PROTO_MSG_MAX;
+        batch->iovs[i].iov_len = ND_PROTO_MSG_MAX;
+
+        batch->hdrs[i].msg_hdr.msg_iov = &batch->iovs[i];
+        batch->hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return batch;
+
+error:
+    proto_batch_free(batch);
+
+    return NULL;
+}
+
+struct proto_batch *proto_batch_take (struct proto_batch *batch)
+{
+    struct proto_batch *taken;
+    struct proto_msg *msg;
+    unsigned count = batch->count - batch->index, i;
+    size_t len = 0;
+    char *buf;
+
+    for (i = batch->index; i < batch->count; i++)
+        len += batch->msgs[i].len;
+
+    if ((taken = calloc(1, sizeof(*taken))) == NULL)
+        return NULL;
+
+    // sized for exactly what is left
+    taken->size = taken->count = count;
+
+    if (
+            (taken->msgs = calloc(count, sizeof(*taken->msgs))) == NULL
+        ||  (taken->bufs = malloc(len)) == NULL
+    ) {
+        proto_batch_free(taken);
+
+        return NULL;
+    }
+
+    for (buf = taken->bufs, i = 0; i < count; i++) {
+        msg = &batch->msgs[batch->index + i];
+
+        memcpy(buf, msg->buf, msg->len);
+        proto_msg_init(&taken->msgs[i], buf, msg->len);
+
+        buf += msg->len;
+    }
+
+    batch->index = batch->count;
+
+    return taken;
+}
+
+struct proto_batch *proto_batch_append (struct proto_batch *batch, const char *buf, size_t len)
+{
+    struct proto_batch *appended;
+    unsigned count = batch ? batch->count : 0, i;
+    size_t offset = 0;
+
+    for (i = 0; i < count; i++)
+        offset += batch->msgs[i].len;
+
+    if ((appended = calloc(1, sizeof(*appended))) == NULL)
+        return NULL;
+
+    // sized for exactly what is left, as by proto_batch_take
+    appended->size = appended->count = count + 1;
+    appended->index = batch ? batch->index : 0;
+
+    if (
+            (appended->msgs = calloc(count + 1, sizeof(*appended->msgs))) == NULL
+        ||  (appended->bufs = malloc(offset + len)) == NULL
+    ) {
+        proto_batch_free(appended);
+
+        return NULL;
+    }
+
+    if (offset)
+        memcpy(appended->bufs, batch->bufs, offset);
+
+    memcpy(appended->bufs + offset, buf, len);
+
+    for (offset = 0, i = 0; i <= count; i++) {
+        if (i < count)
+            appended->msgs[i] = batch->msgs[i];
+        else
+            proto_msg_init(&appended->msgs[i], NULL, len);
+
+        appended->msgs[i].buf = appended->bufs + offset;
+
+        offset += appended->msgs[i].len;
+    }
+
+    if (batch)
+        proto_batch_free(batch);
+
+    return appended;
+}
+
+void proto_batch_free (struct proto_batch *batch)
+{
+    free(batch->bufs);
+    free(batch->msgs);
+    free(batch->iovs);
+    free(batch->hdrs);
+    free(batch);
+}
+
+int proto_recv_batch (int sock, struct proto_batch *batch)
+{
+    struct mmsghdr *hdr;
+    int ret;
+    unsigned i;
+
+    // anything left over is discarded
+    batch->count = batch->index = 0;
+
+    if ((ret = recvmmsg(sock, batch->hdrs, batch->size, MSG_DONTWAIT, NULL)) < 0)
+        return -1;
+
+    for (i = 0; i < ret; i++) {
+        hdr = &batch->hdrs[i];
+
+        if (hdr->msg_len == 0) {
+            // EOF, handle whatever came before it first
+            break;
+
+        } else if (hdr->msg_hdr.msg_flags & MSG_TRUNC) {
+            errno = EMSGSIZE;
+
+            return -1;
+        }
+
+        proto_msg_init(&batch->msgs[i], batch->iovs[i].iov_base, hdr->msg_len);
+    }
+
+    if (i == 0) {
+        // EOF
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    batch->count = i;
+
+    return 0;
+}
+
+void proto_batch_reset (struct proto_batch *batch)
+{
+    batch->count = batch->index = 0;
+}
+
+int proto_batch_push (struct proto_batch *batch, char *buf, size_t len)
+{
+    if (batch->count >= batch->size) {
+        errno = ENOBUFS;
+
+        return -1;
+    }
+
+    return proto_msg_init(&batch->msgs[batch->count++], buf, len);
+}
+
+int proto_batch_full (const struct proto_batch *batch)
+{
+    return batch->count >= batch->size;
+}
+
+struct proto_msg *proto_batch_next (struct proto_batch *batch)
+{
+    if (batch->index >= batch->count)
+        return NULL;
+
+    return &batch->msgs[batch->index++];
+}
+
+int proto_batch_pending (const struct proto_batch *batch)
+{
+    return batch->index < batch->count;
+}
@@ -8,6 +8,8 @@
  */
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 
 /**
  * Protocol version, uint16_t
@@ -15,11 +17,43 @@
 enum proto_version {
     /** First version */
     PROTO_V1         = 1,
+
+    /** CMD_DATA with uint32_t lengths, and optional features negotiated in CMD_HELLO */
+    PROTO_V2         = 2,
     
     /** Current version */
-    PROTO_VERSION    =   PROTO_V1,
+    PROTO_VERSION    =   PROTO_V2,
+};
+
+/**
+ * Optional protocol features, uint32_t bitmask.
+ *
+ * The client requests the features it supports in CMD_HELLO, and the server replies with the ones that it will use.
+ */
+enum proto_caps {
+    /** Process output may be sent compressed as CMD_DATA_LZ */
+    PROTO_CAP_LZ     = 0x0001,
+
+    /** Messages of up to ND_PROTO_STREAM_MSG_MAX on SOCK_STREAM transports or RING_MSG_MAX on rings, large CMD_DATA */
+    PROTO_CAP_LARGE  = 0x0002,
+
+    /** Integers in host byte order following CMD_HELLO, only used for AF_UNIX connections */
+    PROTO_CAP_NATIVE = 0x0004,
+
+    /** Messages following CMD_HELLO are sent using shared memory rings, only used for AF_UNIX connections */
+    PROTO_CAP_RING   = 0x0008,
+
+    /** All features supported by this implementation */
+    PROTO_CAPS       = PROTO_CAP_LZ | PROTO_CAP_LARGE | PROTO_CAP_NATIVE | PROTO_CAP_RING,
 };
 
+/**
+ * Parse a comma-separated list of feature names, "all" or "none" into a PROTO_CAP_* bitmask.
+ *
+ * Fails with EINVAL for unknown names.
+ */
+int proto_caps_parse (const char *str, enum proto_caps *caps_ptr);
+
 /**
  * Protocol message ID.
  *
@@ -53,13 +87,19 @@ enum proto_cmd {
     /**
      * Client -> Server:
      *  uint16_t    proto_version       best protocol version supported by the client
+     *  [uint32_t   caps]               PROTO_V2: features requested by the client (PROTO_CAP_*)
      *
      * Server -> Client:
      *  uint16_t    proto_version       best protocol version supported by the server
+     *  [uint32_t   caps]               features requested by the client that the server will use, if requested
      *
      * Initial message sent by client to server when connecting, server replies with the same code. Used to negotiate
      * protocol version used; the version specified by the client takes precedence if the server replies with a newer
-     * version, this is just used to indicate what the server could support.
+     * version, this is just used to indicate what the server could support. Both sides use the older of the two
+     * versions for the rest of the connection.
+     *
+     * With PROTO_CAP_RING, the server's reply carries the memfd and eventfds of a ring_link as SCM_RIGHTS, and all
+     * further messages in either direction are sent using its rings rather than the socket.
      */
     CMD_HELLO       = 0x0001,
 
@@ -78,6 +118,11 @@ enum proto_cmd {
     /**
      * Client -> Server: attach to an existing process
      *  string          proc_id
+     *  [uint64_t       offset]             output stream offset to replay the process's scrollback from
+     *
+     * Once attached, the process's retained output from the given offset onwards is replayed as CMD_DATA following
+     * the CMD_ATTACHED reply. If no offset is given, all of the retained output is replayed; an offset past the end of
+     * the output replays nothing.
      */
     CMD_ATTACH      = 0x0102,
 
@@ -97,6 +142,13 @@ enum proto_cmd {
     /**
      * Server -> Client: attached to given process
      *  string          proc_id
+     *  uint16_t        process_status
+     *  uint16_t        status_code
+     *  [uint64_t       offset]             output stream offset of the first byte of CMD_DATA to follow, if any is
+     *                                      replayed; omitted by older servers
+     *
+     * The output stream offset counts the bytes of stdout and stderr data produced by the process, in the order they
+     * were read. An offset greater than the one requested in CMD_ATTACH means that some of the output was lost.
      */
     CMD_ATTACHED    = 0x0110,
 
@@ -104,7 +156,8 @@ enum proto_cmd {
      * Server -> Client: data from process stdout/err
      * Client -> Server: data to process stdin
      *  uint16_t        channel (CHANNEL_*)
-     *  [uint16_t]      data
+     *  [uint16_t]      data                PROTO_V1
+     *  [uint32_t]      data                PROTO_V2
      *
      * These data segments are ordered and interleaved atomically.
      *
@@ -126,6 +179,16 @@ enum proto_cmd {
      */
     CMD_KILL        = 0x0203,
 
+    /**
+     * Server -> Client: compressed data from process stdout/err, if PROTO_CAP_LZ is used
+     *  uint16_t        channel (CHANNEL_*)
+     *  uint32_t        len                 length of the decompressed data
+     *  [uint32_t]      data                LZ4 block format
+     *
+     * Sent in place of a non-empty CMD_DATA of at least PROTO_LZ_MIN bytes, if that compresses well.
+     */
+    CMD_DATA_LZ     = 0x0204,
+
     /**
      * Server -> Client: Associated command executed ok, no specific reply data
      */
@@ -146,11 +209,87 @@ enum proto_cmd {
     CMD_ABORT       = 0xffff,
 };
 
+/**
+ * Schema of the fixed-size blocks of fields within the above messages, as F(type, name) for each field in order, where
+ * type is one of uint16, uint32, uint64 or int32.
+ *
+ * Each block is read and written as a whole by the proto_decode_* and proto_encode_* functions generated from
+ * PROTO_SCHEMA, which use a struct proto_* with the same fields. Any strings and byte arrays around the block are read
+ * and written separately.
+ */
+
+/** CMD_DATA, followed by the data */
+#define PROTO_FIELDS_DATA(F) \
+    F(uint16,   channel)
+
+/** CMD_DATA_LZ, followed by the compressed data */
+#define PROTO_FIELDS_DATA_LZ(F) \
+    F(uint16,   channel) \
+    F(uint32,   len)
+
+/** CMD_STATUS, and each process in CMD_ATTACHED and CMD_LIST following the proc_id */
+#define PROTO_FIELDS_STATUS(F) \
+    F(uint16,   status) \
+    F(uint16,   code)
+
+/** Optional in CMD_ATTACH and CMD_ATTACHED, following the proc_id and status */
+#define PROTO_FIELDS_OFFSET(F) \
+    F(uint64,   offset)
+
+/** CMD_KILL */
+#define PROTO_FIELDS_KILL(F) \
+    F(uint16,   signal)
+
+/** CMD_ERROR and CMD_ABORT, followed by the err_msg */
+#define PROTO_FIELDS_ERROR(F) \
+    F(int32,    err_code)
+
+/**
+ * List of blocks, as X(name, FIELDS)
+ */
+#define PROTO_SCHEMA(X) \
+    X(data,     PROTO_FIELDS_DATA) \
+    X(data_lz,  PROTO_FIELDS_DATA_LZ) \
+    X(status,   PROTO_FIELDS_STATUS) \
+    X(offset,   PROTO_FIELDS_OFFSET) \
+    X(kill,     PROTO_FIELDS_KILL) \
+    X(error,    PROTO_FIELDS_ERROR)
+
+#define PROTO_SCHEMA_FIELD(type, name)      type ## _t name;
+#define PROTO_SCHEMA_SIZE(type, name)       + sizeof(type ## _t)
+#define PROTO_SCHEMA_STRUCT(name, FIELDS)   struct proto_ ## name { FIELDS(PROTO_SCHEMA_FIELD) };
+#define PROTO_SCHEMA_LEN(name, FIELDS)      PROTO_LEN_ ## name = 0 FIELDS(PROTO_SCHEMA_SIZE),
+
+PROTO_SCHEMA(PROTO_SCHEMA_STRUCT)
+
+/**
+ * Encoded length of each block as PROTO_LEN_<name>, without any struct padding.
+ *
+ * Used for the min_len of the PROTO_CMD handlers, together with PROTO_LEN_STR for each string and the length prefix
+ * of any data.
+ */
+enum proto_schema_len {
+    PROTO_SCHEMA(PROTO_SCHEMA_LEN)
+
+    /** Minimum encoded length of a string, which is just the NUL */
+    PROTO_LEN_STR = 1,
+};
+
 /**
  * Maximum length of a protocol message: 64k
  */
 #define ND_PROTO_MSG_MAX (64 * 1024)
 
+/**
+ * Maximum length of a message on a SOCK_STREAM transport using PROTO_CAP_LARGE: 1M
+ */
+#define ND_PROTO_STREAM_MSG_MAX (1024 * 1024)
+
+/**
+ * Shortest CMD_DATA that is worth compressing as CMD_DATA_LZ
+ */
+#define PROTO_LZ_MIN 256
+
 /**
  * Protocol message, used for incoming and outgoing messages
  */
@@ -169,6 +308,112 @@ struct proto_msg {
 
     /** Command code */
     uint16_t cmd;
+
+    /** Integers are encoded in host byte order, as per PROTO_CAP_NATIVE */
+    bool native;
+};
+
+/**
+ * Fixed layout of the message header, followed by the CMD_DATA fields in PROTO_V2.
+ *
+ * A native-order message in an aligned buffer can be read using direct access to these, rather than proto_read_*.
+ */
+struct proto_data_head {
+    uint32_t id;
+    uint16_t cmd;
+    uint16_t channel;
+    uint32_t len;
+};
+
+/**
+ * Length of the message header: message id and command
+ */
+#define PROTO_HEAD_SIZE (sizeof(uint32_t) + sizeof(uint16_t))
+
+/**
+ * Return the fixed-layout head of the given native-order message, if at least len bytes of it are available for
+ * direct access, or NULL if the message must be read using proto_read_*
+ */
+static inline const struct proto_data_head *proto_msg_head (const struct proto_msg *msg, size_t len)
+{
+    if (!msg->native || msg->len < len || ((uintptr_t) msg->buf % __alignof__(struct proto_data_head)))
+        return NULL;
+
+    return (const struct proto_data_head *) msg->buf;
+}
+
+/**
+ * Frames allocated for messages of between half and all of this size are recycled via a per-thread pool of up to
+ * PROTO_FRAME_POOL_MAX frames, rather than being malloc'd and free'd each time. This fits a 4KB CMD_DATA payload.
+ */
+#define PROTO_FRAME_POOL_SIZE (4 * 1024 + 64)
+#define PROTO_FRAME_POOL_MAX 256
+
+/**
+ * Alignment of buffers that are reused for each message, to keep them cache-line aligned
+ */
+#define PROTO_BUF_ALIGN 64
+
+/**
+ * Length of the prefix of each message sent on a SOCK_STREAM socket, and the initial size of the reassembly buffer
+ */
+#define PROTO_STREAM_PREFIX 4
+#define PROTO_STREAM_BUF 4096
+
+/**
+ * Maximum number of fds passed along with a message on a SOCK_SEQPACKET socket
+ */
+#define PROTO_FDS_MAX 4
+
+/**
+ * Reference-counted, fully encoded outgoing message, which can be shared between multiple senders without copying.
+ *
+ * The reference count is not atomic; a frame must only be used from within a single thread.
+ */
+struct proto_frame {
+    /** Number of references held */
+    unsigned refs;
+
+    /** Allocated size of buf */
+    size_t size;
+
+    /** Length of encoded message */
+    size_t len;
+
+    /** Next free frame in the pool */
+    struct proto_frame *pool_next;
+
+    /** Message data */
+    char buf[];
+};
+
+/**
+ * Room for the header fields of a proto_iov message, and the maximum number of iovecs it can be sent with
+ */
+#define PROTO_IOV_HEAD 256
+#define PROTO_IOV_MAX 8
+
+/**
+ * Outgoing message whose fields are encoded into a small inline buffer, with any byte arrays referenced in place
+ * rather than copied, to be sent as a single message using an iovec.
+ *
+ * The fields are written using the proto_write_* functions on the embedded msg, and the byte arrays using
+ * proto_iov_write_buf, in message order.
+ */
+struct proto_iov {
+    /** Encoded fields */
+    struct proto_msg msg;
+    char buf[PROTO_IOV_HEAD];
+
+    /** Offset of the fields in buf not yet covered by iov */
+    size_t mark;
+
+    /** Total length of the message, and its limit for the transport */
+    size_t len, max;
+
+    /** Slices of buf and of the referenced byte arrays */
+    struct iovec iov[PROTO_IOV_MAX];
+    unsigned iovcnt;
 };
 
 /**
@@ -192,16 +437,62 @@ int proto_cmd_parse (struct proto_msg *msg);
 typedef int (*proto_cmd_handler_t) (struct proto_msg *in, struct proto_msg *out, void *ctx);
 
 /**
- * Incoming command -> handler mapping
+ * Per-command flags
  */
-struct proto_cmd_handler {
-    /** Command code */
-    enum proto_cmd cmd;
+enum proto_cmd_flags {
+    /** Accepted before the CMD_HELLO handshake */
+    PROTO_CMD_BEFORE_HELLO  = 0x01,
+};
 
-    /** Handler function */
+/**
+ * Incoming command handler, along with the metadata used to validate the command before dispatching it
+ */
+struct proto_cmd_handler {
+    /** Handler function, NULL for unknown commands */
     proto_cmd_handler_t handler_func;
+
+    /** Bitmask of PROTO_CMD_* flags */
+    unsigned flags;
+
+    /** Minimum length of the message following the command header */
+    size_t min_len;
 };
 
+/**
+ * Commands are looked up using a two-level table: a page of handlers for each high byte of the command code, indexed
+ * by the low byte.
+ */
+#define PROTO_CMD_PAGE_SIZE     256
+#define PROTO_CMD_PAGE(cmd)     (((cmd) >> 8) & 0xff)
+#define PROTO_CMD_INDEX(cmd)    ((cmd) & 0xff)
+
+/**
+ * Initializer for the handler for the given command within its page
+ */
+#define PROTO_CMD(cmd, func, flags, min_len) \
+    [PROTO_CMD_INDEX(cmd)] = { (func), (flags), (min_len) }
+
+/**
+ * Incoming command -> handler mapping, with NULL for pages without any handlers
+ */
+struct proto_cmd_table {
+    const struct proto_cmd_handler *pages[PROTO_CMD_PAGE_SIZE];
+};
+
+/**
+ * Look up the handler for the given command.
+ *
+ * Returns NULL with errno=ENOTSUP if there is no matching command handler.
+ */
+const struct proto_cmd_handler *proto_cmd_lookup (const struct proto_cmd_table *table, uint16_t cmd);
+
+/**
+ * Dispatch the incoming request to the given handler, after checking that it is long enough.
+ *
+ * Returns -1 with errno=EBADMSG if the request is too short.
+ */
+int proto_cmd_call (const struct proto_cmd_handler *handler, struct proto_msg *in, struct proto_msg *out, void *ctx);
+
 /**
  * Dispatch incoming request to the correct handler by command.
  *
@@ -211,9 +502,11 @@ struct proto_cmd_handler {
  * As per proto_cmd_handler_t, this will set errno and return -1 in case of system error, or return a positive error
  * code in case of non-fatal protocol error.
  *
- * Returns errno=ENOTSUP if no matching command handler was found.
+ * Returns errno=ENOTSUP if no matching command handler was found, or errno=EBADMSG if the request is too short.
+ *
+ * The PROTO_CMD_* flags depend on the connection state, and are left for the caller to check using proto_cmd_lookup.
  */
-int proto_cmd_dispatch (struct proto_cmd_handler cmd_handlers[], struct proto_msg *in, struct proto_msg *out, void *ctx);
+int proto_cmd_dispatch (const struct proto_cmd_table *table, struct proto_msg *in, struct proto_msg *out, void *ctx);
 
 /**
  * Initialize a proto_msg buffer for use using the given storage buffer.
@@ -241,6 +534,7 @@ int proto_cmd_init (struct proto_msg *msg, char *buf, size_t len, uint32_t id, e
 int proto_read (struct proto_msg *msg, void *buf, size_t len);
 int proto_read_uint16 (struct proto_msg *msg, uint16_t *val_ptr);
 int proto_read_uint32 (struct proto_msg *msg, uint32_t *val_ptr);
+int proto_read_uint64 (struct proto_msg *msg, uint64_t *val_ptr);
 int proto_read_int32 (struct proto_msg *msg, int32_t *val_ptr);
 
 /**
@@ -248,6 +542,23 @@ int proto_read_int32 (struct proto_msg *msg, int32_t *val_ptr);
  */
 int proto_read_buf_ptr (struct proto_msg *msg, const char **buf_ptr, size_t *len_ptr);
 
+/**
+ * Read a uint32-prefixed byte array from the msg, returning a pointer to the first char and the length
+ */
+int proto_read_buf32_ptr (struct proto_msg *msg, const char **buf_ptr, size_t *len_ptr);
+
+/**
+ * Read the CMD_DATA byte array from the msg, as encoded for the given protocol version
+ */
+int proto_read_data_ptr (struct proto_msg *msg, enum proto_version version, const char **buf_ptr, size_t *len_ptr);
+
+/**
+ * Read the CMD_DATA channel and byte array following the message header, as encoded for the given protocol version.
+ *
+ * This uses direct access to the struct proto_data_head of native-order messages.
+ */
+int proto_read_data (struct proto_msg *msg, enum proto_version version, uint16_t *channel_ptr, const char **buf_ptr, size_t *len_ptr);
+
 /**
  * Read a NUL-terminated string from the msg, returning a pointer to it.
  *
@@ -261,13 +572,69 @@ int proto_read_str (struct proto_msg *msg, const char **str_ptr);
 int proto_write (struct proto_msg *msg, const void *buf, size_t len);
 int proto_write_uint16 (struct proto_msg *msg, uint16_t val);
 int proto_write_uint32 (struct proto_msg *msg, uint32_t val);
+int proto_write_uint64 (struct proto_msg *msg, uint64_t val);
 int proto_write_int32 (struct proto_msg *msg, int32_t val);
 
 /**
- * Write a uint16_t-length-prefixed byte array from the given buffer
+ * Write a uint16_t-length-prefixed byte array from the given buffer, failing with EOVERFLOW if it is too long
  */
 int proto_write_buf (struct proto_msg *msg, const char *buf, size_t len);
 
+/**
+ * Write the uint16_t length prefix for a byte array of the given length, and reserve room for the array itself,
+ * returning a pointer to it via buf_ptr if not NULL.
+ *
+ * The array data may be filled in before or after this call; it directly follows the two-byte length prefix. Fails
+ * with EOVERFLOW if the array is too long.
+ */
+int proto_write_buf_ptr (struct proto_msg *msg, char **buf_ptr, size_t len);
+
+/**
+ * Write the uint32_t length prefix for a byte array of the given length, and reserve room for it, as per
+ * proto_write_buf_ptr
+ */
+int proto_write_buf32_ptr (struct proto_msg *msg, char **buf_ptr, size_t len);
+
+/**
+ * Write the length prefix for the CMD_DATA byte array as encoded for the given protocol version, and reserve room for
+ * it, as per proto_write_buf_ptr
+ */
+int proto_write_data_ptr (struct proto_msg *msg, enum proto_version version, char **buf_ptr, size_t len);
+
+/**
+ * Length of the CMD_DATA length prefix for the given protocol version
+ */
+static inline size_t proto_data_prefix (enum proto_version version)
+{
+    return version >= PROTO_V2 ? sizeof(uint32_t) : sizeof(uint16_t);
+}
+
+/**
+ * Initialize the given proto_iov with a protocol command with the given message ID and command code, encoded in host
+ * byte order if native is set.
+ */
+int proto_iov_init (struct proto_iov *iov, bool native, uint32_t id, enum proto_cmd cmd);
+
+/**
+ * Change the maximum length of the proto_iov message from the default ND_PROTO_MSG_MAX, as used for SOCK_STREAM
+ * transports and rings once PROTO_CAP_LARGE has been negotiated, up to ND_PROTO_STREAM_MSG_MAX or RING_MSG_MAX
+ */
+void proto_iov_limit (struct proto_iov *iov, size_t max);
+
+/**
+ * Write a uint16_t-length-prefixed byte array referencing the given buffer, which must remain valid until the message
+ * has been sent.
+ *
+ * Fails with EOVERFLOW if the buffer does not fit the length prefix, or the message.
+ */
+int proto_iov_write_buf (struct proto_iov *iov, const char *buf, size_t len);
+
+/**
+ * Write the CMD_DATA byte array referencing the given buffer as encoded for the given protocol version, as per
+ * proto_iov_write_buf
+ */
+int proto_iov_write_data (struct proto_iov *iov, enum proto_version version, const char *buf, size_t len);
+
 /**
  * Write a zero-terminated string to the msg.
  */
@@ -278,14 +645,227 @@ int proto_write_str (struct proto_msg *msg, const char *str);
  */
 int proto_write_str_array (struct proto_msg *msg, const char *str_array[]);
 
+/**
+ * Read or write each block of fields in PROTO_SCHEMA, e.g.:
+ *
+ *  int proto_decode_status (struct proto_msg *msg, struct proto_status *fields);
+ *  int proto_encode_status (struct proto_msg *msg, const struct proto_status *fields);
+ *
+ * The length of the whole block is checked once, failing with EOVERFLOW if it does not fit.
+ */
+#define PROTO_SCHEMA_DECLARE(name, FIELDS) \
+    int proto_decode_ ## name (struct proto_msg *msg, struct proto_ ## name *fields); \
+    int proto_encode_ ## name (struct proto_msg *msg, const struct proto_ ## name *fields);
+
+PROTO_SCHEMA(PROTO_SCHEMA_DECLARE)
+
+/**
+ * Allocate a new proto_frame with room for a message of the given size, holding one reference
+ */
+struct proto_frame *proto_frame_new (size_t size);
+
+/**
+ * Initialize the given proto_msg to encode a message into the frame
+ */
+int proto_frame_msg (struct proto_frame *frame, struct proto_msg *msg);
+
+/**
+ * Finish encoding the frame from the given proto_msg, as initialized using proto_frame_msg
+ */
+void proto_frame_end (struct proto_frame *frame, struct proto_msg *msg);
+
+/**
+ * Allocate a new proto_frame holding a copy of the given encoded message
+ */
+struct proto_frame *proto_frame_copy (struct proto_msg *msg);
+
+/**
+ * Take an additional reference to the frame
+ */
+static inline struct proto_frame *proto_frame_ref (struct proto_frame *frame)
+{
+    frame->refs++;
+
+    return frame;
+}
+
+/**
+ * Drop a reference to the frame, releasing it once unused
+ */
+void proto_frame_unref (struct proto_frame *frame);
+
+/**
+ * Send the given encoded message out on a SOCK_SEQPACKET socket
+ */
+int proto_send_buf_seqpacket (int sock, const char *buf, size_t len);
+
 /**
  * Send a message out on a SOCK_SEQPACKET socket
  */
 int proto_send_seqpacket (int sock, struct proto_msg *msg);
 
+/**
+ * Send a proto_iov message out on a SOCK_SEQPACKET socket
+ */
+int proto_send_iov_seqpacket (int sock, struct proto_iov *iov);
+
+/**
+ * Send a message out on a SOCK_SEQPACKET socket, passing the given fds along with it
+ */
+int proto_send_fds_seqpacket (int sock, const char *buf, size_t len, const int *fds, unsigned count);
+
+/**
+ * Send a frame out on a SOCK_SEQPACKET socket
+ */
+int proto_send_frame_seqpacket (int sock, struct proto_frame *frame);
+
 /**
  * Recieve a message on a SOCK_SEQPACKET socket
  */
 int proto_recv_seqpacket (int sock, struct proto_msg *msg);
 
+/**
+ * Recieve a message on a SOCK_SEQPACKET socket, along with up to *count_ptr fds passed with it, returning the number
+ * of fds received via count_ptr. The fds are opened with O_CLOEXEC.
+ */
+int proto_recv_fds_seqpacket (int sock, struct proto_msg *msg, int *fds, unsigned *count_ptr);
+
+struct ring;
+
+/**
+ * Send a proto_iov message using the given ring, failing with EAGAIN if there is no room, as per ring_writev
+ */
+int proto_send_iov_ring (struct ring *ring, struct proto_iov *iov);
+
+/**
+ * Send as much as possible of the given encoded message as a uint32_t-length-prefixed frame on a SOCK_STREAM socket,
+ * continuing from the given offset into the frame, which should start out as zero.
+ *
+ * Returns 0 once the whole frame has been sent, or -1 with EAGAIN if the socket is full, with the offset updated to
+ * resume from once it is writable again. Blocking sockets are written until done.
+ */
+int proto_send_stream (int sock, const char *buf, size_t len, size_t *offset_ptr);
+
+/**
+ * Send a proto_iov message as a uint32_t-length-prefixed frame on a blocking SOCK_STREAM socket
+ */
+int proto_send_iov_stream (int sock, struct proto_iov *iov);
+
+/**
+ * Receive a single uint32_t-length-prefixed message on a blocking SOCK_STREAM socket into the given msg
+ */
+int proto_recv_stream_msg (int sock, struct proto_msg *msg);
+
+/**
+ * Reassembly state for uint32_t-length-prefixed messages received on a non-blocking SOCK_STREAM socket
+ */
+struct proto_stream;
+
+/**
+ * Allocate a new stream, with a small buffer that grows to fit the largest message received, up to the given maximum
+ * length
+ */
+struct proto_stream *proto_stream_new (size_t max);
+
+/**
+ * Change the maximum length of a message received from the stream
+ */
+void proto_stream_limit (struct proto_stream *stream, size_t max);
+
+/**
+ * Release the stream, including any messages still pending in it
+ */
+void proto_stream_free (struct proto_stream *stream);
+
+/**
+ * Read whatever is available on the SOCK_STREAM socket into the stream, without blocking.
+ *
+ * Fails with EAGAIN if there was nothing to read, EINVAL on EOF, or EMSGSIZE if a message would be too long.
+ */
+int proto_recv_stream (int sock, struct proto_stream *stream);
+
+/**
+ * Append data received from the SOCK_STREAM socket by other means to the stream, as per proto_recv_stream.
+ *
+ * Fails with EMSGSIZE if a message would be too long.
+ */
+int proto_stream_feed (struct proto_stream *stream, const char *buf, size_t len);
+
+/**
+ * Take the next complete message received on the stream, in order, or return NULL if there is none yet.
+ *
+ * The message remains valid until the next proto_stream_next or proto_recv_stream.
+ */
+struct proto_msg *proto_stream_next (struct proto_stream *stream);
+
+/**
+ * Is there a complete message pending in the stream?
+ */
+int proto_stream_pending (const struct proto_stream *stream);
+
+/**
+ * Batch of messages received from a SOCK_SEQPACKET socket in a single call
+ */
+struct proto_batch;
+
+/**
+ * Allocate a new batch with room for up to the given number of full-size messages
+ */
+struct proto_batch *proto_batch_new (unsigned size);
+
+/**
+ * Move the messages still pending in the batch into a new batch allocated for just those messages, leaving the
+ * original batch empty. The new batch can only be used with proto_batch_next.
+ */
+struct proto_batch *proto_batch_take (struct proto_batch *batch);
+
+/**
+ * Append a copy of the given message to a batch as returned by proto_batch_take, or a new one if NULL, returning the
+ * batch, or NULL on errors, in which case the original batch is left as it was.
+ */
+struct proto_batch *proto_batch_append (struct proto_batch *batch, const char *buf, size_t len);
+
+/**
+ * Release the batch, including any messages still pending in it
+ */
+void proto_batch_free (struct proto_batch *batch);
+
+/**
+ * Receive as many messages as will fit into the batch on a SOCK_SEQPACKET socket, without blocking, discarding any
+ * messages still pending in it.
+ *
+ * Fails with EAGAIN if there were no messages, EINVAL on EOF, or EMSGSIZE if a message was truncated.
+ */
+int proto_recv_batch (int sock, struct proto_batch *batch);
+
+/**
+ * Discard any messages still pending in the batch, to start filling it using proto_batch_push instead
+ */
+void proto_batch_reset (struct proto_batch *batch);
+
+/**
+ * Add a message received by other means to the batch, without copying it: the given buffer must remain valid for as
+ * long as the message may be taken from the batch, or until it is moved out using proto_batch_take.
+ *
+ * Fails with ENOBUFS if the batch is full.
+ */
+int proto_batch_push (struct proto_batch *batch, char *buf, size_t len);
+
+/**
+ * Is the batch full?
+ */
+int proto_batch_full (const struct proto_batch *batch);
+
+/**
+ * Take the next pending message received in the batch, in order, or return NULL once the batch is empty.
+ *
+ * The message remains valid until the next proto_recv_batch.
+ */
+struct proto_msg *proto_batch_next (struct proto_batch *batch);
+
+/**
+ * Are there any messages still pending in the batch?
+ */
+int proto_batch_pending (const struct proto_batch *batch);
+
 #endif
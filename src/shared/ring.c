@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+#include "ring.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+
+/**
+ * Room for the ring_ctl ahead of each buffer, keeping the buffers page-aligned
+ */
+#define RING_CTL_SIZE 4096
+
+/**
+ * Total size of the shared memory, for both directions
+ */
+#define RING_MAP_SIZE (2 * (RING_CTL_SIZE + RING_SIZE))
+
+/**
+ * Header of a padding record, telling the consumer to skip to the start of the buffer
+ */
+#define RING_WRAP 0xffffffff
+
+/**
+ * Length of the record for a message of the given length, including the header and padding
+ */
+#define RING_RECORD(len) (((len) + 2 * RING_HEADER - 1) & ~(size_t) (RING_HEADER - 1))
+
+static void ring_init (struct ring *ring, char *base, int wake_fd)
+{
+    ring->ctl = (struct ring_ctl *) base;
+    ring->buf = base + RING_CTL_SIZE;
+    ring->pos = 0;
+    ring->wake_fd = wake_fd;
+}
+
+/**
+ * Map the given memfd, using the first ring for our outbound direction if we created it, or the second if not
+ */
+static int ring_link_map (struct ring_link *link, int memfd, bool creator)
+{
+    char *first, *second;
+
+    if ((link->map = mmap(NULL, RING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED)
+        return -1;
+
+    first = link->map;
+    second = first + RING_CTL_SIZE + RING_SIZE;
+
+    ring_init(&link->tx, creator ? first : second, link->wake_fd);
+    ring_init(&link->rx, creator ? second : first, link->wake_fd);
+
+    return 0;
+}
+
+int ring_link_create (struct ring_link *link, int fds[RING_LINK_FDS])
+{
+    int memfd = -1;
+
+    link->map = MAP_FAILED;
+    link->wait_fd = link->wake_fd = -1;
+
+    if ((memfd = memfd_create("netdaemon-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+        goto error;
+
+    if (ftruncate(memfd, RING_MAP_SIZE) < 0)
+        goto error;
+
+    // the other side must not be able to shrink it from under us
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+        goto error;
+
+    if ((link->wait_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        goto error;
+
+    if ((link->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        goto error;
+
+    if (ring_link_map(link, memfd, true))
+        goto error;
+
+    // both consumers start out waiting for messages
+    link->tx.ctl->reader_idle = 1;
+    link->rx.ctl->reader_idle = 1;
+
+    // the other side waits on what we wake, and vice versa
+    fds[0] = memfd;
+    fds[1] = link->wake_fd;
+    fds[2] = link->wait_fd;
+
+    return 0;
+
+error:
+    if (memfd >= 0)
+        close(memfd);
+
+    ring_link_close(link);
+
+    return -1;
+}
+
+int ring_link_open (struct ring_link *link, const int fds[RING_LINK_FDS])
+{
+    int err;
+
+    link->map = MAP_FAILED;
+    link->wait_fd = fds[1];
+    link->wake_fd = fds[2];
+
+    // the mapping stays valid without the memfd
+    err = ring_link_map(link, fds[0], false);
+
+    close(fds[0]);
+
+    if (err) {
+        ring_link_close(link);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+void ring_link_close (struct ring_link *link)
+{
+    if (link->map != MAP_FAILED)
+        munmap(link->map, RING_MAP_SIZE);
+
+    if (link->wait_fd >= 0)
+        close(link->wait_fd);
+
+    if (link->wake_fd >= 0)
+        close(link->wake_fd);
+
+    link->map = MAP_FAILED;
+    link->wait_fd = link->wake_fd = -1;
+}
+
+int ring_wakeup (int fd)
+{
+    uint64_t wakeup = 1;
+
+    // the counter only overflows if the other side is not reading it anyways
+    if (write(fd, &wakeup, sizeof(wakeup)) < 0 && errno != EAGAIN)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Wake up the other side if it has marked itself idle using the given flag
+ */
+static int ring_wake (struct ring *ring, uint32_t *idle)
+{
+    // order our update of the head/tail before checking the flag, pairing with the fence in ring_idle/ring_room
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(idle, __ATOMIC_RELAXED) || !__atomic_exchange_n(idle, 0, __ATOMIC_ACQ_REL))
+        return 0;
+
+    return ring_wakeup(ring->wake_fd);
+}
+
+/**
+ * Return the number of bytes the consumer has not read yet, failing with EBADMSG if the shared state is not valid
+ */
+static int ring_used (uint32_t head, uint32_t tail, uint32_t *used_ptr)
+{
+    if ((uint32_t) (head - tail) > RING_SIZE) {
+        errno = EBADMSG;
+
+        return -1;
+    }
+
+    *used_ptr = head - tail;
+
+    return 0;
+}
+
+/**
+ * Is there room for len more bytes in the ring? If not, mark the producer as idle, so that the consumer wakes us up
+ * once it has made some room.
+ */
+static int ring_room (struct ring *ring, size_t len)
+{
+    struct ring_ctl *ctl = ring->ctl;
+    uint32_t used;
+
+    if (ring_used(ring->pos, __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE), &used))
+        return -1;
+
+    if (RING_SIZE - used >= len)
+        return 1;
+
+    __atomic_store_n(&ctl->writer_idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // check again, in case the consumer made room before seeing the flag
+    if (ring_used(ring->pos, __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE), &used))
+        return -1;
+
+    if (RING_SIZE - used < len)
+        return 0;
+
+    __atomic_store_n(&ctl->writer_idle, 0, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+int ring_writev (struct ring *ring, const struct iovec *iov, unsigned count)
+{
+    uint32_t head = ring->pos, offset = head & (RING_SIZE - 1), header, skip = 0;
+    size_t len = 0, total;
+    char *ptr;
+    unsigned i;
+    int ret;
+
+    for (i = 0; i < count; i++)
+        len += iov[i].iov_len;
+
+    if (len > RING_MSG_MAX) {
+        errno = EMSGSIZE;
+
+        return -1;
+    }
+
+    total = RING_RECORD(len);
+
+    // messages are contiguous, so skip the end of the buffer if it does not fit there
+    if (RING_SIZE - offset < total)
+        skip = RING_SIZE - offset;
+
+    if ((ret = ring_room(ring, skip + total)) < 0) {
+        return -1;
+
+    } else if (!ret) {
+        errno = EAGAIN;
+
+        return -1;
+    }
+
+    if (skip) {
+        header = RING_WRAP;
+
+        memcpy(ring->buf + offset, &header, sizeof(header));
+
+        head += skip;
+        offset = 0;
+    }
+
+    // header and message
+    header = len;
+    ptr = ring->buf + offset;
+
+    memcpy(ptr, &header, sizeof(header));
+    ptr += RING_HEADER;
+
+    for (i = 0; i < count; i++) {
+        memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+        ptr += iov[i].iov_len;
+    }
+
+    // publish
+    ring->pos = head + total;
+
+    __atomic_store_n(&ring->ctl->head, ring->pos, __ATOMIC_RELEASE);
+
+    return ring_wake(ring, &ring->ctl->reader_idle);
+}
+
+int ring_write (struct ring *ring, const char *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = (char *) buf, .iov_len = len };
+
+    return ring_writev(ring, &iov, 1);
+}
+
+int ring_read (struct ring *ring, char *buf, size_t size, size_t *len_ptr)
+{
+    uint32_t tail = ring->pos, offset, used, header;
+
+    while (true) {
+        if (ring_used(__atomic_load_n(&ring->ctl->head, __ATOMIC_ACQUIRE), tail, &used))
+            return -1;
+
+        if (!used)
+            return 0;
+
+        // the header is only read once, as the producer may not be trusted to leave it alone
+        offset = tail & (RING_SIZE - 1);
+
+        memcpy(&header, ring->buf + offset, sizeof(header));
+
+        if (header != RING_WRAP)
+            break;
+
+        // skip to the start of the buffer
+        if (RING_SIZE - offset > used) {
+            errno = EBADMSG;
+
+            return -1;
+        }
+
+        tail += RING_SIZE - offset;
+    }
+
+    if (header > RING_SIZE - offset - RING_HEADER || RING_RECORD(header) > used) {
+        errno = EBADMSG;
+
+        return -1;
+    }
+
+    if (header > size) {
+        errno = EMSGSIZE;
+
+        return -1;
+    }
+
+    memcpy(buf, ring->buf + offset + RING_HEADER, header);
+
+    // release
+    ring->pos = tail + RING_RECORD(header);
+
+    __atomic_store_n(&ring->ctl->tail, ring->pos, __ATOMIC_RELEASE);
+
+    *len_ptr = header;
+
+    return ring_wake(ring, &ring->ctl->writer_idle) ? -1 : 1;
+}
+
+bool ring_pending (const struct ring *ring)
+{
+    return __atomic_load_n(&ring->ctl->head, __ATOMIC_ACQUIRE) != ring->pos;
+}
+
+bool ring_idle (struct ring *ring)
+{
+    __atomic_store_n(&ring->ctl->reader_idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // check again, in case the producer wrote a message before seeing the flag
+    return !ring_pending(ring);
+}
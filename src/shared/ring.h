@@ -0,0 +1,146 @@
+#ifndef SHARED_RING_H
+#define SHARED_RING_H
+
+/**
+ * @file
+ *
+ * Lock-free single-producer/single-consumer message rings in shared memory, used as the PROTO_CAP_RING transport
+ * between the daemon and local clients.
+ *
+ * A ring_link is a memfd holding one ring in each direction, along with an eventfd for each side. Each message is
+ * copied into the ring by the producer and out of it by the consumer, without any syscalls; the other side's eventfd is
+ * only written to when it has marked itself idle, i.e. the consumer is waiting for messages on an empty ring, or the
+ * producer is waiting for room in a full ring.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+/**
+ * Size of the buffer for each direction, which must be a power of two
+ */
+#define RING_SIZE (1024 * 1024)
+
+/**
+ * Each message is preceded by a header holding its length, and padded to the alignment of the next header
+ */
+#define RING_HEADER 8
+
+/**
+ * Longest message that is guaranteed to fit, even if the ring has to wrap around first
+ */
+#define RING_MSG_MAX (RING_SIZE / 2 - RING_HEADER)
+
+/**
+ * Number of fds passed to the other side of a ring_link: the memfd, and the eventfds for each side
+ */
+#define RING_LINK_FDS 3
+
+/**
+ * Shared state of one direction, with the producer and consumer fields on separate cache lines
+ */
+struct ring_ctl {
+    /** Written by the producer: end of the last message written, free-running */
+    uint32_t head;
+
+    /** Producer is waiting for room, and should be woken up by the consumer */
+    uint32_t writer_idle;
+
+    char pad[64 - 2 * sizeof(uint32_t)];
+
+    /** Written by the consumer: end of the last message read, free-running */
+    uint32_t tail;
+
+    /** Consumer is waiting for messages, and should be woken up by the producer */
+    uint32_t reader_idle;
+};
+
+/**
+ * Our end of one direction
+ */
+struct ring {
+    /** Shared state and message buffer */
+    struct ring_ctl *ctl;
+    char *buf;
+
+    /** Our own copy of our head or tail, which is never read back from the shared memory */
+    uint32_t pos;
+
+    /** eventfd used to wake up the other side */
+    int wake_fd;
+};
+
+/**
+ * Our end of the rings for both directions
+ */
+struct ring_link {
+    /** Shared memory mapping */
+    void *map;
+
+    /** Outbound and inbound rings */
+    struct ring tx, rx;
+
+    /** eventfd that the other side uses to wake us up, and the one we use to wake them up */
+    int wait_fd, wake_fd;
+};
+
+/**
+ * Create a new memfd and eventfds for a ring_link, and map our end of it.
+ *
+ * Returns the fds to pass to the other side for ring_link_open; the memfd in fds[0] is no longer needed by us, and
+ * should be closed once sent. The others are our own wait_fd and wake_fd.
+ */
+int ring_link_create (struct ring_link *link, int fds[RING_LINK_FDS]);
+
+/**
+ * Map the other end of a ring_link created using ring_link_create, taking ownership of the given fds.
+ */
+int ring_link_open (struct ring_link *link, const int fds[RING_LINK_FDS]);
+
+/**
+ * Unmap the rings and close any fds still held by the ring_link
+ */
+void ring_link_close (struct ring_link *link);
+
+/**
+ * Copy a message gathered from the given iovecs into the ring, waking up the consumer if it is idle.
+ *
+ * Fails with EAGAIN if there is no room; the consumer will then wake us up once it has made some. Fails with EMSGSIZE
+ * if the message is longer than RING_MSG_MAX, or EBADMSG if the shared state has been corrupted.
+ */
+int ring_writev (struct ring *ring, const struct iovec *iov, unsigned count);
+
+/**
+ * Copy a message from the given buffer into the ring, as per ring_writev
+ */
+int ring_write (struct ring *ring, const char *buf, size_t len);
+
+/**
+ * Copy the next message out of the ring into the given buffer, returning its length via len_ptr, and waking up the
+ * producer if it is idle.
+ *
+ * Returns 1 if a message was read, or 0 if the ring is empty. Fails with EMSGSIZE if the message does not fit into the
+ * buffer, or EBADMSG if the ring does not contain a valid message.
+ */
+int ring_read (struct ring *ring, char *buf, size_t size, size_t *len_ptr);
+
+/**
+ * Are there any messages in the ring?
+ */
+bool ring_pending (const struct ring *ring);
+
+/**
+ * Mark the consumer as idle once the ring is empty, so that the producer wakes us up for the next message.
+ *
+ * Returns true if the ring is still empty, or false if a message was written in the meantime, and should be read
+ * without waiting.
+ */
+bool ring_idle (struct ring *ring);
+
+/**
+ * Wake up the other side using the given eventfd
+ */
+int ring_wakeup (int fd);
+
+#endif
@@ -1,11 +1,23 @@
+#define _GNU_SOURCE /* for accept4 */
 #include "select.h"
 
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
 
+const char *select_backend_names[] = {
+    "default",
+    "select",
+    "epoll",
+    "uring",
+    NULL
+};
+
 int select_fd_init (struct select_fd *fd, int _fd, short mask, select_handler_t handler_func, void *handler_arg)
 {
     memset(fd, 0, sizeof(*fd));
@@ -16,44 +28,737 @@ int select_fd_init (struct select_fd *fd, int _fd, short mask, select_handler_t
     fd->want_read = mask & FD_READ;
     fd->want_write = mask & FD_WRITE;
     fd->active = false;
+    fd->loop = NULL;
+
+    // ok
+    return 0;
+}
+
+void select_fd_op (struct select_fd *fd, enum select_op op)
+{
+    assert(!fd->active);
+
+    fd->op = op;
+}
+
+void select_fd_deinit (struct select_fd *fd)
+{
+    assert(!fd->active);
+
+    fd->fd = -1;
+}
+
+void select_defer_init (struct select_defer *defer, select_defer_func func, void *arg)
+{
+    defer->func = func;
+    defer->arg = arg;
+    defer->pending = false;
+}
+
+#ifdef SELECT_EPOLL
+/**
+ * Build the epoll event mask for the given fd
+ */
+static uint32_t select_epoll_mask (struct select_fd *fd)
+{
+    return (fd->want_read ? EPOLLIN : 0) | (fd->want_write ? EPOLLOUT : 0);
+}
+
+/**
+ * Update the fd's registration in the epoll interest list
+ */
+static int select_epoll_ctl (struct select_loop *loop, int op, struct select_fd *fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+
+    ev.events = select_epoll_mask(fd);
+    ev.data.u64 = select_fd_handle(loop, fd);
+
+    return epoll_ctl(loop->epoll_fd, op, fd->fd, &ev);
+}
+#endif
+
+/**
+ * Marks the end of the slot free list
+ */
+#define SELECT_SLOT_NONE UINT32_MAX
+
+/**
+ * Assign a free slot in the loop's slot table to the given fd, growing the table as needed
+ */
+static int select_slot_alloc (struct select_loop *loop, struct select_fd *fd)
+{
+    struct select_slot *slots;
+    uint32_t i, len;
+
+    if (loop->slots_free == SELECT_SLOT_NONE) {
+        // grow
+        len = loop->slots_len ? loop->slots_len * 2 : 64;
+
+        if ((slots = realloc(loop->slots, len * sizeof(*slots))) == NULL)
+            return -1;
+
+        // chain new slots onto the free list
+        for (i = loop->slots_len; i < len; i++) {
+            slots[i].fd = NULL;
+            slots[i].generation = 1;
+            slots[i].next_free = (i + 1 < len) ? i + 1 : SELECT_SLOT_NONE;
+        }
+
+        loop->slots = slots;
+        loop->slots_free = loop->slots_len;
+        loop->slots_len = len;
+    }
+
+    // take
+    fd->slot = loop->slots_free;
+    loop->slots_free = loop->slots[fd->slot].next_free;
+    loop->slots[fd->slot].fd = fd;
+
+    return 0;
+}
+
+/**
+ * Release the fd's slot, invalidating any references to it
+ */
+static void select_slot_free (struct select_loop *loop, struct select_fd *fd)
+{
+    struct select_slot *slot = &loop->slots[fd->slot];
+
+    slot->fd = NULL;
+    slot->next_free = loop->slots_free;
+
+    // zero is reserved for SELECT_HANDLE_NONE
+    if (!++slot->generation)
+        slot->generation = 1;
+
+    loop->slots_free = fd->slot;
+}
+
+struct select_fd *select_loop_lookup (struct select_loop *loop, select_handle_t handle)
+{
+    uint32_t index = handle & 0xffffffff;
+    uint16_t generation = (handle >> 32) & 0xffff;
+
+    if (index >= loop->slots_len || loop->slots[index].generation != generation)
+        // removed
+        return NULL;
+
+    return loop->slots[index].fd;
+}
+
+#ifdef SELECT_URING
+/**
+ * Completion user_data for requests whose completions are ignored
+ */
+#define SELECT_URING_IGNORE UINT64_MAX
+
+/**
+ * Layout of the user_data for our requests: the fd's handle in the low 48 bits, followed by the request's sequence
+ * number, and the select_op that the request performs, or SELECT_OP_POLL for poll requests
+ */
+#define SELECT_URING_HANDLE_MASK 0xffffffffffffULL
+#define SELECT_URING_SEQ_SHIFT 48
+#define SELECT_URING_SEQ_MASK 0x3fff
+#define SELECT_URING_OP_SHIFT 62
+
+/**
+ * Encode the user_data for a request on the given fd
+ */
+static uint64_t select_uring_token (struct select_loop *loop, struct select_fd *fd, enum select_op op, uint16_t seq)
+{
+    return select_fd_handle(loop, fd) | (uint64_t) (seq & SELECT_URING_SEQ_MASK) << SELECT_URING_SEQ_SHIFT | (uint64_t) op << SELECT_URING_OP_SHIFT;
+}
+
+/**
+ * Is the fd read using its select_op, rather than polled for reading?
+ */
+static bool select_uring_op (struct select_loop *loop, struct select_fd *fd)
+{
+    return fd->op != SELECT_OP_POLL && loop->uring_ops;
+}
+
+/**
+ * Queue a new poll request for the fd's current interest set, if any
+ */
+static int select_uring_arm (struct select_loop *loop, struct select_fd *fd)
+{
+    struct io_uring_sqe *sqe;
+    bool want_read = fd->want_read && !select_uring_op(loop, fd);
+
+    if (!(want_read || fd->want_write))
+        return 0;
+
+    if ((sqe = uring_get_sqe(&loop->ring)) == NULL)
+        return -1;
+
+    // new request, so that completions for any older one are recognized as stale
+    fd->uring_seq++;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd->fd;
+    sqe->poll32_events = (want_read ? POLLIN : 0) | (fd->want_write ? POLLOUT : 0);
+    sqe->user_data = select_uring_token(loop, fd, SELECT_OP_POLL, fd->uring_seq);
+
+    fd->uring_armed = true;
+
+    return 0;
+}
+
+/**
+ * Cancel the fd's pending poll request, if any
+ */
+static int select_uring_disarm (struct select_loop *loop, struct select_fd *fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!fd->uring_armed)
+        return 0;
+
+    if ((sqe = uring_get_sqe(&loop->ring)) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = select_uring_token(loop, fd, SELECT_OP_POLL, fd->uring_seq);
+    sqe->user_data = SELECT_URING_IGNORE;
+
+    fd->uring_armed = false;
+
+    return 0;
+}
+
+/**
+ * Set up the loop's buffers on first use
+ */
+static int select_uring_bufs (struct select_loop *loop)
+{
+    if (loop->bufs.ring)
+        return 0;
+
+    return uring_bufs_init(&loop->ring, &loop->bufs, 0, SELECT_URING_BUFS, SELECT_URING_BUF_SIZE);
+}
+
+/**
+ * Queue a new request for the fd's select_op, if it wants to read, and does not have one pending already
+ */
+static int select_uring_arm_op (struct select_loop *loop, struct select_fd *fd)
+{
+    struct io_uring_sqe *sqe;
+    uint64_t token;
+
+    if (!fd->want_read || fd->uring_op_armed || fd->uring_op_eof)
+        return 0;
+
+    // new request, so that the end of any older one is recognized as stale
+    token = select_uring_token(loop, fd, fd->op, ++fd->uring_op_seq);
+
+    if (fd->op == SELECT_OP_READ) {
+        // reads from O_NONBLOCK fds fail with EAGAIN instead of waiting, so wait for the fd to become readable first
+        if ((sqe = uring_get_sqe(&loop->ring)) == NULL)
+            return -1;
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd->fd;
+        sqe->poll32_events = POLLIN;
+        sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = token;
+    }
+
+    if ((sqe = uring_get_sqe(&loop->ring)) == NULL)
+        return -1;
+
+    sqe->fd = fd->fd;
+    sqe->user_data = token;
+
+    switch (fd->op) {
+        case SELECT_OP_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            break;
+
+        case SELECT_OP_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = loop->bufs.group;
+            break;
+
+        case SELECT_OP_READ:
+            // at the current position, as pipes have none
+            sqe->opcode = IORING_OP_READ;
+            sqe->off = (uint64_t) -1;
+            sqe->len = loop->bufs.size;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = loop->bufs.group;
+            break;
+
+        default:
+            break;
+    }
+
+    fd->uring_op_armed = fd->uring_op_busy = true;
+
+    return 0;
+}
+
+/**
+ * Cancel the fd's pending select_op request, if any. Any results it completed with in the meantime are still queued.
+ */
+static int select_uring_cancel_op (struct select_loop *loop, struct select_fd *fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!fd->uring_op_armed)
+        return 0;
+
+    if ((sqe = uring_get_sqe(&loop->ring)) == NULL)
+        return -1;
+
+    // including the poll linked ahead of a read
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = select_uring_token(loop, fd, fd->op, fd->uring_op_seq);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = SELECT_URING_IGNORE;
+
+    fd->uring_op_armed = false;
+
+    return 0;
+}
+
+/**
+ * Release whatever the given result of a select_op holds, once it is not going to be taken
+ */
+static void select_uring_discard (struct select_loop *loop, enum select_op op, int res, int buf)
+{
+    if (buf >= 0)
+        uring_bufs_put(&loop->bufs, buf);
+
+    if (op == SELECT_OP_ACCEPT && res >= 0)
+        close(res);
+}
+
+/**
+ * Queue the fd for dispatching its results, if it has any and wants to read
+ */
+static void select_uring_ready (struct select_loop *loop, struct select_fd *fd)
+{
+    if (fd->uring_ready || !fd->want_read || fd->uring_results_head == fd->uring_results_tail)
+        return;
+
+    TAILQ_INSERT_TAIL(&loop->uring_ready, fd, loop_ready);
+    fd->uring_ready = true;
+}
+
+/**
+ * Append a result to the fd's queue
+ */
+static int select_uring_push (struct select_fd *fd, int res, int buf)
+{
+    struct select_result *results;
+    unsigned size;
+
+    if (fd->uring_results_tail == fd->uring_results_size) {
+        // grow
+        size = fd->uring_results_size ? fd->uring_results_size * 2 : 8;
+
+        if ((results = realloc(fd->uring_results, size * sizeof(*results))) == NULL)
+            return -1;
+
+        fd->uring_results = results;
+        fd->uring_results_size = size;
+    }
+
+    fd->uring_results[fd->uring_results_tail++] = (struct select_result) { .res = res, .buf = buf };
+
+    return 0;
+}
+
+/**
+ * Take the next result from the fd's queue, putting back its buffer for the next run, or fail with EAGAIN if empty.
+ *
+ * EOF is left in place.
+ */
+static int select_uring_take (struct select_fd *fd, struct select_result *result)
+{
+    if (fd->uring_results_head == fd->uring_results_tail) {
+        errno = EAGAIN;
+
+        return -1;
+    }
+
+    *result = fd->uring_results[fd->uring_results_head];
+
+    if (fd->op != SELECT_OP_ACCEPT && result->res == 0)
+        return 0;
+
+    if (result->buf >= 0)
+        uring_bufs_put(&fd->loop->bufs, result->buf);
+
+    if (++fd->uring_results_head == fd->uring_results_tail)
+        // empty, start over
+        fd->uring_results_head = fd->uring_results_tail = 0;
+
+    return 0;
+}
+
+/**
+ * Discard any results still queued for the fd, and forget about it
+ */
+static void select_uring_clear (struct select_loop *loop, struct select_fd *fd)
+{
+    unsigned i;
+
+    for (i = fd->uring_results_head; i < fd->uring_results_tail; i++)
+        select_uring_discard(loop, fd->op, fd->uring_results[i].res, fd->uring_results[i].buf);
+
+    free(fd->uring_results);
+
+    fd->uring_results = NULL;
+    fd->uring_results_head = fd->uring_results_tail = fd->uring_results_size = 0;
+
+    if (fd->uring_ready)
+        TAILQ_REMOVE(&loop->uring_ready, fd, loop_ready);
+
+    if (fd->uring_starved)
+        LIST_REMOVE(fd, loop_starved);
+
+    fd->uring_ready = fd->uring_starved = false;
+}
+
+/**
+ * Re-submit the fd's requests after its interest set changed
+ */
+static int select_uring_update (struct select_loop *loop, struct select_fd *fd)
+{
+    if (select_uring_disarm(loop, fd) || select_uring_arm(loop, fd))
+        return -1;
+
+    if (!select_uring_op(loop, fd))
+        return 0;
+
+    if (!fd->want_read)
+        // any results already queued are kept for once we are reading again
+        return select_uring_cancel_op(loop, fd);
+
+    select_uring_ready(loop, fd);
+
+    return select_uring_arm_op(loop, fd);
+}
+#endif
+
+bool select_fd_op_active (struct select_fd *fd)
+{
+#ifdef SELECT_URING
+    return fd->active && fd->loop->backend == SELECT_BACKEND_URING && select_uring_op(fd->loop, fd);
+#else
+    return false;
+#endif
+}
+
+bool select_fd_op_stopped (struct select_fd *fd)
+{
+#ifdef SELECT_URING
+    if (select_fd_op_active(fd))
+        return !fd->want_read && !fd->uring_op_busy;
+#endif
+
+    return true;
+}
+
+int select_accept (struct select_fd *fd)
+{
+#ifdef SELECT_URING
+    struct select_result result;
+
+    if (select_fd_op_active(fd)) {
+        if (select_uring_take(fd, &result))
+            return -1;
+
+        if (result.res < 0) {
+            errno = -result.res;
+
+            return -1;
+        }
+
+        return result.res;
+    }
+#endif
+
+    return accept4(fd->fd, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+ssize_t select_recv (struct select_fd *fd, char **buf_ptr)
+{
+#ifdef SELECT_URING
+    struct select_result result;
+
+    if (select_fd_op_active(fd) && fd->op != SELECT_OP_ACCEPT) {
+        if (select_uring_take(fd, &result))
+            return -1;
+
+        if (result.res < 0) {
+            errno = -result.res;
+
+            return -1;
+        }
+
+        if (result.res > 0)
+            *buf_ptr = uring_bufs_get(&fd->loop->bufs, result.buf);
+
+        return result.res;
+    }
+#endif
+
+    errno = EINVAL;
+
+    return -1;
+}
+
+/**
+ * Update the loop's interest set after a change in the fd's want flags
+ */
+static int select_fd_update (struct select_fd *fd)
+{
+    if (!fd->active)
+        return 0;
+
+    switch (fd->loop->backend) {
+#ifdef SELECT_EPOLL
+        case SELECT_BACKEND_EPOLL:
+            return select_epoll_ctl(fd->loop, EPOLL_CTL_MOD, fd);
+#endif
+
+#ifdef SELECT_URING
+        case SELECT_BACKEND_URING:
+            return select_uring_update(fd->loop, fd);
+#endif
+
+        default:
+            return 0;
+    }
+}
+
+int select_want_read (struct select_fd *fd, bool want_read)
+{
+    if (fd->want_read == want_read)
+        return 0;
+
+    fd->want_read = want_read;
+
+    return select_fd_update(fd);
+}
+
+int select_want_write (struct select_fd *fd, bool want_write)
+{
+    if (fd->want_write == want_write)
+        return 0;
+
+    fd->want_write = want_write;
+
+    return select_fd_update(fd);
+}
+
+int select_loop_init (struct select_loop *loop, enum select_backend backend)
+{
+    // clear
+    LIST_INIT(&loop->fds);
+
+    loop->slots = NULL;
+    loop->slots_len = 0;
+    loop->slots_free = SELECT_SLOT_NONE;
+
+    TAILQ_INIT(&loop->defers);
+
+    loop->closes = NULL;
+    loop->closes_count = loop->closes_size = 0;
+
+    timer_wheel_init(&loop->timers, timer_now());
+
+    // pick
+    if (backend == SELECT_BACKEND_DEFAULT)
+#ifdef SELECT_EPOLL
+        backend = SELECT_BACKEND_EPOLL;
+#else
+        backend = SELECT_BACKEND_SELECT;
+#endif
+
+    loop->backend = backend;
+
+    switch (backend) {
+        case SELECT_BACKEND_SELECT:
+            break;
+
+#ifdef SELECT_EPOLL
+        case SELECT_BACKEND_EPOLL:
+            loop->events_count = 0;
+
+            if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+                return -1;
+
+            break;
+#endif
+
+#ifdef SELECT_URING
+        case SELECT_BACKEND_URING:
+            loop->cqes_count = 0;
+            loop->uring_ops = false;
+            memset(&loop->bufs, 0, sizeof(loop->bufs));
+            TAILQ_INIT(&loop->uring_ready);
+            LIST_INIT(&loop->uring_starved);
+
+            if (uring_init(&loop->ring, SELECT_URING_ENTRIES))
+                return -1;
+
+#ifdef IORING_RECV_MULTISHOT
+            // there is no feature flag for multishot recv, which arrived along with IORING_OP_SEND_ZC in Linux 6.0
+            loop->uring_ops = uring_supported(&loop->ring, IORING_OP_SEND_ZC);
+#endif
+
+            break;
+#endif
+
+        default:
+            // not compiled in
+            errno = ENOSYS;
+
+            return -1;
+    }
 
     // ok
     return 0;
 }
 
-void select_fd_deinit (struct select_fd *fd)
+int select_loop_add (struct select_loop *loop, struct select_fd *fd)
 {
-    assert(!fd->active);
+    // can't be represented in an fd_set
+    if (loop->backend == SELECT_BACKEND_SELECT && fd->fd >= FD_SETSIZE) {
+        errno = EMFILE;
 
-    fd->fd = -1;
-}
+        return -1;
+    }
 
-void select_loop_init (struct select_loop *loop)
-{
-    // clear
-    LIST_INIT(&loop->fds);
-}
+    // take a slot, which gives us our handle
+    if (select_slot_alloc(loop, fd))
+        return -1;
+
+    switch (loop->backend) {
+#ifdef SELECT_EPOLL
+        case SELECT_BACKEND_EPOLL:
+            // register with kernel
+            if (select_epoll_ctl(loop, EPOLL_CTL_ADD, fd))
+                goto error;
+
+            break;
+#endif
+
+#ifdef SELECT_URING
+        case SELECT_BACKEND_URING:
+            // start polling, and reading if using an op
+            fd->uring_armed = fd->uring_op_armed = fd->uring_op_busy = fd->uring_op_eof = false;
+            fd->uring_ready = fd->uring_starved = false;
+            fd->uring_results = NULL;
+            fd->uring_results_head = fd->uring_results_tail = fd->uring_results_size = 0;
+
+            if (select_uring_op(loop, fd) && fd->op != SELECT_OP_ACCEPT && select_uring_bufs(loop))
+                goto error;
+
+            if (select_uring_arm(loop, fd) || (select_uring_op(loop, fd) && select_uring_arm_op(loop, fd)))
+                goto error;
+
+            break;
+#endif
+
+        default:
+            break;
+    }
 
-int select_loop_add (struct select_loop *loop, struct select_fd *fd)
-{
     // add to fd list
     LIST_INSERT_HEAD(&loop->fds, fd, loop_fds);
 
     fd->active = true;
+    fd->loop = loop;
 
     // ok
     return 0;
+
+error:
+    select_slot_free(loop, fd);
+
+    return -1;
 }
 
 void select_loop_del (struct select_loop *loop, struct select_fd *fd)
 {
-    if (fd->active) {
-        // remove from fd list
-        // XXX: this leaves our ->next pointer valid, but hmm
-        LIST_REMOVE(fd, loop_fds);
+    if (!fd->active)
+        return;
+
+    // remove from fd list
+    LIST_REMOVE(fd, loop_fds);
+
+#ifdef SELECT_EPOLL
+    if (loop->backend == SELECT_BACKEND_EPOLL)
+        // unregister from kernel; the fd is still open at this point
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd->fd, NULL);
+#endif
+
+#ifdef SELECT_URING
+    if (loop->backend == SELECT_BACKEND_URING) {
+        // cancel poll and op, and drop anything already completed
+        select_uring_disarm(loop, fd);
+        select_uring_cancel_op(loop, fd);
+        select_uring_clear(loop, fd);
+    }
+#endif
+
+    // invalidate our handle, and with it any events still pending for us
+    select_slot_free(loop, fd);
+
+    fd->active = false;
+    fd->loop = NULL;
+}
+
+void select_loop_close (struct select_loop *loop, struct select_fd *fd)
+{
+    int *closes;
+    unsigned size;
+
+    select_loop_del(loop, fd);
+
+    if (fd->fd < 0)
+        return;
+
+    if (loop->closes_count == loop->closes_size) {
+        // grow
+        size = loop->closes_size ? loop->closes_size * 2 : 16;
 
-        fd->active = false;
+        if ((closes = realloc(loop->closes, size * sizeof(*closes))) == NULL) {
+            // close right away instead
+            close(fd->fd);
+
+            goto out;
+        }
+
+        loop->closes = closes;
+        loop->closes_size = size;
     }
+
+    loop->closes[loop->closes_count++] = fd->fd;
+
+out:
+    select_fd_deinit(fd);
+}
+
+void select_loop_defer (struct select_loop *loop, struct select_defer *defer)
+{
+    if (defer->pending)
+        return;
+
+    TAILQ_INSERT_TAIL(&loop->defers, defer, loop_defers);
+
+    defer->pending = true;
 }
 
 /**
@@ -77,7 +782,7 @@ static int select_loop_build (struct select_loop *loop, fd_set *rfds, fd_set *wf
         // read?
         if (fd->want_read)
             FD_SET(fd->fd, rfds);
-        
+
         // write?
         if (fd->want_write)
             FD_SET(fd->fd, wfds);
@@ -92,23 +797,33 @@ static int select_loop_build (struct select_loop *loop, fd_set *rfds, fd_set *wf
  *
  * If any handler returns with EAGAIN, simply skip it. Otherwise, if any handler returns nonzero, return that
  * error code.
+ *
+ * This walks the slot table rather than the fd list, such that handlers may remove any fd. Since fds are only closed at
+ * the end of the run, any fd added by a handler cannot re-use an fd number that is still set in the fd_sets.
  */
 static int select_loop_dispatch (struct select_loop *loop, fd_set *rfds, fd_set *wfds, int count)
 {
     int err;
+    uint32_t i;
     struct select_fd *fd;
+    select_handle_t handle;
+
+    for (i = 0; count > 0 && i < loop->slots_len; i++) {
+        if ((fd = loop->slots[i].fd) == NULL)
+            continue;
+
+        handle = select_fd_handle(loop, fd);
 
-    for (fd = LIST_FIRST(&loop->fds); count > 0 && fd; fd = LIST_NEXT(fd, loop_fds) ) {
         // read?
-        if (fd->active && FD_ISSET(fd->fd, rfds)) {
+        if (FD_ISSET(fd->fd, rfds)) {
             count--;
 
             if ((err = fd->handler_func(fd->fd, FD_READ, fd->handler_arg)))
                 goto fd_error;
         }
 
-        // write?
-        if (fd->active && FD_ISSET(fd->fd, wfds)) {
+        // write? Check that the read handler didn't remove the fd
+        if (select_loop_lookup(loop, handle) == fd && FD_ISSET(fd->fd, wfds)) {
             count--;
 
             if ((err = fd->handler_func(fd->fd, FD_WRITE, fd->handler_arg)))
@@ -118,10 +833,10 @@ static int select_loop_dispatch (struct select_loop *loop, fd_set *rfds, fd_set
         continue;
 
 fd_error:
-        if (err == -1 && errno == EAGAIN ) 
+        if (err == -1 && errno == EAGAIN )
             // just skip to next
             continue;
-                
+
         else
             // break select loop
             return err;
@@ -131,7 +846,10 @@ fd_error:
     return 0;
 }
 
-int select_loop_run (struct select_loop *loop, struct timeval *tv)
+/**
+ * Run the select() backend once
+ */
+static int select_loop_run_select (struct select_loop *loop, struct timeval *tv)
 {
     int fd_max;
     int ret, err;
@@ -154,6 +872,415 @@ int select_loop_run (struct select_loop *loop, struct timeval *tv)
     return 0;
 }
 
+#ifdef SELECT_EPOLL
+/**
+ * Dispatch the ready events from epoll_wait, with the same error semantics as select_loop_dispatch.
+ *
+ * Events refer to fds by handle, so handlers may select_loop_del any fd, which invalidates its pending events.
+ */
+static int select_loop_dispatch_epoll (struct select_loop *loop)
+{
+    int i, err = 0;
+    struct select_fd *fd;
+    select_handle_t handle;
+    uint32_t events;
+
+    for (i = 0; i < loop->events_count; i++) {
+        handle = loop->events[i].data.u64;
+
+        if ((fd = select_loop_lookup(loop, handle)) == NULL)
+            // removed
+            continue;
+
+        events = loop->events[i].events;
+
+        // read? Errors and hangups are reported as readable, as per select()
+        if (fd->want_read && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            if ((err = fd->handler_func(fd->fd, FD_READ, fd->handler_arg)))
+                goto fd_error;
+        }
+
+        // write? Check that the read handler didn't remove the fd
+        if (select_loop_lookup(loop, handle) == fd && fd->want_write && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+            if ((err = fd->handler_func(fd->fd, FD_WRITE, fd->handler_arg)))
+                goto fd_error;
+        }
+
+        continue;
+
+fd_error:
+        if (err == -1 && errno == EAGAIN) {
+            // just skip to next
+            err = 0;
+
+            continue;
+        }
+
+        else
+            // break select loop
+            break;
+    }
+
+    // done with these
+    loop->events_count = 0;
+
+    return err;
+}
+
+/**
+ * Run the epoll backend once
+ */
+static int select_loop_run_epoll (struct select_loop *loop, struct timeval *tv)
+{
+    int timeout = tv ? (tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000) : -1;
+    int ret, err;
+
+    // wait
+    if ((ret = epoll_wait(loop->epoll_fd, loop->events, SELECT_EPOLL_EVENTS, timeout)) < 0)
+        return -1;
+
+    loop->events_count = ret;
+
+    // dispatch ready fds
+    if ((err = select_loop_dispatch_epoll(loop)) < 0)
+        return err;
+
+    // done
+    return 0;
+}
+#endif
+
+#ifdef SELECT_URING
+/**
+ * Look up the active fd that the given poll completion refers to, or NULL if it's stale
+ */
+static struct select_fd *select_uring_lookup (struct select_loop *loop, uint64_t token)
+{
+    uint16_t seq = (token >> SELECT_URING_SEQ_SHIFT) & SELECT_URING_SEQ_MASK;
+    struct select_fd *fd;
+
+    if ((fd = select_loop_lookup(loop, token & SELECT_URING_HANDLE_MASK)) == NULL)
+        // removed
+        return NULL;
+
+    if ((fd->uring_seq & SELECT_URING_SEQ_MASK) != seq)
+        // superseded poll request
+        return NULL;
+
+    return fd;
+}
+
+/**
+ * Queue the result of a completed select_op request for the fd's handler, and re-arm the request once it has ended.
+ *
+ * Results are queued even for requests that have since been cancelled, as the data has already been read.
+ */
+static int select_uring_complete (struct select_loop *loop, struct io_uring_cqe *cqe)
+{
+    enum select_op op = cqe->user_data >> SELECT_URING_OP_SHIFT;
+    uint16_t seq = (cqe->user_data >> SELECT_URING_SEQ_SHIFT) & SELECT_URING_SEQ_MASK;
+    int buf = (cqe->flags & IORING_CQE_F_BUFFER) ? (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    int res = cqe->res;
+    struct select_fd *fd;
+
+    if ((fd = select_loop_lookup(loop, cqe->user_data & SELECT_URING_HANDLE_MASK)) == NULL || fd->op != op) {
+        // removed, but the buffer or socket is still ours to release
+        select_uring_discard(loop, op, res, buf);
+
+        return 0;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && (fd->uring_op_seq & SELECT_URING_SEQ_MASK) == seq)
+        // latest request ended, possibly after being cancelled
+        fd->uring_op_busy = false;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && fd->uring_op_armed && (fd->uring_op_seq & SELECT_URING_SEQ_MASK) == seq) {
+        // request ended by itself
+        fd->uring_op_armed = false;
+
+        if (res == -ENOBUFS) {
+            // re-armed once buffers have been put back
+            if (!fd->uring_starved)
+                LIST_INSERT_HEAD(&loop->uring_starved, fd, loop_starved);
+
+            fd->uring_starved = true;
+
+        } else if (res == 0 && op != SELECT_OP_ACCEPT) {
+            // nothing more to read
+            fd->uring_op_eof = true;
+
+        } else if (select_uring_arm_op(loop, fd)) {
+            select_uring_discard(loop, op, res, buf);
+
+            return -1;
+        }
+    }
+
+    if (res == -ECANCELED || res == -ENOBUFS || res == -EAGAIN)
+        // no result, as the request was cancelled, ran out of buffers, or raced with another reader
+        return 0;
+
+    if (select_uring_push(fd, res, buf)) {
+        select_uring_discard(loop, op, res, buf);
+
+        return -1;
+    }
+
+    select_uring_ready(loop, fd);
+
+    return 0;
+}
+
+/**
+ * Dispatch the results queued for each ready fd, with the same error semantics as select_loop_dispatch.
+ *
+ * The handler is called with FD_READ for as long as the fd wants to read, and the handler keeps taking results.
+ */
+static int select_loop_dispatch_ready (struct select_loop *loop)
+{
+    struct select_fd *fd;
+    select_handle_t handle;
+    unsigned head, tail;
+    int err = 0;
+
+    while ((fd = TAILQ_FIRST(&loop->uring_ready)) != NULL) {
+        TAILQ_REMOVE(&loop->uring_ready, fd, loop_ready);
+        fd->uring_ready = false;
+
+        handle = select_fd_handle(loop, fd);
+
+        while (fd->want_read && fd->uring_results_head != fd->uring_results_tail) {
+            head = fd->uring_results_head;
+            tail = fd->uring_results_tail;
+
+            if ((err = fd->handler_func(fd->fd, FD_READ, fd->handler_arg)))
+                break;
+
+            if (select_loop_lookup(loop, handle) != fd)
+                // removed
+                break;
+
+            if (fd->uring_results_head == head && fd->uring_results_tail == tail)
+                // not taking any more for now
+                break;
+        }
+
+        if (err == -1 && errno == EAGAIN)
+            // just skip to next
+            err = 0;
+
+        else if (err)
+            // break select loop
+            break;
+    }
+
+    return err;
+}
+
+/**
+ * Dispatch the completions from the last wait, with the same error semantics as select_loop_dispatch.
+ *
+ * Poll requests are one-shot, so that the fd is polled again after the handler runs, with the same level-triggered
+ * semantics as select(). The results of select_op requests are queued first, and then dispatched after the polls.
+ */
+static int select_loop_dispatch_uring (struct select_loop *loop)
+{
+    int i, err = 0;
+    struct select_fd *fd;
+    uint64_t token;
+    int events;
+
+    // queue results, which hold buffers and sockets that must not be lost even if a handler fails
+    for (i = 0; i < loop->cqes_count; i++) {
+        token = loop->cqes[i].user_data;
+
+        if (token == SELECT_URING_IGNORE || (token >> SELECT_URING_OP_SHIFT) == SELECT_OP_POLL)
+            continue;
+
+        if (select_uring_complete(loop, &loop->cqes[i]) && !err)
+            err = -1;
+    }
+
+    for (i = 0; !err && i < loop->cqes_count; i++) {
+        token = loop->cqes[i].user_data;
+
+        if (token == SELECT_URING_IGNORE || (token >> SELECT_URING_OP_SHIFT) != SELECT_OP_POLL)
+            continue;
+
+        if ((fd = select_uring_lookup(loop, token)) == NULL)
+            continue;
+
+        // the request is done
+        fd->uring_armed = false;
+
+        if ((events = loop->cqes[i].res) < 0)
+            // report as error on the fd
+            events = POLLERR;
+
+        // read?
+        if (fd->want_read && !select_uring_op(loop, fd) && (events & (POLLIN | POLLHUP | POLLERR)))
+            err = fd->handler_func(fd->fd, FD_READ, fd->handler_arg);
+
+        // write? Check that the read handler didn't remove the fd
+        if (!err && select_uring_lookup(loop, token) == fd && fd->want_write && (events & (POLLOUT | POLLHUP | POLLERR)))
+            err = fd->handler_func(fd->fd, FD_WRITE, fd->handler_arg);
+
+        // poll again, unless removed, or already re-armed by the handler changing its interest set
+        if (select_uring_lookup(loop, token) == fd && !fd->uring_armed && select_uring_arm(loop, fd) && !err)
+            err = -1;
+
+        if (err == -1 && errno == EAGAIN)
+            // just skip to next
+            err = 0;
+    }
+
+    // done with these
+    loop->cqes_count = 0;
+
+    if (err)
+        // break select loop
+        return err;
+
+    // and then the results
+    return select_loop_dispatch_ready(loop);
+}
+
+/**
+ * Run the io_uring backend once
+ */
+static int select_loop_run_uring (struct select_loop *loop, struct timeval *tv)
+{
+    struct timespec ts;
+    struct select_fd *fd;
+    int err;
+
+    // buffers put back during the last run are available again, including to any fds that ran out of them
+    if (loop->bufs.ring && uring_bufs_flush(&loop->bufs)) {
+        while ((fd = LIST_FIRST(&loop->uring_starved)) != NULL) {
+            LIST_REMOVE(fd, loop_starved);
+            fd->uring_starved = false;
+
+            if (select_uring_arm_op(loop, fd))
+                return -1;
+        }
+    }
+
+    if (!TAILQ_EMPTY(&loop->uring_ready)) {
+        // results left over for fds that are reading again
+        ts.tv_sec = ts.tv_nsec = 0;
+
+    } else if (tv) {
+        ts.tv_sec = tv->tv_sec;
+        ts.tv_nsec = tv->tv_usec * 1000;
+    }
+
+    // submit queued requests and wait
+    if (uring_enter(&loop->ring, (tv || !TAILQ_EMPTY(&loop->uring_ready)) ? &ts : NULL) < 0)
+        return -1;
+
+    loop->cqes_count = uring_reap(&loop->ring, loop->cqes, SELECT_URING_CQES);
+
+    // dispatch ready fds
+    if ((err = select_loop_dispatch_uring(loop)) < 0)
+        return err;
+
+    // done
+    return 0;
+}
+#endif
+
+void select_timer_add (struct select_loop *loop, struct timer *timer, unsigned msec)
+{
+    timer_wheel_add(&loop->timers, timer, timer_now() + msec);
+}
+
+void select_timer_cancel (struct select_loop *loop, struct timer *timer)
+{
+    timer_wheel_cancel(&loop->timers, timer);
+}
+
+/**
+ * Return the timeout to wait for, given the caller's timeout and any pending timers
+ */
+static struct timeval *select_loop_timeout (struct select_loop *loop, struct timeval *tv, struct timeval *timer_tv)
+{
+    uint64_t next, now, msec;
+
+    if (!timer_wheel_next(&loop->timers, &next))
+        // no timers
+        return tv;
+
+    now = timer_now();
+    msec = next > now ? next - now : 0;
+
+    if (tv && (uint64_t) tv->tv_sec * 1000 + tv->tv_usec / 1000 <= msec)
+        // caller's timeout comes first
+        return tv;
+
+    timer_tv->tv_sec = msec / 1000;
+    timer_tv->tv_usec = (msec % 1000) * 1000;
+
+    return timer_tv;
+}
+
+/**
+ * Run deferred callbacks, and then close deferred fds
+ */
+static void select_loop_cleanup (struct select_loop *loop)
+{
+    struct select_defer *defer;
+    int errno_saved = errno;
+
+    while ((defer = TAILQ_FIRST(&loop->defers)) != NULL) {
+        TAILQ_REMOVE(&loop->defers, defer, loop_defers);
+
+        defer->pending = false;
+        defer->func(defer->arg);
+    }
+
+    while (loop->closes_count)
+        close(loop->closes[--loop->closes_count]);
+
+    // preserve errno for select_loop_run
+    errno = errno_saved;
+}
+
+int select_loop_run (struct select_loop *loop, struct timeval *tv)
+{
+    struct timeval timer_tv;
+    int err;
+
+    // wait no longer than the next timer
+    tv = select_loop_timeout(loop, tv, &timer_tv);
+
+    switch (loop->backend) {
+#ifdef SELECT_EPOLL
+        case SELECT_BACKEND_EPOLL:
+            err = select_loop_run_epoll(loop, tv);
+            break;
+#endif
+
+#ifdef SELECT_URING
+        case SELECT_BACKEND_URING:
+            err = select_loop_run_uring(loop, tv);
+            break;
+#endif
+
+        default:
+            err = select_loop_run_select(loop, tv);
+            break;
+    }
+
+    // run expired timers
+    if (!err)
+        err = timer_wheel_run(&loop->timers, timer_now());
+
+    // release anything removed during this run, even on errors
+    select_loop_cleanup(loop);
+
+    return err;
+}
+
 int select_loop_main (struct select_loop *loop)
 {
     while (true) {
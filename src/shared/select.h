@@ -5,10 +5,88 @@
  * @file
  *
  * select() loop implementation
+ *
+ * The loop can be backed either by plain select(), which rebuilds its fd_sets from the fd list on every run, or by
+ * epoll, which keeps a persistent kernel interest list that is updated incrementally by select_loop_add/del and
+ * select_want_read/write, and only dispatches to the fds that are actually ready.
+ *
+ * The io_uring backend works like the epoll backend, but uses poll requests on an io_uring, such that all of the
+ * interest-set changes made during one loop iteration are submitted together with the wait for the next events, in
+ * a single system call. Fds using a select_op are not polled for reading at all: the loop performs the accept, recv or
+ * read itself using completion-based io_uring requests, and the handler takes their results, so reading from any
+ * number of fds costs no system calls of its own.
+ *
+ * Each loop also owns a timer wheel, such that the wait for fd events is bounded by the next timer expiry, and expired
+ * timers are run after the fd handlers.
+ *
+ * Every active select_fd holds a slot in the loop's slot table, identified by a generation-counted handle. Pending
+ * events are looked up by handle rather than by pointer, such that handlers may remove and release any fd, including
+ * their own, while the loop is dispatching. Objects that may still be referenced by the current run are released
+ * using select_loop_defer, and fds are closed using select_loop_close, which only closes the fd number at the end of
+ * the run, such that it cannot be re-used for a new fd while events for the old one may still be dispatched.
+ *
+ * The epoll and io_uring backends are available on Linux, unless disabled at build time using -DSELECT_NO_EPOLL or
+ * -DSELECT_NO_URING.
  */
+#include "timer.h"
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/queue.h>
 #include <sys/time.h>
+#include <sys/types.h>
+
+#if defined(__linux__) && !defined(SELECT_NO_EPOLL)
+#define SELECT_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#if defined(__linux__) && !defined(SELECT_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SELECT_URING
+#include "uring.h"
+#endif
+#endif
+
+/**
+ * Available select_loop implementations
+ */
+enum select_backend {
+    /** Use the best available backend */
+    SELECT_BACKEND_DEFAULT  = 0,
+
+    /** Portable select() with per-run fd_set rebuild, limited to FD_SETSIZE */
+    SELECT_BACKEND_SELECT,
+
+    /** Linux epoll with a persistent interest list */
+    SELECT_BACKEND_EPOLL,
+
+    /** Linux io_uring poll requests with batched submission */
+    SELECT_BACKEND_URING,
+};
+
+/**
+ * List of select_backend values as strings, indexed by value, NULL-terminated
+ */
+extern const char *select_backend_names[];
+
+/**
+ * Maximum number of ready events handled per epoll_wait()
+ */
+#define SELECT_EPOLL_EVENTS 64
+
+/**
+ * Maximum number of completions handled per io_uring wait, and the size of the submission queue
+ */
+#define SELECT_URING_CQES 64
+#define SELECT_URING_ENTRIES 256
+
+/**
+ * Number and size of the buffers provided to the kernel for SELECT_OP_RECV and SELECT_OP_READ, per loop. Each buffer
+ * must fit any single message received on a SOCK_SEQPACKET socket.
+ */
+#define SELECT_URING_BUFS 64
+#define SELECT_URING_BUF_SIZE (64 * 1024)
 
 /**
  * FD events
@@ -18,6 +96,39 @@ enum fd_events {
     FD_WRITE    = 0x02,
 };
 
+/**
+ * Operations that the io_uring backend performs to read from an fd on behalf of its handler, in place of polling it
+ * for readiness.
+ *
+ * The handler is then called with FD_READ once for each completed operation, and takes its result using select_accept
+ * or select_recv. With the other backends, the fd is polled for readiness as usual, and select_accept just calls
+ * accept4 itself.
+ */
+enum select_op {
+    /** Poll for readiness, and let the handler do its own reads */
+    SELECT_OP_POLL      = 0,
+
+    /** Multishot accept on a listening socket */
+    SELECT_OP_ACCEPT,
+
+    /** Multishot recv on a socket, into the loop's buffers */
+    SELECT_OP_RECV,
+
+    /** Read from a pipe or other pollable fd, into the loop's buffers */
+    SELECT_OP_READ,
+};
+
+/**
+ * Result of a completed select_op, not yet taken by the handler
+ */
+struct select_result {
+    /** Accepted socket, or number of bytes received, or -errno */
+    int res;
+
+    /** Loop buffer that the data was received into, or -1 */
+    int buf;
+};
+
 /**
  * Callback handler return codes
  */
@@ -36,6 +147,15 @@ enum select_handler_ret {
  */
 typedef int (*select_handler_t) (int fd, short what, void *arg);
 
+/**
+ * Generation-counted reference to an active select_fd, which no longer resolves once the fd has been removed.
+ *
+ * Zero is never a valid handle.
+ */
+typedef uint64_t select_handle_t;
+
+#define SELECT_HANDLE_NONE 0
+
 /**
  * Per-fd state
  */
@@ -56,6 +176,38 @@ struct select_fd {
     /** Active (i.e. in the select_loop fd list) */
     bool active;
 
+    /** The select_loop we are active in */
+    struct select_loop *loop;
+
+    /** Index into the select_loop's slot table while active */
+    uint32_t slot;
+
+    /** Operation used for reading with the io_uring backend */
+    enum select_op op;
+
+#ifdef SELECT_URING
+    /** Sequence number of our most recent poll request, and whether it is still pending */
+    uint16_t uring_seq;
+    bool uring_armed;
+
+    /** Sequence number of our most recent select_op request, whether we want it to keep going, whether it has yet to
+     * end, even if cancelled, and whether it has reached EOF, in which case it is not re-armed */
+    uint16_t uring_op_seq;
+    bool uring_op_armed, uring_op_busy, uring_op_eof;
+
+    /** Completed operations not yet taken by the handler, and the allocated size */
+    struct select_result *uring_results;
+    unsigned uring_results_head, uring_results_tail, uring_results_size;
+
+    /** In the loop's queue of fds with results to dispatch */
+    bool uring_ready;
+    TAILQ_ENTRY(select_fd) loop_ready;
+
+    /** In the loop's list of fds waiting for buffers to re-arm their operation */
+    bool uring_starved;
+    LIST_ENTRY(select_fd) loop_starved;
+#endif
+
     /** Our entry in the select_loop */
     LIST_ENTRY(select_fd) loop_fds;
 };
@@ -66,20 +218,20 @@ struct select_fd {
 int select_fd_init (struct select_fd *fd, int _fd, short mask, select_handler_t handler_func, void *handler_arg);
 
 /**
- * Change read flag
+ * Use the given operation for reading from the fd with the io_uring backend, if supported. This must be set before
+ * adding the fd to a loop.
  */
-static inline void select_want_read (struct select_fd *fd, bool want_read)
-{
-    fd->want_read = want_read;
-}
+void select_fd_op (struct select_fd *fd, enum select_op op);
 
 /**
- * Change write flag
+ * Change read flag, updating the loop's interest set if active
  */
-static inline void select_want_write (struct select_fd *fd, bool want_write)
-{
-    fd->want_write = want_write;
-}
+int select_want_read (struct select_fd *fd, bool want_read);
+
+/**
+ * Change write flag, updating the loop's interest set if active
+ */
+int select_want_write (struct select_fd *fd, bool want_write);
 
 /**
  * Is the given select_fd still active?
@@ -94,18 +246,106 @@ static inline bool select_fd_active (struct select_fd *fd)
  */
 void select_fd_deinit (struct select_fd *fd);
 
+/**
+ * Slot table entry, used to validate events that may arrive after the select_fd has been removed
+ */
+struct select_slot {
+    /** Active select_fd in this slot, or NULL */
+    struct select_fd *fd;
+
+    /** Incremented every time the slot is released, skipping zero */
+    uint16_t generation;
+
+    /** Next free slot, if free */
+    uint32_t next_free;
+};
+
+/**
+ * Deferred callback, run at the end of select_loop_run
+ */
+typedef void (*select_defer_func) (void *arg);
+
+/**
+ * Per-object deferred callback state
+ */
+struct select_defer {
+    /** Callback */
+    select_defer_func func;
+    void *arg;
+
+    /** Queued for the end of the current run */
+    bool pending;
+
+    /** Our entry in the select_loop */
+    TAILQ_ENTRY(select_defer) loop_defers;
+};
+
+/**
+ * Set up select_defer values
+ */
+void select_defer_init (struct select_defer *defer, select_defer_func func, void *arg);
+
 /**
  * Select-loop state
  */
 struct select_loop {
+    /** Backend in use */
+    enum select_backend backend;
+
     /** List of FDs to select on */
     LIST_HEAD(select_loop_fds, select_fd) fds;
+
+#ifdef SELECT_EPOLL
+    /** epoll instance for SELECT_BACKEND_EPOLL */
+    int epoll_fd;
+
+    /** Ready events from the last epoll_wait, and the number of them */
+    struct epoll_event events[SELECT_EPOLL_EVENTS];
+    int events_count;
+#endif
+
+#ifdef SELECT_URING
+    /** io_uring for SELECT_BACKEND_URING */
+    struct uring ring;
+
+    /** Completions from the last wait, and the number of them */
+    struct io_uring_cqe cqes[SELECT_URING_CQES];
+    int cqes_count;
+
+    /** The kernel supports the select_op requests */
+    bool uring_ops;
+
+    /** Buffers for SELECT_OP_RECV/READ, set up on first use */
+    struct uring_bufs bufs;
+
+    /** fds with completed operations to dispatch */
+    TAILQ_HEAD(select_loop_ready, select_fd) uring_ready;
+
+    /** fds waiting for buffers to be put back */
+    LIST_HEAD(select_loop_starved, select_fd) uring_starved;
+#endif
+
+    /** Slot table, its size, and the head of the free list */
+    struct select_slot *slots;
+    uint32_t slots_len, slots_free;
+
+    /** Queue of deferred callbacks */
+    TAILQ_HEAD(select_loop_defers, select_defer) defers;
+
+    /** fd numbers to close at the end of the run, their number and allocated size */
+    int *closes;
+    unsigned closes_count, closes_size;
+
+    /** Pending timers */
+    struct timer_wheel timers;
 };
 
 /**
- * Initialize the given select loop
+ * Initialize the given select loop using the given backend.
+ *
+ * @return zero on success, <0 on errno (e.g. ENOSYS for an unsupported backend)
  */
-void select_loop_init (struct select_loop *loop);
+int select_loop_init (struct select_loop *loop, enum select_backend backend);
 
 /**
  * Add the given select_fd to the select loop
@@ -113,16 +353,88 @@ void select_loop_init (struct select_loop *loop);
 int select_loop_add (struct select_loop *loop, struct select_fd *fd);
 
 /**
- * Remove the given select_fd from the select loop if active
+ * Remove the given select_fd from the select loop if active.
  *
- * XXX: how safe is this when called from within select_loop_run?
+ * This must be called before the fd is closed. It is safe to call this from within any handler, for any fd: events
+ * still pending for the fd from the current run are discarded, and the select_fd itself is not referenced again.
  */
 void select_loop_del (struct select_loop *loop, struct select_fd *fd);
 
 /**
- * Run the select loop once with the given timeout
+ * Remove the given select_fd from the select loop if active, and close it at the end of the current run.
+ *
+ * The select_fd is left de-initialized. Does nothing for an already de-initialized select_fd.
+ */
+void select_loop_close (struct select_loop *loop, struct select_fd *fd);
+
+/**
+ * Return the handle for the given active select_fd
+ */
+static inline select_handle_t select_fd_handle (struct select_loop *loop, struct select_fd *fd)
+{
+    return (uint64_t) fd->slot | (uint64_t) loop->slots[fd->slot].generation << 32;
+}
+
+/**
+ * Resolve the given handle to its active select_fd, or NULL if it has since been removed.
+ */
+struct select_fd *select_loop_lookup (struct select_loop *loop, select_handle_t handle);
+
+/**
+ * Are reads from the given active fd performed by the loop using its select_op?
+ */
+bool select_fd_op_active (struct select_fd *fd);
+
+/**
+ * Has the fd's select_op stopped reading, after the fd stopped wanting to read, such that the results of any reads
+ * already made on its behalf are all there to be taken? Always true for fds that are not using a select_op.
+ *
+ * This must be true before removing such an fd from the loop without losing any data, and becomes true once the loop
+ * has run again.
+ */
+bool select_fd_op_stopped (struct select_fd *fd);
+
+/**
+ * Accept a connection on the given listening fd, returning the new socket, which is O_NONBLOCK and O_CLOEXEC.
+ *
+ * With SELECT_OP_ACCEPT, this takes the socket accepted by the completed operation that the handler was called for,
+ * and fails with EAGAIN if there is none.
+ */
+int select_accept (struct select_fd *fd);
+
+/**
+ * Take the data received by the next completed SELECT_OP_RECV or SELECT_OP_READ for the given fd, returning its length
+ * and the loop buffer holding it, which remains valid until the end of the current select_loop_run.
+ *
+ * Returns zero on EOF, which is not taken, and is returned again by any further calls. Fails with EAGAIN if there are
+ * no completed operations left, or with the operation's error.
+ */
+ssize_t select_recv (struct select_fd *fd, char **buf_ptr);
+
+/**
+ * Queue the given callback to run at the end of the current select_loop_run, after all handlers and timers.
+ *
+ * Callbacks run in the order they were queued, including any queued by other deferred callbacks. Does nothing if
+ * already queued.
+ */
+void select_loop_defer (struct select_loop *loop, struct select_defer *defer);
+
+/**
+ * Add the given timer to the loop, to expire after the given number of milliseconds.
+ *
+ * A timer that is already pending is re-scheduled.
+ */
+void select_timer_add (struct select_loop *loop, struct timer *timer, unsigned msec);
+
+/**
+ * Cancel the given timer, if pending
+ */
+void select_timer_cancel (struct select_loop *loop, struct timer *timer);
+
+/**
+ * Run the select loop once with the given timeout, or until the next timer expires, whichever is first.
  *
- * Returns zero on success, <0 on errno, or whatever any select_fd handler happens to return
+ * Returns zero on success, <0 on errno, or whatever any select_fd handler or timer callback happens to return
  */
 int select_loop_run (struct select_loop *loop, struct timeval *tv);
 
@@ -1,49 +1,106 @@
+#define _GNU_SOURCE
 #include "signal.h"
 #include "shared/log.h"
 
 #include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <errno.h>
 
 /**
- * Main list of all signal handlers
+ * Registered signal handlers, by signal number
  */
-static LIST_HEAD(signal_handlers, signal_handler) handlers;
+static struct signal_handler *handlers[NSIG];
 
 /**
- * Total number of outstanding signal handler calls
+ * Set of registered signals, and the signal mask from before we blocked them
  */
-volatile sig_atomic_t ncalls;
+static sigset_t signal_mask, signal_orig_mask;
 
-static void signal_handler (int sig)
+/**
+ * Set of ignored signals
+ */
+static sigset_t signal_ignored;
+
+/**
+ * signalfd state
+ */
+static struct select_fd signal_fd;
+
+/**
+ * Read and dispatch all pending signals
+ */
+static int signal_on_read (int fd, short what, void *arg)
 {
+    struct signalfd_siginfo infos[16];
     struct signal_handler *handler;
+    ssize_t ret;
+    int sig, i, count;
+
+    // read everything that is pending
+    while ((ret = read(fd, infos, sizeof(infos))) > 0) {
+        count = ret / sizeof(*infos);
+
+        for (i = 0; i < count; i++) {
+            sig = infos[i].ssi_signo;
 
-    // find handler
-    LIST_FOREACH(handler, &handlers, signal_handlers) {
-        if (handler->signal == sig)
-            break;
+            if (sig < NSIG && (handler = handlers[sig]))
+                // count
+                handler->ncalls++;
+
+            else
+                // XXX: fail
+                log_warn("Unknown signal: %d", sig);
+        }
     }
 
-    if (handler) {
-        // count
-        handler->ncalls++;
-        ncalls++;
+    if (ret < 0 && errno != EAGAIN)
+        return -1;
+
+    // run each handler once
+    for (sig = 0; sig < NSIG; sig++) {
+        if (!(handler = handlers[sig]) || !handler->ncalls)
+            continue;
 
-    } else {
-        // XXX: fail
-        log_warn("Unknown signal: %d", sig);
+        handler->ncalls = 0;
+
+        // invoke
+        if ((ret = handler->func(handler->func_arg)) < 0)
+            return ret;
     }
+
+    return 0;
 }
 
 int signal_init (void)
 {
-    LIST_INIT(&handlers);
+    int fd;
+
+    sigemptyset(&signal_mask);
+    sigemptyset(&signal_ignored);
+
+    // remember original mask
+    if (sigprocmask(SIG_BLOCK, &signal_mask, &signal_orig_mask))
+        return -1;
+
+    // no signals yet
+    if ((fd = signalfd(-1, &signal_mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        return -1;
+
+    select_fd_init(&signal_fd, fd, FD_READ, signal_on_read, NULL);
 
     return 0;
 }
 
 int signal_register (struct signal_handler *state, int signal, signal_func func, void *arg)
 {
-    struct sigaction sa;
+    sigset_t mask;
+
+    if (signal <= 0 || signal >= NSIG) {
+        errno = EINVAL;
+
+        return -1;
+    }
 
     // store
     state->signal = signal;
@@ -51,50 +108,48 @@ int signal_register (struct signal_handler *state, int signal, signal_func func,
     state->func_arg = arg;
     state->ncalls = 0;
 
-    // prep
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
+    sigemptyset(&mask);
+    sigaddset(&mask, signal);
+
+    // block normal delivery
+    if (sigprocmask(SIG_BLOCK, &mask, NULL))
+        return -1;
 
-    // add to list
-    LIST_INSERT_HEAD(&handlers, state, signal_handlers);
+    // and deliver via signalfd instead
+    sigaddset(&signal_mask, signal);
 
-    // register handler
-    if (sigaction(signal, &sa, NULL) < 0)
-        goto error;
+    if (signalfd(signal_fd.fd, &signal_mask, 0) < 0)
+        return -1;
+
+    handlers[signal] = state;
 
     // ok
     return 0;
+}
+
+int signal_ignore (int signal)
+{
+    struct sigaction action = { .sa_handler = SIG_IGN };
 
-error:
-    // remove from list
-    LIST_REMOVE(state, signal_handlers);    
+    if (sigaction(signal, &action, NULL))
+        return -1;
 
-    return -1;
+    sigaddset(&signal_ignored, signal);
+
+    return 0;
 }
 
-int signal_run (void)
+int signal_loop_add (struct select_loop *loop)
 {
-    struct signal_handler *handler;
-    int ret = 0, count = 0;
-
-    // fast-path
-    if (!ncalls)
-        return 0;
-
-    // look for calls
-    LIST_FOREACH(handler, &handlers, signal_handlers) {
-        while (handler->ncalls) {
-            // count
-            ncalls--;
-            handler->ncalls--;
-            count++;
-
-            // invoke
-            if ((ret = handler->func(handler->func_arg)) <0)
-                return ret;
-        }
-    }
+    return select_loop_add(loop, &signal_fd);
+}
 
-    return count;
+void signal_child_mask (sigset_t *mask)
+{
+    *mask = signal_orig_mask;
 }
 
+void signal_child_default (sigset_t *set)
+{
+    *set = signal_ignored;
+}
@@ -5,18 +5,25 @@
  * @file
  *
  * Signal handling
+ *
+ * Registered signals are blocked, and delivered via a signalfd that is part of the select loop, such that signal
+ * handlers are run in process context like any other event. All pending signals are read at once, and each handler is
+ * called once per batch, regardless of how many times its signal was delivered.
  */
+#include "shared/select.h"
+
 #include <sys/types.h>
-#include <sys/queue.h>
 #include <signal.h>
 
 /**
  * Process-context signal handler function.
+ *
+ * @return zero on success, <0 on errno, which will be returned from select_loop_run
  */
 typedef int (*signal_func) (void *arg);
 
 /**
- * Per-signal handler state 
+ * Per-signal handler state
  */
 struct signal_handler {
     /** Signal number */
@@ -28,20 +35,17 @@ struct signal_handler {
     /** Context argument */
     void *func_arg;
 
-    /** Number of calls */
-    volatile sig_atomic_t ncalls;
-
-    /** Part of list */
-    LIST_ENTRY(signal_handler) signal_handlers;
+    /** Number of signals received in the current batch */
+    unsigned ncalls;
 };
 
 /**
- * Init module state
+ * Init module state, creating the signalfd
  */
 int signal_init (void);
 
 /**
- * Register a signal handler
+ * Register a signal handler, blocking the signal for normal delivery
  *
  * @param state     structure to fill out and use for signal handling
  * @param signal    signal to handle
@@ -51,10 +55,23 @@ int signal_init (void);
 int signal_register (struct signal_handler *state, int signal, signal_func func, void *arg);
 
 /**
- * Scan for and run signal handlers.
- *
- * @return <0 if handler returns error, number of signals handled otherwise
+ * Add the signalfd to the given select loop, to run the signal handlers from
+ */
+int signal_loop_add (struct select_loop *loop);
+
+/**
+ * Ignore the given signal, such as SIGPIPE. The signal is reset to its default action in spawned child processes.
+ */
+int signal_ignore (int signal);
+
+/**
+ * Return the signal mask from before signal_init, for use in spawned child processes
+ */
+void signal_child_mask (sigset_t *mask);
+
+/**
+ * Return the set of signals that must be reset to their default action in spawned child processes
  */
-int signal_run (void);
+void signal_child_default (sigset_t *set);
 
 #endif
@@ -0,0 +1,221 @@
+#include "timer.h"
+
+#include <time.h>
+
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+
+/**
+ * Slot index of the given time at the given level
+ */
+static inline unsigned timer_slot_index (uint64_t time, unsigned level)
+{
+    return (time >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK;
+}
+
+uint64_t timer_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_init (struct timer *timer, timer_func_t func, void *arg)
+{
+    timer->expire = 0;
+    timer->func = func;
+    timer->arg = arg;
+    timer->pending = false;
+}
+
+void timer_wheel_init (struct timer_wheel *wheel, uint64_t now)
+{
+    unsigned level, slot;
+
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        wheel->slot_bitmap[level] = 0;
+
+        for (slot = 0; slot < TIMER_SLOTS; slot++)
+            LIST_INIT(&wheel->slots[level][slot]);
+    }
+}
+
+/**
+ * Place the timer into the level and slot for its expiry time, relative to the wheel's current time.
+ *
+ * The expiry time must not be before the current time.
+ */
+static void timer_wheel_insert (struct timer_wheel *wheel, struct timer *timer)
+{
+    uint64_t delta = timer->expire - wheel->now;
+    unsigned level;
+
+    // find the lowest level that covers it
+    for (level = 0; level < TIMER_LEVELS - 1; level++) {
+        if (delta < (1ULL << ((level + 1) * TIMER_SLOT_BITS)))
+            break;
+    }
+
+    // clamp to the range of the top level
+    if (delta >= (1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS)))
+        timer->expire = wheel->now + (1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1;
+
+    timer->level = level;
+    timer->slot = timer_slot_index(timer->expire, level);
+
+    LIST_INSERT_HEAD(&wheel->slots[level][timer->slot], timer, wheel_timers);
+
+    wheel->slot_bitmap[level] |= 1ULL << timer->slot;
+}
+
+/**
+ * Unlink the timer from its slot
+ */
+static void timer_wheel_remove (struct timer_wheel *wheel, struct timer *timer)
+{
+    LIST_REMOVE(timer, wheel_timers);
+
+    if (LIST_EMPTY(&wheel->slots[timer->level][timer->slot]))
+        wheel->slot_bitmap[timer->level] &= ~(1ULL << timer->slot);
+}
+
+void timer_wheel_add (struct timer_wheel *wheel, struct timer *timer, uint64_t expire)
+{
+    if (timer->pending)
+        timer_wheel_remove(wheel, timer);
+    else
+        wheel->count++;
+
+    // already expired timers run on the next tick
+    timer->expire = expire > wheel->now ? expire : wheel->now + 1;
+    timer->pending = true;
+
+    timer_wheel_insert(wheel, timer);
+}
+
+void timer_wheel_cancel (struct timer_wheel *wheel, struct timer *timer)
+{
+    if (!timer->pending)
+        return;
+
+    timer_wheel_remove(wheel, timer);
+
+    timer->pending = false;
+    wheel->count--;
+}
+
+/**
+ * Move all timers in the given slot down to the levels below it
+ */
+static void timer_wheel_cascade (struct timer_wheel *wheel, unsigned level, unsigned slot)
+{
+    struct timer_slot list;
+    struct timer *timer;
+
+    // take the whole slot
+    LIST_INIT(&list);
+
+    while ((timer = LIST_FIRST(&wheel->slots[level][slot])) != NULL) {
+        LIST_REMOVE(timer, wheel_timers);
+        LIST_INSERT_HEAD(&list, timer, wheel_timers);
+    }
+
+    wheel->slot_bitmap[level] &= ~(1ULL << slot);
+
+    // and re-insert
+    while ((timer = LIST_FIRST(&list)) != NULL) {
+        LIST_REMOVE(timer, wheel_timers);
+
+        timer_wheel_insert(wheel, timer);
+    }
+}
+
+bool timer_wheel_next (struct timer_wheel *wheel, uint64_t *next_ptr)
+{
+    uint64_t next = UINT64_MAX, time, bitmap;
+    unsigned level, shift, current, offset;
+
+    if (!wheel->count)
+        return false;
+
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        if (!(bitmap = wheel->slot_bitmap[level]))
+            continue;
+
+        shift = level * TIMER_SLOT_BITS;
+        current = timer_slot_index(wheel->now, level);
+
+        // first non-empty slot after the current one, wrapping around
+        bitmap = (bitmap >> current) | (current ? bitmap << (TIMER_SLOTS - current) : 0);
+        offset = __builtin_ctzll(bitmap);
+
+        if (level == 0) {
+            // exact expiry time
+            time = wheel->now + offset;
+
+        } else {
+            // the current slot is only cascaded on the next rotation
+            if (!offset)
+                offset = TIMER_SLOTS;
+
+            // time at which the slot is cascaded
+            time = ((wheel->now >> shift) + offset) << shift;
+        }
+
+        if (time < next)
+            next = time;
+    }
+
+    *next_ptr = next;
+
+    return true;
+}
+
+int timer_wheel_run (struct timer_wheel *wheel, uint64_t now)
+{
+    struct timer *timer;
+    uint64_t tick;
+    unsigned level, slot;
+    int ret, err = 0;
+
+    while (wheel->now < now) {
+        // skip over empty ticks in this rotation of the bottom level
+        if (!(wheel->slot_bitmap[0] >> timer_slot_index(wheel->now, 0) >> 1)) {
+            tick = wheel->now | TIMER_SLOT_MASK;
+
+            if (tick >= now) {
+                wheel->now = now;
+
+                break;
+            }
+
+            wheel->now = tick;
+        }
+
+        tick = ++wheel->now;
+
+        // cascade upper levels at the start of each rotation of the level below
+        for (level = 1; level < TIMER_LEVELS; level++) {
+            if (timer_slot_index(tick, level - 1))
+                break;
+
+            timer_wheel_cascade(wheel, level, timer_slot_index(tick, level));
+        }
+
+        // run timers in this slot
+        slot = timer_slot_index(tick, 0);
+
+        while ((timer = LIST_FIRST(&wheel->slots[0][slot])) != NULL) {
+            timer_wheel_cancel(wheel, timer);
+
+            if ((ret = timer->func(timer, timer->arg)) && !err)
+                err = ret;
+        }
+    }
+
+    return err;
+}
@@ -0,0 +1,127 @@
+#ifndef SHARED_TIMER_H
+#define SHARED_TIMER_H
+
+/**
+ * @file
+ *
+ * Hierarchical timer wheel.
+ *
+ * Timers are kept in TIMER_LEVELS levels of TIMER_SLOTS slots each, with each level covering TIMER_SLOTS times the
+ * range of the one below it, at a resolution of one millisecond. Adding and cancelling a timer is O(1), and timers are
+ * cascaded down a level at a time as their expiry time approaches, so the cost of each timer is bounded by the number
+ * of levels regardless of how many timers are pending.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/**
+ * Number of bits of the expiry time handled by each level, and the resulting number of slots per level
+ */
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+/**
+ * Number of levels, covering 2^36 ms, or about two years
+ */
+#define TIMER_LEVELS 6
+
+struct timer;
+
+/**
+ * Timer callback, called once the timer expires.
+ *
+ * The timer is no longer pending when this is called, and may be re-added from within the callback.
+ *
+ * @return zero on success, -1 on errno, >0 for app-specific return code
+ */
+typedef int (*timer_func_t) (struct timer *timer, void *arg);
+
+/**
+ * Per-timer state
+ */
+struct timer {
+    /** Absolute expiry time, in ms */
+    uint64_t expire;
+
+    /** Callback */
+    timer_func_t func;
+    void *arg;
+
+    /** Added to a wheel */
+    bool pending;
+
+    /** Position in the wheel */
+    uint8_t level, slot;
+
+    /** Our entry in the wheel slot */
+    LIST_ENTRY(timer) wheel_timers;
+};
+
+/**
+ * Timer wheel state
+ */
+struct timer_wheel {
+    /** Time up to which timers have been run, in ms */
+    uint64_t now;
+
+    /** Number of pending timers */
+    unsigned count;
+
+    /** Bitmap of non-empty slots for each level */
+    uint64_t slot_bitmap[TIMER_LEVELS];
+
+    /** Slots of timers */
+    LIST_HEAD(timer_slot, timer) slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/**
+ * Current CLOCK_MONOTONIC time in ms, as used for timer expiry times
+ */
+uint64_t timer_now (void);
+
+/**
+ * Set up timer values
+ */
+void timer_init (struct timer *timer, timer_func_t func, void *arg);
+
+/**
+ * Is the timer pending?
+ */
+static inline bool timer_pending (const struct timer *timer)
+{
+    return timer->pending;
+}
+
+/**
+ * Initialize the given timer wheel starting at the given time
+ */
+void timer_wheel_init (struct timer_wheel *wheel, uint64_t now);
+
+/**
+ * Add the given timer to expire at the given absolute time, re-scheduling it if already pending.
+ *
+ * Timers that have already expired will be run on the next timer_wheel_run.
+ */
+void timer_wheel_add (struct timer_wheel *wheel, struct timer *timer, uint64_t expire);
+
+/**
+ * Remove the given timer from the wheel, if pending
+ */
+void timer_wheel_cancel (struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * Return the time at which the wheel next needs to be run, which may be earlier than the next expiry time.
+ *
+ * @return false if there are no pending timers
+ */
+bool timer_wheel_next (struct timer_wheel *wheel, uint64_t *next_ptr);
+
+/**
+ * Run all timers that have expired by the given time.
+ *
+ * @return zero, or the first non-zero value returned by a timer callback
+ */
+int timer_wheel_run (struct timer_wheel *wheel, uint64_t now);
+
+#endif
@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+
+static int sys_io_uring_setup (unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register (int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Map one region of the ring fd
+ */
+static void *uring_mmap (struct uring *ring, size_t size, off_t offset)
+{
+    void *ptr;
+
+    if ((ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, offset)) == MAP_FAILED)
+        return NULL;
+
+    return ptr;
+}
+
+int uring_init (struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    unsigned i;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    // keep submitting past failed entries where supported
+    params.flags = IORING_SETUP_SUBMIT_ALL;
+
+    if ((ring->fd = sys_io_uring_setup(entries, &params)) < 0 && errno == EINVAL) {
+        params.flags = 0;
+
+        ring->fd = sys_io_uring_setup(entries, &params);
+    }
+
+    if (ring->fd < 0)
+        return -1;
+
+    // we need the timeout argument for uring_enter
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+
+        goto error;
+    }
+
+    // map rings
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+
+        ring->cq_ring_size = 0;
+    }
+
+    if ((ring->sq_ring = uring_mmap(ring, ring->sq_ring_size, IORING_OFF_SQ_RING)) == NULL)
+        goto error;
+
+    if (ring->cq_ring_size) {
+        if ((ring->cq_ring = uring_mmap(ring, ring->cq_ring_size, IORING_OFF_CQ_RING)) == NULL)
+            goto error;
+
+    } else {
+        ring->cq_ring = ring->sq_ring;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if ((ring->sqes = uring_mmap(ring, ring->sqes_size, IORING_OFF_SQES)) == NULL)
+        goto error;
+
+    // locate fields
+    ring->sq_head = ring->sq_ring + params.sq_off.head;
+    ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+    ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+    ring->sq_array = ring->sq_ring + params.sq_off.array;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->cq_head = ring->cq_ring + params.cq_off.head;
+    ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+    ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+    ring->cqes = ring->cq_ring + params.cq_off.cqes;
+
+    // fixed 1:1 mapping of ring slots to entries
+    for (i = 0; i < ring->sq_entries; i++)
+        ring->sq_array[i] = i;
+
+    // ok
+    return 0;
+
+error:
+    uring_destroy(ring);
+
+    return -1;
+}
+
+/**
+ * Number of entries queued locally but not yet seen by the kernel
+ */
+static unsigned uring_pending (struct uring *ring)
+{
+    return ring->sq_local_tail - *ring->sq_tail;
+}
+
+/**
+ * Publish our local tail to the kernel and enter
+ */
+static int uring_submit (struct uring *ring, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    unsigned to_submit = uring_pending(ring);
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    return sys_io_uring_enter(ring->fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+struct io_uring_sqe *uring_get_sqe (struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    // full?
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (uring_submit(ring, 0, 0, NULL, 0) < 0)
+            return NULL;
+    }
+
+    sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    ring->sq_local_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+int uring_enter (struct uring *ring, const struct timespec *ts)
+{
+    struct __kernel_timespec kts;
+    struct io_uring_getevents_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+
+    arg.sigmask_sz = _NSIG / 8;
+
+    if (ts) {
+        kts.tv_sec = ts->tv_sec;
+        kts.tv_nsec = ts->tv_nsec;
+
+        arg.ts = (uintptr_t) &kts;
+    }
+
+    // completions already waiting?
+    if (__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != *ring->cq_head) {
+        if (uring_pending(ring) && uring_submit(ring, 0, 0, NULL, 0) < 0)
+            return -1;
+
+    } else if (uring_submit(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0) {
+        if (errno == ETIME)
+            // timeout
+            return 0;
+
+        return -1;
+    }
+
+    return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
+
+unsigned uring_reap (struct uring *ring, struct io_uring_cqe *cqes, unsigned max)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+
+    while (head != tail && count < max)
+        cqes[count++] = ring->cqes[head++ & *ring->cq_mask];
+
+    // release slots back to kernel
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+void uring_destroy (struct uring *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+
+    if (ring->fd >= 0)
+        close(ring->fd);
+
+    ring->fd = -1;
+    ring->sqes = NULL;
+    ring->sq_ring = ring->cq_ring = NULL;
+}
+
+bool uring_supported (struct uring *ring, unsigned op)
+{
+    struct io_uring_probe *probe;
+    size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    bool supported = false;
+
+    if ((probe = calloc(1, size)) == NULL)
+        return false;
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 && op <= probe->last_op && op < probe->ops_len)
+        supported = probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+
+    free(probe);
+
+    return supported;
+}
+
+int uring_bufs_init (struct uring *ring, struct uring_bufs *bufs, unsigned short group, unsigned count, size_t size)
+{
+    struct io_uring_buf_reg reg;
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+    unsigned i;
+
+    memset(bufs, 0, sizeof(*bufs));
+
+    bufs->group = group;
+    bufs->count = count;
+    bufs->size = size;
+
+    // the shared ring must be page-aligned
+    if ((bufs->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        bufs->ring = NULL;
+
+        return -1;
+    }
+
+    if ((bufs->bufs = malloc(count * size)) == NULL)
+        goto error;
+
+    memset(&reg, 0, sizeof(reg));
+
+    reg.ring_addr = (uintptr_t) bufs->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto error;
+
+    // all available
+    for (i = 0; i < count; i++)
+        uring_bufs_put(bufs, i);
+
+    uring_bufs_flush(bufs);
+
+    return 0;
+
+error:
+    munmap(bufs->ring, ring_size);
+    free(bufs->bufs);
+
+    bufs->ring = NULL;
+    bufs->bufs = NULL;
+
+    return -1;
+}
+
+void uring_bufs_put (struct uring_bufs *bufs, unsigned short bid)
+{
+    struct io_uring_buf *buf = &bufs->ring->bufs[bufs->tail & (bufs->count - 1)];
+
+    buf->addr = (uintptr_t) uring_bufs_get(bufs, bid);
+    buf->len = bufs->size;
+    buf->bid = bid;
+
+    bufs->tail++;
+}
+
+bool uring_bufs_flush (struct uring_bufs *bufs)
+{
+    if (bufs->ring->tail == bufs->tail)
+        return false;
+
+    __atomic_store_n(&bufs->ring->tail, bufs->tail, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void uring_bufs_destroy (struct uring *ring, struct uring_bufs *bufs)
+{
+    struct io_uring_buf_reg reg;
+
+    if (!bufs->ring)
+        return;
+
+    memset(&reg, 0, sizeof(reg));
+
+    reg.bgid = bufs->group;
+
+    sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+    munmap(bufs->ring, bufs->count * sizeof(struct io_uring_buf));
+    free(bufs->bufs);
+
+    bufs->ring = NULL;
+    bufs->bufs = NULL;
+}
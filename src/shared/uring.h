@@ -0,0 +1,136 @@
+#ifndef SHARED_URING_H
+#define SHARED_URING_H
+
+/**
+ * @file
+ *
+ * Minimal io_uring ring handling using the raw system calls, for use by the select loop.
+ *
+ * Submissions are queued locally using uring_get_sqe, and only passed to the kernel on the next uring_enter, so that
+ * any number of requests queued during one loop iteration cost a single system call.
+ */
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * Per-ring state
+ */
+struct uring {
+    /** The io_uring fd */
+    int fd;
+
+    /** Submission queue ring */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+
+    /** Submission queue entries */
+    struct io_uring_sqe *sqes;
+
+    /** Our local tail, ahead of *sq_tail by the number of not-yet-submitted entries */
+    unsigned sq_local_tail;
+
+    /** Completion queue ring */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /** mmap'd regions */
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/**
+ * Ring of buffers provided to the kernel, from which requests using IOSQE_BUFFER_SELECT pick a buffer to receive into
+ */
+struct uring_bufs {
+    /** Shared ring of buffers available to the kernel, and our local tail, ahead of the shared one by any buffers put
+     * back since the last uring_bufs_flush */
+    struct io_uring_buf_ring *ring;
+    unsigned short tail;
+
+    /** Buffer group ID used in requests */
+    unsigned short group;
+
+    /** Number of buffers, which must be a power of two, and the size of each */
+    unsigned count;
+    size_t size;
+
+    /** The buffers themselves */
+    char *bufs;
+};
+
+/**
+ * Set up the given ring with the given number of submission entries.
+ *
+ * This requires the IORING_FEAT_EXT_ARG feature (Linux 5.11) for timeouts, and fails with ENOSYS otherwise.
+ */
+int uring_init (struct uring *ring, unsigned entries);
+
+/**
+ * Return a cleared submission queue entry to fill in, or NULL on error.
+ *
+ * If the submission queue is full, the pending entries are first submitted to the kernel.
+ */
+struct io_uring_sqe *uring_get_sqe (struct uring *ring);
+
+/**
+ * Submit any pending entries, and wait for at least one completion, or until the given timeout expires.
+ *
+ * @param ts    timeout, or NULL to wait indefinitely
+ * @return number of completions available, zero on timeout, <0 on errno (EINTR)
+ */
+int uring_enter (struct uring *ring, const struct timespec *ts);
+
+/**
+ * Copy out up to max completed entries into the given array, consuming them from the ring.
+ *
+ * @return number of entries copied
+ */
+unsigned uring_reap (struct uring *ring, struct io_uring_cqe *cqes, unsigned max);
+
+/**
+ * Release the ring
+ */
+void uring_destroy (struct uring *ring);
+
+/**
+ * Does the kernel support the given IORING_OP_* opcode?
+ */
+bool uring_supported (struct uring *ring, unsigned op);
+
+/**
+ * Allocate the given number of buffers of the given size, and register them with the ring as the given buffer group,
+ * all of them initially available to the kernel.
+ *
+ * This requires Linux 5.19, and fails with EINVAL otherwise.
+ */
+int uring_bufs_init (struct uring *ring, struct uring_bufs *bufs, unsigned short group, unsigned count, size_t size);
+
+/**
+ * Return the buffer that a completion with IORING_CQE_F_BUFFER received into
+ */
+static inline char *uring_bufs_get (struct uring_bufs *bufs, unsigned short bid)
+{
+    return bufs->bufs + (size_t) bid * bufs->size;
+}
+
+/**
+ * Give the given buffer back to the kernel once done with its contents. The kernel does not see it until the next
+ * uring_bufs_flush.
+ */
+void uring_bufs_put (struct uring_bufs *bufs, unsigned short bid);
+
+/**
+ * Make any buffers put back since the last flush available to the kernel again.
+ *
+ * Returns true if there were any.
+ */
+bool uring_bufs_flush (struct uring_bufs *bufs);
+
+/**
+ * Unregister and release the buffers, if set up
+ */
+void uring_bufs_destroy (struct uring *ring, struct uring_bufs *bufs);
+
+#endif
@@ -1,9 +1,13 @@
+#define _GNU_SOURCE
 #include "util.h"
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 
 /**
  * Identify pipe ends
@@ -14,14 +18,14 @@ enum pipe_end {
 };
 
 /**
- * Construct a pipe, returning the read end of the pipe via *fd_read, and the write end via *fd_write.
+ * Construct a close-on-exec pipe, returning the read end of the pipe via *fd_read, and the write end via *fd_write.
  */
 int make_pipe (int *fd_read, int *fd_write)
 {
     int fds[2];
 
-    // make pipes
-    if (pipe(fds) < 0)
+    // make pipes, which must not be inherited by any other process forked in the meantime
+    if (pipe2(fds, O_CLOEXEC) < 0)
         return -1;
 
     // set
@@ -81,3 +85,35 @@ char *strfmt (const char *fmt, ...)
     // ok
     return buf;
 }
+
+int parse_host_port (char *str, const char **host_ptr, const char **port_ptr)
+{
+    char *sep;
+
+    if (!(sep = strrchr(str, ':'))) {
+        // port only
+        *host_ptr = NULL;
+        *port_ptr = str;
+
+        return 0;
+    }
+
+    *sep = '\0';
+    *port_ptr = sep + 1;
+
+    if (str[0] == '[') {
+        // strip brackets around IPv6 address
+        if (sep == str + 1 || sep[-1] != ']') {
+            errno = EINVAL;
+
+            return -1;
+        }
+
+        sep[-1] = '\0';
+        str++;
+    }
+
+    *host_ptr = *str ? str : NULL;
+
+    return 0;
+}
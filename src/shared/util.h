@@ -8,7 +8,7 @@
 #include <fcntl.h>
 
 /**
- * Construct a pipe, returning the read end of the pipe via *fd_read, and the write end via *fd_write.
+ * Construct a close-on-exec pipe, returning the read end of the pipe via *fd_read, and the write end via *fd_write.
  */
 int make_pipe (int *fd_read, int *fd_write);
 
@@ -22,4 +22,11 @@ int fd_flags (int fd, int set_flags);
  */
 char *strfmt (const char *fmt, ...);
 
+/**
+ * Split the given [HOST:]PORT string in place, returning pointers to the host, or NULL if not given, and the port.
+ *
+ * An IPv6 host may be given in brackets, as in [::1]:PORT.
+ */
+int parse_host_port (char *str, const char **host_ptr, const char **port_ptr);
+
 #endif